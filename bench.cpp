@@ -0,0 +1,360 @@
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <unistd.h>
+
+#include "convert_machine.hpp"
+#include "optimise.hpp"
+#include "register_convert.hpp"
+#include "register_machine.hpp"
+#include "stack_machine.hpp"
+#include "util.hpp"
+
+log_level_t GLOBAL_LOG_LEVEL = LOG_NOTHING;
+
+/* Straight line code using a spread of ops and addressing modes */
+dcpu16::program generate_program(size_t length)
+{
+	static const std::vector<dcpu16::op_t> OPS {
+		dcpu16::op_t::SET, dcpu16::op_t::ADD, dcpu16::op_t::SUB, dcpu16::op_t::MUL,
+		dcpu16::op_t::AND, dcpu16::op_t::XOR, dcpu16::op_t::SHL, dcpu16::op_t::IFN,
+		dcpu16::op_t::IFG, dcpu16::op_t::OUT,
+	};
+	static const std::vector<std::string> MEM {"[0x3000+I]", "[J+0x3000]", "[0x2fff]", "[A]"};
+	std::mt19937 rng(42);
+	auto operand = [&rng](bool dest) -> dcpu16::operand_t {
+		switch (rng() % (dest ? 3 : 4)) {
+			case 0:
+			case 1: return static_cast<dcpu16::reg_t>(rng() % 8);
+			case 2: return dcpu16::get_operand(MEM[rng() % MEM.size()]);
+			default: return static_cast<uint16_t>(rng() % 0x100);
+		}
+	};
+
+	dcpu16::program prog;
+	for (size_t i = 0; i < length; i++) {
+		dcpu16::instruction ins;
+		ins.code = OPS[rng() % OPS.size()];
+		ins.b = operand(true);
+		if (ins.code != dcpu16::op_t::OUT) ins.a = operand(false);
+		if (i % 8 == 0) ins.label = "L" + std::to_string(i);
+		prog.push_back(ins);
+	}
+	return prog;
+}
+
+/**
+ * Register assembly source of about the given size, with the labels,
+ * comments, blank lines and literal forms the lexer has to deal with. The
+ * last line has no newline after it.
+ */
+std::string generate_dcpu_source(size_t bytes)
+{
+	static const std::vector<std::string> REGS {"A", "B", "C", "X", "Y", "Z", "I", "J"};
+	std::mt19937 rng(7);
+	std::string source;
+	source.reserve(bytes + 64);
+	for (size_t i = 0; source.size() < bytes; i++) {
+		size_t kind = rng() % 6;
+		if (i % 8 == 0 && kind != 4) source += string_format(":L%zu ", i);
+		const std::string &r = REGS[rng() % REGS.size()];
+		switch (kind) {
+			case 0: source += string_format("SET %s, 0x%04x\n", r.c_str(), rng() % 0x10000); break;
+			case 1: source += string_format("ADD [0x3000+%s], %u ; comment\n", r.c_str(), rng() % 1000); break;
+			case 2: source += string_format("\tIFN %s, [0x2fff]\n", r.c_str()); break;
+			case 3: source += string_format("SET PC, L%zu\n", i / 8 * 8); break;
+			case 4: source += "; just a comment\n\n"; break;
+			default: source += string_format("OUT %s\n", r.c_str()); break;
+		}
+	}
+	source += "OUT A";
+	return source;
+}
+
+/* J5 assembly source of about the given size, the same idea */
+std::string generate_j5_source(size_t bytes)
+{
+	std::mt19937 rng(7);
+	std::string source;
+	source.reserve(bytes + 64);
+	for (size_t i = 0; source.size() < bytes; i++) {
+		size_t kind = rng() % 5;
+		if (i % 8 == 0 && kind != 3) source += string_format("L%zu: ", i);
+		switch (kind) {
+			case 0: source += string_format("SET %04xh\n", rng() % 0x10000); break;
+			case 1: source += string_format("SET %u ; comment\n", rng() % 0x10000); break;
+			case 2: source += string_format("BRZERO L%zu\n", i / 8 * 8); break;
+			case 3: source += "\n"; break;
+			default: source += "LOAD\n"; break;
+		}
+	}
+	source += "STOP";
+	return source;
+}
+
+/* How long to spend on each benchmark */
+struct bench_options {
+	std::chrono::duration<double> warmup{0.1};
+	std::chrono::duration<double> min_time{0.5};
+	size_t min_samples = 5;
+	std::chrono::duration<double> min_sample{0.001}; ///< Shorter runs are timed in batches of at least this
+};
+
+/* Timings of one benchmark, in seconds per run */
+struct result {
+	std::string name;
+	size_t runs;
+	size_t samples;
+	double min, median, mean, stddev;
+	double work; ///< Units of work done by each run, for throughput
+	std::string unit;
+};
+
+/* Keeps the compiler from dropping a result nothing else uses */
+template<typename T>
+void keep(const T &value)
+{
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+/* Throws away what the machines print while they're being timed */
+class quiet_cout {
+public:
+	quiet_cout() : old(std::cout.rdbuf(nullptr)) {}
+	~quiet_cout()
+	{
+		std::cout.rdbuf(this->old);
+		std::cout.clear();
+	}
+private:
+	std::streambuf *old;
+};
+
+/**
+ * Times f, after running it for the warm up time, until there are both
+ * min_samples timings and min_time has passed. Each timing is of a batch
+ * of runs, however many make up min_sample going by the warm up.
+ * @param work Units of work f does each run.
+ * @param unit What the work is counted in.
+ * @return Summary of the run times.
+ */
+template<typename F>
+result measure(const std::string &name, F f, double work, const std::string &unit, const bench_options &opts)
+{
+	using clock = std::chrono::steady_clock;
+	quiet_cout quiet;
+	auto start = clock::now();
+	size_t warm_runs = 0;
+	do {
+		f();
+		warm_runs++;
+	} while (clock::now() - start < opts.warmup);
+	std::chrono::duration<double> per_run = (clock::now() - start) / warm_runs;
+	size_t batch = std::max<size_t>(1, opts.min_sample / per_run);
+
+	std::vector<double> samples;
+	start = clock::now();
+	while (samples.size() < opts.min_samples || clock::now() - start < opts.min_time) {
+		auto before = clock::now();
+		for (size_t i = 0; i < batch; i++) f();
+		samples.push_back(std::chrono::duration<double>(clock::now() - before).count() / batch);
+	}
+
+	std::sort(samples.begin(), samples.end());
+	size_t n = samples.size();
+	result r{name, n * batch, n, samples.front(), 0, 0, 0, work, unit};
+	r.median = n % 2 == 1 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+	r.mean = std::accumulate(samples.begin(), samples.end(), 0.0) / n;
+	double sq = 0;
+	for (double s : samples) sq += (s - r.mean) * (s - r.mean);
+	r.stddev = n > 1 ? std::sqrt(sq / (n - 1)) : 0;
+	return r;
+}
+
+void print_result(const result &r)
+{
+	std::cout << string_format("%-48s %10.4f ms +-%5.1f%%  min %10.4f ms  %7zu runs  %10.4g %s/s\n",
+			r.name.c_str(), r.median * 1e3, 100 * r.stddev / r.mean, r.min * 1e3, r.runs,
+			r.work / r.median, r.unit.c_str());
+}
+
+std::string json_string(const std::string &s)
+{
+	std::string out = "\"";
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (static_cast<unsigned char>(c) < 0x20) {
+			out += string_format("\\u%04x", c);
+		} else {
+			out += c;
+		}
+	}
+	return out + '"';
+}
+
+/**
+ * Writes results as JSON, one object per benchmark keyed by name, for
+ * comparing runs from different commits (see bench_compare.py).
+ */
+void write_json(const std::string &path, const std::vector<result> &results)
+{
+	std::ofstream out(path);
+	if (!out) throw "Error opening " + path;
+	out << "{\n\t\"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		const result &r = results[i];
+		out << "\t\t{\"name\": " << json_string(r.name) << string_format(", \"runs\": %zu, \"samples\": %zu, \"min\": %.9g, "
+				"\"median\": %.9g, \"mean\": %.9g, \"stddev\": %.9g, \"work\": %.9g, \"unit\": ",
+				r.runs, r.samples, r.min, r.median, r.mean, r.stddev, r.work) << json_string(r.unit) << '}'
+			<< (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	out << "\t]\n}\n";
+}
+
+/* A register program split into blocks the way convertmachine does */
+struct workload {
+	std::string name;
+	dcpu16::program prog;
+	std::vector<std::pair<size_t, size_t>> blocks;
+	bool runnable; ///< Whether it runs the same on every machine, generated code doesn't
+};
+
+workload make_workload(const std::string &name, dcpu16::program prog, bool runnable)
+{
+	workload w{name, std::move(prog), {}, runnable};
+	for (size_t pc = 0; pc < w.prog.size();) {
+		size_t end = block_end(w.prog, pc);
+		w.blocks.emplace_back(pc, end);
+		pc = end;
+	}
+	return w;
+}
+
+/* Times each stage of conversion on its own, then running and converting the whole program */
+void bench_workload(const workload &w, const bench_options &opts, std::vector<result> &results)
+{
+	auto run = [&](const std::string &name, auto f, double work, const std::string &unit) {
+		results.push_back(measure(name, f, work, unit, opts));
+		print_result(results.back());
+	};
+	double instructions = w.prog.size();
+
+	for (size_t stack_regs : {0, 2}) {
+		convert_options opts;
+		opts.stack_regs = stack_regs;
+		run("convert/" + w.name + "/regs=" + std::to_string(stack_regs), [&w, &opts] {
+			for (const auto &b : w.blocks) {
+				keep(convert_instructions(w.prog.begin() + b.first, w.prog.begin() + b.second, opts));
+			}
+		}, instructions, "ins");
+	}
+
+	std::vector<j5::program> lowered, optimised;
+	for (const auto &b : w.blocks) {
+		lowered.push_back(convert_instructions(w.prog.begin() + b.first, w.prog.begin() + b.second));
+		optimised.push_back(peephole_optimise(lowered.back()));
+	}
+	auto count = [](const std::vector<j5::program> &blocks) {
+		return std::accumulate(blocks.begin(), blocks.end(), 0.0, [](double n, const j5::program &p) {
+			return n + p.size();
+		});
+	};
+	run("peephole/" + w.name, [&lowered] {
+		for (const auto &p : lowered) keep(peephole_optimise(p));
+	}, count(lowered), "ins");
+	run("schedule/" + w.name, [&optimised] {
+		for (const auto &p : optimised) keep(stack_schedule(p));
+	}, count(optimised), "ins");
+	if (!w.runnable) return;
+
+	dcpu16::machine reg;
+	run("run/dcpu16/" + w.name, [&w, &reg] {
+		reg.run(w.prog, false);
+	}, 1, "run");
+	j5::program stack = reg2stack(w.prog);
+	j5::machine j5;
+	run("run/j5/" + w.name, [&stack, &j5] {
+		j5.run(stack, false);
+	}, 1, "run");
+	for (size_t optimise : {0, 2}) {
+		run("run_reg/" + w.name + "/o" + std::to_string(optimise), [&w, optimise] {
+			auto mach = std::make_unique<convertmachine>();
+			mach->run_reg(w.prog, false, optimise, true);
+		}, 1, "run");
+	}
+}
+
+void print_usage(const char *arg0)
+{
+	std::cerr << "Usage: " << arg0 << " [-o results.json] [-t seconds] [file...]\n"
+		"Times each stage of the pipeline on generated programs and on the files given\n"
+		"-o file    -  Also write the results to file as JSON\n"
+		"-t seconds -  Time to spend on each benchmark (default 0.5)\n";
+}
+
+int main(int argc, char **argv)
+{
+	bench_options opts;
+	std::string json_path;
+	int c = 0;
+	while ((c = getopt(argc, argv, "ho:t:")) != -1) {
+		switch (c) {
+			case 'o':
+				json_path = optarg;
+				break;
+			case 't':
+				opts.min_time = std::chrono::duration<double>(atof(optarg));
+				opts.warmup = opts.min_time / 5;
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	try {
+		std::vector<result> results;
+
+		static const size_t SOURCE_BYTES = 4 << 20;
+		const std::string dcpu_source = generate_dcpu_source(SOURCE_BYTES);
+		const std::string j5_source = generate_j5_source(SOURCE_BYTES);
+		size_t cores = std::max(1u, std::thread::hardware_concurrency());
+		for (size_t threads : {(size_t)1, cores}) {
+			results.push_back(measure("tokenise/dcpu16/threads=" + std::to_string(threads), [&dcpu_source, threads] {
+				keep(dcpu16::tokenise_source(dcpu_source, threads));
+			}, SOURCE_BYTES, "B", opts));
+			print_result(results.back());
+			results.push_back(measure("tokenise/j5/threads=" + std::to_string(threads), [&j5_source, threads] {
+				keep(j5::tokenise_source(j5_source, threads));
+			}, SOURCE_BYTES, "B", opts));
+			print_result(results.back());
+			if (cores == 1) break;
+		}
+
+		std::vector<workload> workloads;
+		workloads.push_back(make_workload("generated", generate_program(10000), false));
+		for (int i = optind; i < argc; i++) {
+			mapped_file file(argv[i]);
+			workloads.push_back(make_workload(argv[i], dcpu16::tokenise_source(file.text()), true));
+		}
+		for (const auto &w : workloads) bench_workload(w, opts, results);
+
+		if (!json_path.empty()) write_json(json_path, results);
+	} catch (const char *e) {
+		std::cerr << e << '\n';
+		return 1;
+	} catch (const std::string &e) {
+		std::cerr << e << '\n';
+		return 1;
+	}
+}
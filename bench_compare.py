@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+"""Compares two results files from reg2stack_bench -o.
+
+Prints the change in median time of each benchmark in both, marking those
+that moved by more than their spread.
+"""
+
+import json
+import sys
+
+
+def load(path):
+    """Reads a results file into a dict of benchmarks by name
+    """
+    with open(path) as f:
+        return {b['name']: b for b in json.load(f)['benchmarks']}
+
+
+def noise(b):
+    """Relative spread of a benchmark's run times
+    """
+    return b['stddev'] / b['mean'] if b['mean'] > 0 else 0
+
+
+def main():
+    if len(sys.argv) != 3:
+        print('Usage:', sys.argv[0], 'old.json new.json')
+        sys.exit(1)
+
+    old = load(sys.argv[1])
+    new = load(sys.argv[2])
+    for name, b in new.items():
+        if name not in old:
+            print('{:48} {:>10.3f} ms  (new)'.format(name, b['median'] * 1e3))
+            continue
+        a = old[name]
+        change = (b['median'] - a['median']) / a['median']
+        mark = ''
+        if abs(change) > max(noise(a), noise(b)):
+            mark = 'slower' if change > 0 else 'faster'
+        print('{:48} {:>10.3f} -> {:>10.3f} ms {:>+7.1f}%  {}'.format(
+            name, a['median'] * 1e3, b['median'] * 1e3, 100 * change, mark))
+    for name in old:
+        if name not in new:
+            print('{:48} (gone)'.format(name))
+
+
+main()
@@ -1,130 +1,638 @@
+#include <array>
+#include <cstdint>
 #include <iostream>
+#include <sstream>
 #include <thread>
 
 #include "convert_machine.hpp"
 #include "optimise.hpp"
+#include "perf_counters.hpp"
+#include "profile.hpp"
+#include "sampler.hpp"
 #include "register_convert.hpp"
 #include "util.hpp"
 
+/* How many DCPU registers to keep on the stack within a block. The J5 stack
+ * operations only reach 3 deep, so any more would rarely be accessible */
+static const size_t STACK_REGS = 2;
+
+/* Rough estimate of how much memory a translated snippet holds on to */
+static size_t snippet_size(const j5::program &snippet)
+{
+	/* Labels are symbols, their names are only held once in the pool */
+	return sizeof(j5::program) + snippet.capacity() * sizeof(j5::instruction);
+}
+
+/**
+ * Finds the end of the block starting at reg_pc, which is the next label.
+ * @return Index of the first instruction after the block.
+ */
+size_t block_end(const dcpu16::program &prog, size_t reg_pc)
+{
+	auto next_label = std::find_if(
+		prog.begin() + reg_pc + 1,
+		prog.end(),
+		[](const dcpu16::instruction &i){return !i.label.empty();}
+	);
+	/* The branch for a conditional has to land in the same snippet, so the
+	 * instruction it skips comes along even if it is labelled */
+	while (next_label != prog.end()
+			&& (next_label - 1)->code >= dcpu16::op_t::IFB && (next_label - 1)->code <= dcpu16::op_t::IFU) {
+		++next_label;
+	}
+	return std::distance(prog.begin(), next_label);
+}
+
+/* A way of converting a block into J5 code */
+struct lowering {
+	bool dataflow;
+	size_t stack_regs;
+};
+
+/* The lowerings -o3 chooses between */
+static const std::array<lowering, 6> LOWERINGS{{
+	{true, STACK_REGS}, {true, 1}, {true, 0},
+	{false, STACK_REGS}, {false, 1}, {false, 0},
+}};
+
+/* Orders of passes run after lowering, P for peephole, S for stack scheduling.
+ * The first three are what levels 0 - 2 do, -o3 tries them all */
+static const std::array<const char *, 9> ORDERINGS{{"", "P", "PSP", "S", "PS", "SP", "SPS", "PSPS", "SPSP"}};
+
+static j5::program run_passes(j5::program prog, const char *order)
+{
+	for (const char *pass = order; *pass != '\0'; pass++) {
+		prog = *pass == 'P' ? peephole_optimise(std::move(prog)) : stack_schedule(std::move(prog));
+	}
+	return prog;
+}
+
+/* Converts a block, then drops dead register writes if live is given */
+static j5::program lower_block(const dcpu16::program &prog, size_t begin, size_t end, const lowering &how,
+		const liveness::analysis *live, const exit_layouts &exits, std::vector<dcpu16::reg_t> *regs,
+		const loop_stack_regs *loop = nullptr)
+{
+	convert_options opts;
+	opts.stack_regs = how.stack_regs;
+	opts.use_dataflow = how.dataflow;
+	opts.exits = exits;
+	opts.live = live != nullptr ? &live->after()[begin] : nullptr;
+	opts.loop = loop;
+	opts.first_pc = begin;
+	j5::program snippet = convert_instructions(prog.begin() + begin, prog.begin() + end, opts, regs);
+	if (live != nullptr) {
+		snippet = liveness::eliminate_dead_stores(std::move(snippet), [live, end](symbol label) {
+			return label.empty() ? live->before(end) : live->at(label);
+		});
+	}
+	return snippet;
+}
+
+/**
+ * Estimated cost of running a block once. A block that loops back to itself
+ * goes round from its warm entry, so its stack register loads only happen
+ * once and are left out.
+ * @param in_loop Whether the block shares its loop's stack registers, so
+ *                that it is usually entered warm too.
+ */
+static size_t estimate_cost(const j5::program &snippet, bool in_loop)
+{
+	const cost_model &costs = cost_table();
+	symbol own_label = snippet.empty() ? symbol() : snippet.front().label;
+	bool loops = !own_label.empty() && std::any_of(snippet.begin(), snippet.end(), [own_label](const j5::instruction &i) {
+		return (i.code == j5::op_t::BRANCH || i.code == j5::op_t::BRZERO)
+			&& i.op.which() == 2 && boost::get<symbol>(i.op) == own_label;
+	});
+	auto warm = std::find_if(snippet.begin(), snippet.end(), [](const j5::instruction &i) {
+		return i.code == j5::op_t::LABEL && i.label == WARM_ENTRY;
+	});
+	size_t total = 0;
+	for (auto it = (loops || in_loop) && warm != snippet.end() ? warm : snippet.begin(); it != snippet.end(); ++it) {
+		if (it->code != j5::op_t::LABEL) total += costs.cost(it->code);
+	}
+	return total;
+}
+
+/**
+ * Level 3: tries every lowering with every pass ordering and keeps the
+ * cheapest code by the cost table (see estimate_cost). Blocks going to this
+ * one need to know its stack registers without knowing where it goes, so the
+ * lowering, and with it the stack registers, is picked as though every exit
+ * spilt them. Only the ordering is then picked with the real exits, keeping
+ * level 2's unless another beats it. Blocks in a loop only try lowerings
+ * that can keep the loop's stack registers, leaving any of them out would
+ * spill on the way round.
+ */
+static j5::program search_block(const dcpu16::program &prog, size_t begin, size_t end,
+		const liveness::analysis *live, const exit_layouts &exits, std::vector<dcpu16::reg_t> *regs,
+		const loop_stack_regs *loop)
+{
+	const exit_layouts spill = [](symbol){return std::vector<dcpu16::reg_t>();};
+	const bool in_loop = loop != nullptr && !loop->regs.empty();
+
+	size_t best_cost = SIZE_MAX;
+	const lowering *how = nullptr;
+	for (const auto &l : LOWERINGS) {
+		if (in_loop && l.stack_regs < loop->regs.size()) continue;
+		j5::program lowered = lower_block(prog, begin, end, l, live, spill, nullptr, loop);
+		for (auto order : ORDERINGS) {
+			size_t c = estimate_cost(run_passes(lowered, order), in_loop);
+			if (c < best_cost) {
+				best_cost = c;
+				how = &l;
+			}
+		}
+	}
+
+	j5::program lowered = lower_block(prog, begin, end, *how, live, exits ? exits : spill, regs, loop);
+	const char *best_order = ORDERINGS[2];
+	j5::program best = run_passes(lowered, best_order);
+	best_cost = estimate_cost(best, in_loop);
+	for (auto order : ORDERINGS) {
+		j5::program snippet = run_passes(lowered, order);
+		size_t c = estimate_cost(snippet, in_loop);
+		if (c < best_cost) {
+			best_cost = c;
+			best = std::move(snippet);
+			best_order = order;
+		}
+	}
+	log<LOG_DEBUG>("# ", prog.at(begin), ": cost ", best_cost, " (", how->dataflow ? "dataflow" : "direct", ", ",
+			how->stack_regs, " stack registers, passes '", best_order, "')");
+	return best;
+}
+
+/**
+ * Converts a block and optimises it as the given level does. Branches
+ * within the block are left going to local labels, for layout_branches.
+ * @param live Register liveness for prog, to drop dead register writes.
+ * @param exits Stack registers of the blocks it goes to, see convert_options.
+ * @param regs Set to the block's own stack registers, if not null.
+ * @param loop Stack registers shared by the loop the block is in, if any.
+ */
+j5::program translate_block(const dcpu16::program &prog, size_t begin, size_t end, size_t optimise,
+		const liveness::analysis *live, const exit_layouts &exits, std::vector<dcpu16::reg_t> *regs,
+		const loop_stack_regs *loop)
+{
+	if (optimise >= 3) return search_block(prog, begin, end, live, exits, regs, loop);
+
+	lowering how = {optimise >= 1, optimise >= 1 ? STACK_REGS : 0};
+	j5::program snippet = lower_block(prog, begin, end, how, optimise >= 1 ? live : nullptr, exits, regs, loop);
+	return run_passes(std::move(snippet), ORDERINGS[optimise]);
+}
+
+/* Drop least recently used snippets until the cache fits in its budget.
+ * The snippet at keep is never evicted, even if it alone is over budget */
+void convertmachine::evict_snippets(uint16_t keep)
+{
+	if (this->cache_budget == 0) return;
+	while (this->cache_size > this->cache_budget && this->cache_lru.back() != keep) {
+		auto victim = this->section_cache.find(this->cache_lru.back());
+		log<LOG_DEBUG2>("# Evicting ", this->reg_prog.at(victim->first), " (", victim->second.size, " bytes)");
+		this->cache_size -= victim->second.size;
+		this->cache_lru.pop_back();
+		this->section_cache.erase(victim);
+		this->stats.evictions++;
+	}
+}
+
+/**
+ * Stack registers of the block starting at reg_pc, bottom first. A block
+ * going to it can leave them on the stack rather than spill them, for it to
+ * take up from its warm entry.
+ */
+const std::vector<dcpu16::reg_t> &convertmachine::layout(uint16_t reg_pc)
+{
+	auto it = this->layouts.find(reg_pc);
+	if (it != this->layouts.end()) return it->second;
+
+	auto &regs = this->layouts[reg_pc];
+	if (this->read_block(reg_pc)) {
+		translate_block(this->reg_prog, reg_pc, block_end(this->reg_prog, reg_pc), this->optimise,
+				this->streaming ? nullptr : &this->live_regs,
+				[](symbol){return std::vector<dcpu16::reg_t>();}, &regs, this->loop_layout(reg_pc));
+	}
+	auto cached = this->section_cache.find(reg_pc);
+	if (cached != this->section_cache.end()) this->check_layout(reg_pc, cached->second.regs);
+	return regs;
+}
+
+/**
+ * Throws unless the stack registers a block was translated with are those
+ * blocks going to it were told it has, as they'd be left the wrong values.
+ */
+void convertmachine::check_layout(uint16_t reg_pc, const std::vector<dcpu16::reg_t> &regs) const
+{
+	auto told = this->layouts.find(reg_pc);
+	if (told == this->layouts.end() || told->second == regs) return;
+	auto names = [](const std::vector<dcpu16::reg_t> &rs) {
+		std::ostringstream ss;
+		ss << '(';
+		for (size_t i = 0; i < rs.size(); i++) ss << (i == 0 ? "" : ", ") << rs[i];
+		ss << ')';
+		return ss.str();
+	};
+	std::ostringstream ss;
+	ss << "Block " << this->reg_prog.at(reg_pc) << " keeps stack registers " << names(regs)
+		<< ", but blocks going to it expect " << names(told->second);
+	throw ss.str();
+}
+
+/**
+ * Stack registers shared by every block of the innermost loop around reg_pc,
+ * null outside loops or below level 2. They are loaded by whichever block
+ * the loop is entered at and then stay on the stack all the way round, so
+ * registers the loop only reads (its bounds and bases) are loaded once
+ * rather than every time round. The registers the loop's code goes to
+ * memory for most are chosen, those it never writes first on a tie as they
+ * never need writing back. A register used to index memory can then be
+ * kept with the base it indexes from added (see loop_stack_regs), if that
+ * makes the loop cheaper.
+ */
+const loop_stack_regs *convertmachine::loop_layout(uint16_t reg_pc)
+{
+	if (this->optimise < 2 || this->streaming) return nullptr;
+	const loops::loop *l = loops::innermost(this->loops_found, reg_pc);
+	if (l == nullptr) return nullptr;
+	auto it = this->loop_layouts.find(l->header);
+	if (it != this->loop_layouts.end()) return &it->second;
+
+	std::map<dcpu16::reg_t, size_t> uses;
+	std::set<uint16_t> bases; // constants added to something, which might be indexing from them
+	for (size_t pc = l->header; pc < l->end; pc = block_end(this->reg_prog, pc)) {
+		auto code = lower_block(this->reg_prog, pc, block_end(this->reg_prog, pc), {true, 0}, &this->live_regs,
+				nullptr, nullptr);
+		for (const auto &u : count_reg_accesses(code)) uses[u.first] += u.second;
+		for (size_t i = 0; i + 1 < code.size(); i++) {
+			if (code[i].code == j5::op_t::SET && code[i].op.which() == 1 && code[i + 1].code == j5::op_t::ADD) {
+				uint16_t c = boost::get<uint16_t>(code[i].op);
+				if (c > 1 && c != 0xffff) bases.insert(c);
+			}
+		}
+	}
+	std::vector<dcpu16::reg_t> regs;
+	for (const auto &u : uses) regs.push_back(u.first);
+	std::stable_sort(regs.begin(), regs.end(), [&uses, l](auto a, auto b) {
+		if (uses[a] != uses[b]) return uses[a] > uses[b];
+		return l->invariant.test((size_t)a) && !l->invariant.test((size_t)b);
+	});
+	if (regs.size() > STACK_REGS) regs.resize(STACK_REGS);
+
+	/* Every block has to be able to reach them, or the loop would spill on
+	 * the way round anyway. Which order they are in decides how deep */
+	auto fits = [this, l](const std::vector<dcpu16::reg_t> &order) {
+		const exit_layouts spill = [](symbol){return std::vector<dcpu16::reg_t>();};
+		const loop_stack_regs trial = {order, {}};
+		for (size_t pc = l->header; pc < l->end; pc = block_end(this->reg_prog, pc)) {
+			std::vector<dcpu16::reg_t> got;
+			lower_block(this->reg_prog, pc, block_end(this->reg_prog, pc), {true, STACK_REGS}, &this->live_regs,
+					spill, &got, &trial);
+			if (got != order) return false;
+		}
+		return true;
+	};
+	auto &chosen = this->loop_layouts[l->header].regs;
+	for (size_t size = regs.size(); size > 0 && chosen.empty(); size--) {
+		for (size_t subset = 1; subset < (1u << regs.size()) && chosen.empty(); subset++) {
+			std::vector<dcpu16::reg_t> order;
+			for (size_t k = 0; k < regs.size(); k++) {
+				if (subset & (1u << k)) order.push_back(regs[k]);
+			}
+			if (order.size() != size) continue;
+			std::sort(order.begin(), order.end());
+			do {
+				if (fits(order)) {
+					chosen = order;
+					break;
+				}
+			} while (std::next_permutation(order.begin(), order.end()));
+		}
+	}
+
+	/* Then each register is tried biased by each base, keeping any that
+	 * makes the loop's code cheaper by the cost table */
+	auto cost = [this, l](const loop_stack_regs &trial) {
+		const exit_layouts spill = [](symbol){return std::vector<dcpu16::reg_t>();};
+		size_t total = 0;
+		for (size_t pc = l->header; pc < l->end; pc = block_end(this->reg_prog, pc)) {
+			std::vector<dcpu16::reg_t> got;
+			auto code = run_passes(lower_block(this->reg_prog, pc, block_end(this->reg_prog, pc), {true, STACK_REGS},
+					&this->live_regs, spill, &got, &trial), ORDERINGS[2]);
+			if (got != trial.regs) return SIZE_MAX;
+			total += estimate_cost(code, true);
+		}
+		return total;
+	};
+	loop_stack_regs &layout = this->loop_layouts[l->header];
+	/* A loop keeping the same registers as the loop around it keeps them
+	 * the same way, so going in and out of it needs no spilling. The
+	 * outermost picks, going by all of their code */
+	auto around = std::find_if(this->loops_found.begin(), this->loops_found.end(), [l](const loops::loop &o) {
+		return &o != l && o.header <= l->header && l->end <= o.end;
+	});
+	const loop_stack_regs *outer = around != this->loops_found.end() ? this->loop_layout(around->header) : nullptr;
+	const bool shared = outer != nullptr && outer->regs == chosen;
+	if (shared) layout.bias = outer->bias;
+	size_t best = chosen.empty() || shared ? 0 : cost(layout);
+	for (size_t k = 0; k < chosen.size() && !shared; k++) {
+		for (uint16_t base : bases) {
+			loop_stack_regs trial = layout;
+			trial.bias.resize(chosen.size(), 0);
+			trial.bias[k] = base;
+			size_t c = cost(trial);
+			if (c < best) {
+				best = c;
+				layout.bias = trial.bias;
+			}
+		}
+		if (!layout.bias.empty() && layout.bias[k] != 0) {
+			log<LOG_DEBUG2>("# Loop at ", this->reg_prog.at(l->header), ": ", chosen[k], " biased by ", layout.bias[k]);
+		}
+	}
+	log<LOG_DEBUG2>("# Loop at ", this->reg_prog.at(l->header), ": ", chosen.size(), " stack registers, invariant ",
+			l->invariant.count());
+	return &layout;
+}
+
+/**
+ * What a block's stack registers have added to them, see loop_stack_regs.
+ * Empty unless the block keeps its loop's stack registers.
+ */
+std::vector<uint16_t> convertmachine::stack_bias(uint16_t reg_pc)
+{
+	const loop_stack_regs *loop = this->loop_layout(reg_pc);
+	if (loop == nullptr || loop->bias.empty() || this->layout(reg_pc) != loop->regs) return {};
+	return loop->bias;
+}
+
 /* Get cached instruction snippet, if it exists. Otherwise create it */
-std::pair<j5::program, uint16_t> convertmachine::get_snippet(uint16_t reg_pc, size_t optimise)
+const convertmachine::cache_entry &convertmachine::get_snippet(uint16_t reg_pc, size_t optimise)
 {
 	auto section_it = this->section_cache.find(reg_pc);
 	if (section_it != this->section_cache.end()) {
-		return section_it->second;
+		auto &entry = section_it->second;
+		this->cache_lru.splice(this->cache_lru.begin(), this->cache_lru, entry.lru_pos);
+		this->stats.hits++;
+		return entry;
 	}
+	this->stats.misses++;
+	if (!this->translated.insert(reg_pc).second) this->stats.retranslations++;
 
-	// find end of section (next label)
-	auto next_label = std::find_if(
-		this->reg_prog.begin() + reg_pc + 1,
-		this->reg_prog.end(),
-		[](const dcpu16::instruction &i){return !i.label.empty();}
-	);
-	uint16_t distance = std::distance(this->reg_prog.begin() + reg_pc, next_label);
+	uint16_t distance = block_end(this->reg_prog, reg_pc) - reg_pc;
 	log<LOG_DEBUG2>("# Caching ", this->reg_prog.at(reg_pc), " (",  distance, ")");
-	j5::program snippet = convert_instructions(this->reg_prog.begin() + reg_pc, next_label);
-	if (optimise >= 1) {
-		snippet = peephole_optimise(snippet);
+	/* Level 2 keeps stack registers on the stack from block to block, where
+	 * the next block has the same ones with the same biases. Unknown labels
+	 * are left to fail if the branch is ever taken */
+	exit_layouts exits;
+	if (optimise >= 2) {
+		size_t end = reg_pc + distance;
+		std::vector<uint16_t> bias = this->stack_bias(reg_pc);
+		exits = [this, end, bias](symbol label) {
+			size_t target = end;
+			if (!label.empty()) {
+				auto pos = std::find_if(this->reg_prog.begin(), this->reg_prog.end(), [label](const dcpu16::instruction &i){return i.label == label;});
+				if (pos == this->reg_prog.end()) return std::vector<dcpu16::reg_t>();
+				target = std::distance(this->reg_prog.begin(), pos);
+			}
+			if (this->stack_bias(target) != bias) return std::vector<dcpu16::reg_t>();
+			return this->layout(target);
+		};
 	}
-	if (optimise >= 2) { // koopman
-		snippet = stack_schedule(snippet);
-		snippet = peephole_optimise(snippet); // peephole again
+	std::vector<dcpu16::reg_t> regs;
+	/* Liveness needs the whole program, which a stream doesn't have up front */
+	const liveness::analysis *live = this->streaming ? nullptr : &this->live_regs;
+	j5::program snippet = translate_block(this->reg_prog, reg_pc, reg_pc + distance, optimise, live, exits, &regs,
+			this->loop_layout(reg_pc));
+	std::map<symbol, size_t> labels;
+	snippet = layout_branches(std::move(snippet), &labels);
+	snippet.shrink_to_fit();
+	auto warm = labels.find(WARM_ENTRY);
+	this->check_layout(reg_pc, regs);
+
+	this->cache_lru.push_front(reg_pc);
+	size_t size = snippet_size(snippet);
+	auto &entry = this->section_cache[reg_pc] = {
+		snippet, distance, warm != labels.end() ? warm->second : 0, regs, size, this->cache_lru.begin()
+	};
+	this->cache_size += size;
+	this->stats.peak_size = std::max(this->stats.peak_size, this->cache_size);
+	this->evict_snippets(reg_pc);
+	return entry;
+}
+
+/* Where to start a snippet, past its stack register loads if the last block left them there */
+size_t convertmachine::entry_point(const cache_entry &entry) const
+{
+	if (this->stack.empty()) return 0;
+	if (this->stack.size() != entry.regs.size()) {
+		throw "Block entered with " + std::to_string(this->stack.size()) + " values on the stack, expected "
+			+ std::to_string(entry.regs.size());
 	}
-	this->section_cache[reg_pc] = {snippet, distance};
-	return this->section_cache[reg_pc];
+	return entry.warm;
 }
 
-void convertmachine::run_reg(const dcpu16::program &prog, bool speedlimit, size_t optimise, bool cache)
+void convertmachine::load(const dcpu16::program &prog, size_t optimise, bool cache)
 {
 	this->terminate = false;
 	this->reg_prog = prog;
-	size_t program_cost = 0;
-	size_t skip = 0;
+	this->reg_reader = nullptr;
+	this->streaming = false;
+	this->live_regs = liveness::analysis(prog);
+	this->loops_found = loops::find_loops(prog);
+	this->optimise = optimise;
+	this->cache = cache;
+	this->reg_pc = 0;
+	this->skip = 0;
+	this->program_cost = 0;
+	this->layouts.clear();
+	this->loop_layouts.clear();
 	this->pc = 0;
-	for (uint16_t reg_pc = 0; !this->terminate && reg_pc < this->reg_prog.size();) {
-		auto start = std::chrono::high_resolution_clock::now();
-
-		bool is_cached = cache && this->section_cache.find(reg_pc) != this->section_cache.end();
-		j5::program snippet;
-		uint16_t distance;
-		std::tie(snippet, distance) = get_snippet(reg_pc, optimise);
-
-		if (is_cached) {
-			program_cost += 1; // lookup cost
-		} else {
-			program_cost += distance * 10; // caching cost
-		}
+	this->stack = {};
+	this->flags = 0;
+	this->mem.fill(0);
+}
 
-		size_t memcount = std::count_if(snippet.begin(), snippet.end(), [](const auto &i){return i.code == j5::op_t::LOAD || i.code == j5::op_t::STORE;});
-		log<LOG_DEBUG>(prog.at(reg_pc), "(size: ", snippet.size(), ", ", memcount, ")");
+/**
+ * Loads a program that is still being read, which is then read a block at
+ * a time as it runs. Nothing that needs the whole program (liveness, loops)
+ * is worked out, so registers are all written back and no loop keeps its
+ * registers on the stack.
+ */
+void convertmachine::load(const dcpu16::program_reader &reader, size_t optimise, bool cache)
+{
+	this->load(dcpu16::program(), optimise, cache);
+	this->reg_reader = reader;
+	this->streaming = true;
+}
 
-		/* Run instruction snippet */
-		for (size_t start_pc = this->pc;  this->pc - start_pc < snippet.size(); this->pc++) {
-			if (skip > 0) {
-				skip--;
-				continue;
-			}
-			const auto &i = snippet.at(this->pc - start_pc);
-			log<LOG_DEBUG>('\t', i);
-			auto new_pc = this->run_instruction(i);
-
-			bool breakout = false;
-			log<LOG_DEBUG2>(this->register_dump());
-			// branch specials
-			switch (i.code) {
-				case j5::op_t::BRZERO:
-					skip = new_pc - this->pc - 1; // get rid of relative
-					break;
-				case j5::op_t::BRANCH: {
-					if (i.op.which() == 1) {
-						skip = new_pc - this->pc - 1;
+/* Whether there is an instruction reg_pc, reading up to it if the program is still coming */
+bool convertmachine::read_to(size_t reg_pc)
+{
+	while (reg_pc >= this->reg_prog.size() && this->reg_reader) {
+		if (!this->reg_reader(this->reg_prog)) this->reg_reader = nullptr;
+	}
+	return reg_pc < this->reg_prog.size();
+}
+
+/**
+ * Reads up to the end of the block starting at reg_pc, if the program is
+ * still coming, so that block_end can find it.
+ * @return Whether there is a block there.
+ */
+bool convertmachine::read_block(size_t reg_pc)
+{
+	if (!this->read_to(reg_pc)) return false;
+	while (this->reg_reader && block_end(this->reg_prog, reg_pc) == this->reg_prog.size()) {
+		this->read_to(this->reg_prog.size());
+	}
+	return true;
+}
+
+/**
+ * Runs the block of register instructions starting at the next one.
+ * @return Whether there is anything left to run.
+ */
+bool convertmachine::step(bool speedlimit)
+{
+	if (this->terminate || !this->read_block(this->reg_pc)) return false;
+	auto start = std::chrono::high_resolution_clock::now();
+
+	uint16_t &reg_pc = this->reg_pc;
+	bool translating = this->section_cache.find(reg_pc) == this->section_cache.end();
+	bool is_cached = this->cache && !translating;
+	if (translating && this->counters != nullptr) this->counters->switch_to(perf_counters::TRANSLATE);
+	const cache_entry &entry = get_snippet(reg_pc, this->optimise);
+	if (translating && this->counters != nullptr) this->counters->switch_to(perf_counters::RUN);
+	const j5::program &snippet = entry.snippet;
+	uint16_t distance = entry.distance;
+
+	if (is_cached) {
+		this->program_cost += 1; // lookup cost
+	} else {
+		this->program_cost += distance * 10; // caching cost
+	}
+
+	profile::translation *counted = nullptr;
+	if (this->prof != nullptr) {
+		this->prof->enter(reg_pc);
+		counted = &this->prof->translated(reg_pc, snippet);
+	}
+
+	size_t memcount = std::count_if(snippet.begin(), snippet.end(), [](const auto &i){return i.code == j5::op_t::LOAD || i.code == j5::op_t::STORE;});
+	log<LOG_DEBUG>(this->reg_prog.at(reg_pc), "(size: ", snippet.size(), ", ", memcount, ")");
+
+	/* Run instruction snippet */
+	size_t start_pc = this->pc;
+	uint64_t executed = 0;
+	this->pc += this->entry_point(entry);
+	for (; this->pc - start_pc < snippet.size(); this->pc++) {
+		if (this->skip > 0) {
+			this->skip--;
+			continue;
+		}
+		const auto &i = snippet.at(this->pc - start_pc);
+		log<LOG_DEBUG>('\t', i);
+		if (this->samp != nullptr && sampler::due) this->sample(i, reg_pc);
+		bool taken = i.code == j5::op_t::BRANCH
+			|| (i.code == j5::op_t::BRZERO && HasBit(this->flags, static_cast<uint8_t>(flagbit::ZERO)));
+		if (counted != nullptr) {
+			profile::counts &c = this->prof->ran(*counted, this->pc - start_pc);
+			if (i.code == j5::op_t::BRZERO) profile::branch(c, taken);
+		}
+		auto new_pc = this->run_instruction(i);
+		executed++;
+
+		bool breakout = false;
+		log<LOG_DEBUG2>(this->register_dump());
+		// branch specials
+		switch (i.code) {
+			case j5::op_t::BRZERO:
+			case j5::op_t::BRANCH: {
+				if (i.op.which() == 1) {
+					this->skip = new_pc - this->pc - 1; // get rid of relative
+				} else if (taken) {
+					symbol branch_label = boost::get<symbol>(i.op);
+					if (snippet.begin()->label == branch_label) {
+						// label is in current snippet
+						this->pc = start_pc + this->entry_point(entry) - 1; // loop
 					} else {
-						std::string branch_label = boost::get<std::string>(i.op);
-						if (snippet.begin()->label == branch_label) {
-							// label is in current snippet
-							this->pc = start_pc - 1; // loop
-						} else {
-							reg_pc = new_pc - distance; // postinc
-							breakout = true;
-						}
+						reg_pc = new_pc - distance; // postinc
+						breakout = true;
 					}
-					break;
 				}
-				default:
-					break;
+				break;
 			}
-
-			switch (i.code) {
-				case j5::op_t::BRZERO:
-				case j5::op_t::BRANCH:
-					program_cost += 2; // branch cost
-					break;
-				case j5::op_t::LOAD:
-				case j5::op_t::STORE:
-					program_cost += 3;
-					break;
-				default:
-					program_cost += 1;
-					break;
-			}
-			if (breakout) break;
+			default:
+				break;
 		}
-		log<LOG_DEBUG>("");
 
-		if (speedlimit) {
-			std::this_thread::sleep_until(start + (std::chrono::milliseconds(100) * distance)); // arbitrary
-		}
-		reg_pc += distance;
+		this->program_cost += cost_table().cost(i.code);
+		if (breakout || this->terminate) break;
 	}
-	log<LOG_DEBUG>("Program cost: ", program_cost);
+	log<LOG_DEBUG>("");
+	if (this->counters != nullptr) this->counters->executed(executed);
+
+	if (speedlimit) {
+		std::this_thread::sleep_until(start + (std::chrono::milliseconds(100) * distance)); // arbitrary
+	}
+	reg_pc += distance;
+	return !this->terminate && this->read_to(reg_pc);
+}
+
+void convertmachine::run_reg(const dcpu16::program &prog, bool speedlimit, size_t optimise, bool cache)
+{
+	this->load(prog, optimise, cache);
+	this->run_steps(speedlimit);
+}
+
+void convertmachine::run_reg(const dcpu16::program_reader &reader, bool speedlimit, size_t optimise, bool cache)
+{
+	this->load(reader, optimise, cache);
+	this->run_steps(speedlimit);
+}
+
+void convertmachine::run_steps(bool speedlimit)
+{
+	if (this->counters != nullptr) this->counters->switch_to(perf_counters::RUN);
+	while (this->step(speedlimit)) {}
+	if (this->counters != nullptr) this->counters->switch_to(perf_counters::IDLE);
+	this->out->flush();
+	log<LOG_DEBUG>("Program cost: ", this->program_cost);
+	log<LOG_DEBUG>("Snippet cache: ", this->stats.hits, " hits, ", this->stats.misses, " misses, ",
+			this->stats.evictions, " evictions, ", this->stats.retranslations, " retranslations, ",
+			"peak ", this->stats.peak_size, " bytes");
+	if (this->optimise >= 1) peephole_rules().report();
+	if (this->optimise >= 2) stack_schedule_report();
+}
+
+/* Samples a stack instruction of the block at reg_pc, under the register instruction it came from */
+void convertmachine::sample(const j5::instruction &ins, uint16_t reg_pc)
+{
+	size_t from = ins.reg_pc != -1 ? ins.reg_pc : reg_pc;
+	this->samp->take({sampler::enclosing(this->reg_prog, from), sampler::frame(this->reg_prog.at(from)),
+			sampler::text(ins)});
+}
+
+uint16_t convertmachine::reg(dcpu16::reg_t r) const
+{
+	return this->mem[reg2memaddr(r)];
+}
+
+bool convertmachine::is_live(dcpu16::reg_t r) const
+{
+	if (this->optimise == 0 || this->streaming) return true;
+	if (this->terminate) return false;
+	return this->live_regs.before(this->reg_pc).test((size_t)r);
 }
 
-uint16_t convertmachine::find_label(const std::string &l)
+/* Labels further on than has been read yet are read up to when first used */
+uint16_t convertmachine::find_label(symbol l)
 {
-	auto pos = std::find_if(this->reg_prog.begin(), this->reg_prog.end(), [l](const dcpu16::instruction &i) { return i.label == l; });
-	if (pos == this->reg_prog.end()) {
-		throw "Undefined label '" + l + "' used";
+	for (size_t searched = 0;;) {
+		auto pos = std::find_if(this->reg_prog.begin() + searched, this->reg_prog.end(), [l](const dcpu16::instruction &i) { return i.label == l; });
+		if (pos != this->reg_prog.end()) return std::distance(this->reg_prog.begin(), pos);
+		searched = this->reg_prog.size();
+		if (!this->read_to(searched)) throw "Undefined label '" + l.str() + "' used";
 	}
-	return std::distance(this->reg_prog.begin(), pos);
 }
 
@@ -1,21 +1,110 @@
 #ifndef STACKCONVERT_MACHINE_HPP
 #define STACKCONVERT_MACHINE_HPP
 
+#include <list>
 #include <map>
+#include <set>
 #include <string>
 
+#include "liveness.hpp"
+#include "loops.hpp"
+#include "register_convert.hpp"
 #include "register_machine.hpp"
 #include "stack_machine.hpp"
 
+size_t block_end(const dcpu16::program &prog, size_t reg_pc);
+j5::program translate_block(const dcpu16::program &prog, size_t begin, size_t end, size_t optimise,
+		const liveness::analysis *live = nullptr, const exit_layouts &exits = nullptr,
+		std::vector<dcpu16::reg_t> *regs = nullptr, const loop_stack_regs *loop = nullptr);
+
 class convertmachine : j5::machine {
 public:
+	/**
+	 * @param cache_budget Approximate number of bytes translated snippets
+	 *                     may occupy before the least recently used ones are
+	 *                     evicted. 0 means unbounded.
+	 */
+	explicit convertmachine(size_t cache_budget = 0) : cache_budget(cache_budget) {}
+
 	void run_reg(const dcpu16::program &prog, bool speedlimit, size_t optimise, bool cache);
+	void run_reg(const dcpu16::program_reader &reader, bool speedlimit, size_t optimise, bool cache);
+	void load(const dcpu16::program &prog, size_t optimise, bool cache);
+	void load(const dcpu16::program_reader &reader, size_t optimise, bool cache);
+	bool step(bool speedlimit = false);
+
+	/* Register values are only up to date in between blocks */
+	uint16_t reg(dcpu16::reg_t r) const;
+	/* Whether a register's value might be read again, dead ones aren't kept up to date */
+	bool is_live(dcpu16::reg_t r) const;
+	inline uint16_t memory(uint16_t addr) const
+	{
+		return this->mem[addr];
+	}
+	/* Index of the first register instruction of the next block */
+	inline uint16_t next_pc() const
+	{
+		return this->reg_pc;
+	}
+	inline size_t cost() const
+	{
+		return this->program_cost;
+	}
+	using j5::machine::attach;
+	using j5::machine::output_to;
+	/* The register program as far as it's been read */
+	inline const dcpu16::program &loaded() const
+	{
+		return this->reg_prog;
+	}
 private:
-	std::pair<j5::program, uint16_t> get_snippet(uint16_t reg_pc, size_t optimise);
-	uint16_t find_label(const std::string &l) override;
+	struct cache_entry {
+		j5::program snippet;
+		uint16_t distance;
+		size_t warm; ///< Where to start when the stack registers are already on the stack
+		std::vector<dcpu16::reg_t> regs; ///< Stack registers, bottom first
+		size_t size; ///< Estimated memory footprint, in bytes
+		std::list<uint16_t>::iterator lru_pos;
+	};
+
+	struct cache_stats {
+		size_t hits = 0;
+		size_t misses = 0;
+		size_t evictions = 0;
+		size_t retranslations = 0;
+		size_t peak_size = 0;
+	};
+
+	const cache_entry &get_snippet(uint16_t reg_pc, size_t optimise);
+	const std::vector<dcpu16::reg_t> &layout(uint16_t reg_pc);
+	const loop_stack_regs *loop_layout(uint16_t reg_pc);
+	std::vector<uint16_t> stack_bias(uint16_t reg_pc);
+	void check_layout(uint16_t reg_pc, const std::vector<dcpu16::reg_t> &regs) const;
+	size_t entry_point(const cache_entry &entry) const;
+	void evict_snippets(uint16_t keep);
+	void run_steps(bool speedlimit);
+	bool read_to(size_t reg_pc);
+	bool read_block(size_t reg_pc);
+	uint16_t find_label(symbol l) override;
+	void sample(const j5::instruction &ins, uint16_t reg_pc);
 	dcpu16::program reg_prog;
+	dcpu16::program_reader reg_reader; ///< Rest of the program, if it's still being read
+	bool streaming; ///< Whether the program was read as it ran, so isn't all known up front
+	uint16_t reg_pc;
+	size_t skip; ///< Stack instructions left to skip, which can carry over into the next block
+	size_t optimise;
+	bool cache;
+	size_t program_cost;
+	liveness::analysis live_regs;
+	std::vector<loops::loop> loops_found;
 
-	std::map<uint16_t, std::pair<j5::program, uint16_t>> section_cache;
+	std::map<uint16_t, cache_entry> section_cache;
+	std::list<uint16_t> cache_lru; ///< Most recently used at the front
+	std::set<uint16_t> translated; ///< Every section ever translated, to spot retranslations
+	std::map<uint16_t, std::vector<dcpu16::reg_t>> layouts; ///< Stack registers of each block, by start
+	std::map<size_t, loop_stack_regs> loop_layouts; ///< Stack registers of each loop, by header
+	size_t cache_budget;
+	size_t cache_size = 0;
+	cache_stats stats;
 };
 
 #endif /* STACKCONVERT_MACHINE_HPP */
@@ -0,0 +1,962 @@
+#include <algorithm>
+#include <map>
+
+#include "dataflow.hpp"
+#include "register_convert.hpp"
+#include "util.hpp"
+
+namespace dataflow {
+
+/* Whether a register operand is a general register (or EX). PC, SP and IA
+ * mean rather more than a memory slot */
+static bool plain_register(const dcpu16::operand_t &x)
+{
+	if (x.which() != 1) return true;
+	auto r = boost::get<dcpu16::reg_t>(x);
+	return r <= dcpu16::reg_t::J || r == dcpu16::reg_t::EX;
+}
+
+static bool plain_operand(const dcpu16::operand_t &x)
+{
+	if (x.which() != 0) return plain_register(x);
+
+	const std::string &op = boost::get<symbol>(x).str();
+	if (!dcpu16::is_array_type(op)) return false; // label
+	size_t pos = op.find('+');
+	if (pos == std::string::npos) return plain_register(simple_operand(op, 1, op.size() - 1));
+	return plain_register(simple_operand(op, 1, pos)) && plain_register(simple_operand(op, pos + 1, op.size() - 1));
+}
+
+static bool commutative(dcpu16::op_t op)
+{
+	switch (op) {
+		case dcpu16::op_t::ADD:
+		case dcpu16::op_t::MUL:
+		case dcpu16::op_t::MLI:
+		case dcpu16::op_t::AND:
+		case dcpu16::op_t::BOR:
+		case dcpu16::op_t::XOR:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Constant folding. Follows what the J5 code for the operation would do.
+ * @param k OP or EX, which of the results to give.
+ * @param[out] res Folded value.
+ * @return Whether the operation could be folded.
+ */
+static bool fold(kind k, dcpu16::op_t op, uint16_t b, uint16_t a, uint16_t &res)
+{
+	bool ex = k == kind::EX;
+	switch (op) {
+		case dcpu16::op_t::ADD:
+			res = ex ? (b + a > 0xffff) : b + a;
+			return true;
+		case dcpu16::op_t::SUB:
+			res = ex ? (a > b ? 0xffff : 0) : b - a;
+			return true;
+		case dcpu16::op_t::MUL: {
+			uint32_t v = static_cast<uint32_t>(b) * a;
+			res = ex ? v >> 16 : v;
+			return true;
+		}
+		case dcpu16::op_t::MLI: {
+			int32_t v = static_cast<int16_t>(b) * static_cast<int16_t>(a);
+			res = ex ? static_cast<uint32_t>(v) >> 16 : v;
+			return true;
+		}
+		case dcpu16::op_t::DIV:
+			if (a == 0) {
+				res = 0;
+			} else {
+				res = ex ? (static_cast<uint32_t>(b) << 16) / a : b / a;
+			}
+			return true;
+		case dcpu16::op_t::DVI: {
+			if (a == 0) {
+				res = 0;
+				return true;
+			}
+			if (a == 0xffff) return false; // -0x8000 / -1 overflows
+			int32_t sb = static_cast<int16_t>(b);
+			int32_t sa = static_cast<int16_t>(a);
+			res = ex ? (sb * 0x10000) / sa : sb / sa;
+			return true;
+		}
+		case dcpu16::op_t::MOD:
+			res = a == 0 ? 0 : b % a;
+			return true;
+		case dcpu16::op_t::MDI:
+			res = a == 0 ? 0 : static_cast<int16_t>(b) % static_cast<int16_t>(a);
+			return true;
+		case dcpu16::op_t::AND:
+			res = b & a;
+			return true;
+		case dcpu16::op_t::BOR:
+			res = b | a;
+			return true;
+		case dcpu16::op_t::XOR:
+			res = b ^ a;
+			return true;
+		case dcpu16::op_t::SHR:
+			res = a >= 16 ? 0 : b >> a;
+			return true;
+		case dcpu16::op_t::ASR:
+			res = static_cast<int16_t>(b) >> std::min<uint16_t>(a, 15);
+			return true;
+		case dcpu16::op_t::SHL:
+			res = a >= 16 ? 0 : b << a;
+			return true;
+		default:
+			return false;
+	}
+}
+
+block::block()
+{
+	this->clear();
+}
+
+void block::clear()
+{
+	this->nodes.clear();
+	this->effects.clear();
+	this->regs.fill(-1);
+	this->slots.fill(-1);
+	this->mem.clear();
+	this->version = 0;
+	this->end = end_t::NONE;
+	this->invert = false;
+	this->label.clear();
+}
+
+/* Instructions that can be part of a block, anything else is converted on its own */
+bool block::supported(const dcpu16::instruction &ins)
+{
+	switch (ins.code) {
+		case dcpu16::op_t::SET:
+			if (ins.b.which() == 1 && boost::get<dcpu16::reg_t>(ins.b) == dcpu16::reg_t::PC) {
+				if (ins.a.which() == 0) return !dcpu16::is_array_type(boost::get<symbol>(ins.a).str());
+				return ins.a.which() == 1 && boost::get<dcpu16::reg_t>(ins.a) == dcpu16::reg_t::PC;
+			}
+			break;
+		case dcpu16::op_t::ADD:
+		case dcpu16::op_t::SUB:
+		case dcpu16::op_t::MUL:
+		case dcpu16::op_t::MLI:
+		case dcpu16::op_t::DIV:
+		case dcpu16::op_t::DVI:
+		case dcpu16::op_t::MOD:
+		case dcpu16::op_t::MDI:
+		case dcpu16::op_t::AND:
+		case dcpu16::op_t::BOR:
+		case dcpu16::op_t::XOR:
+		case dcpu16::op_t::SHR:
+		case dcpu16::op_t::ASR:
+		case dcpu16::op_t::SHL:
+		case dcpu16::op_t::IFB:
+		case dcpu16::op_t::IFC:
+		case dcpu16::op_t::IFE:
+		case dcpu16::op_t::IFN:
+		case dcpu16::op_t::IFG:
+		case dcpu16::op_t::IFA:
+		case dcpu16::op_t::IFL:
+		case dcpu16::op_t::IFU:
+			break;
+		case dcpu16::op_t::OUT:
+			return plain_operand(ins.b);
+		default:
+			return false;
+	}
+	return plain_operand(ins.b) && plain_operand(ins.a);
+}
+
+/* Finds or creates a node */
+int block::make(kind k, dcpu16::op_t op, uint16_t value, int b, int a)
+{
+	for (size_t n = 0; n < this->nodes.size(); n++) {
+		const auto &x = this->nodes[n];
+		if (x.k == k && x.op == op && x.value == value && x.b == b && x.a == a) return n;
+	}
+	this->nodes.push_back({k, op, value, b, a});
+	return this->nodes.size() - 1;
+}
+
+int block::constant(uint16_t v)
+{
+	return this->make(kind::CONST, dcpu16::op_t::SET, v, -1, -1);
+}
+
+/* Current value of a register */
+int block::reg(dcpu16::reg_t r)
+{
+	auto &cur = this->regs[static_cast<size_t>(r)];
+	if (cur == -1) cur = this->make(kind::REG, dcpu16::op_t::SET, static_cast<uint16_t>(r), -1, -1);
+	return cur;
+}
+
+int block::load(int addr)
+{
+	for (const auto &m : this->mem) {
+		if (m.first == addr) return m.second; // forwarded from an earlier store
+	}
+	return this->make(kind::LOAD, dcpu16::op_t::SET, this->version, addr, -1);
+}
+
+/* Node for an operation, after folding constants and simple identities */
+int block::operation(dcpu16::op_t op, int b, int a)
+{
+	if (commutative(op) && this->nodes[b].k == kind::CONST) std::swap(b, a);
+	if (this->nodes[a].k == kind::CONST) {
+		uint16_t va = this->nodes[a].value;
+		uint16_t res;
+		if (this->nodes[b].k == kind::CONST && fold(kind::OP, op, this->nodes[b].value, va, res)) {
+			return this->constant(res);
+		}
+		switch (op) {
+			case dcpu16::op_t::ADD:
+			case dcpu16::op_t::SUB:
+			case dcpu16::op_t::BOR:
+			case dcpu16::op_t::XOR:
+			case dcpu16::op_t::ASR:
+				if (va == 0) return b;
+				break;
+			case dcpu16::op_t::SHR:
+			case dcpu16::op_t::SHL:
+				if (va == 0) return b;
+				if (va >= 16) return this->constant(0);
+				break;
+			case dcpu16::op_t::MUL:
+			case dcpu16::op_t::MLI:
+				if (va == 0) return this->constant(0);
+				/* FALLTHROUGH */
+			case dcpu16::op_t::DIV:
+			case dcpu16::op_t::DVI:
+				if (va == 1) return b;
+				break;
+			case dcpu16::op_t::AND:
+				if (va == 0) return this->constant(0);
+				if (va == 0xffff) return b;
+				break;
+			default:
+				break;
+		}
+	}
+	return this->make(kind::OP, op, 0, b, a);
+}
+
+/**
+ * Node for the bits a shift by a moves out of b into EX. Up to 16 that's b
+ * shifted the other way by 16 - a, and from 16 on b shifted the same way by
+ * a - 16. Whichever doesn't apply has an amount of 16 or more, so it comes
+ * out 0, except that an ASR would leave the sign. Masking b down to its low
+ * a bits first keeps that 0 as well.
+ * @param shift The shift.
+ * @param opposite The shift the other way.
+ */
+int block::shifted_out(dcpu16::op_t shift, dcpu16::op_t opposite, int b, int a)
+{
+	if (this->nodes[a].k == kind::CONST) {
+		uint16_t va = this->nodes[a].value;
+		if (va <= 16) return this->operation(opposite, b, this->constant(16 - va));
+		return this->operation(shift, b, this->constant(va - 16));
+	}
+	int back = this->operation(opposite, b, this->operation(dcpu16::op_t::SUB, this->constant(16), a));
+	int on = b;
+	if (shift == dcpu16::op_t::ASR) {
+		int low = this->operation(dcpu16::op_t::XOR, this->operation(dcpu16::op_t::SHL, this->constant(0xffff), a),
+				this->constant(0xffff));
+		on = this->operation(dcpu16::op_t::AND, b, low);
+	}
+	on = this->operation(shift, on, this->operation(dcpu16::op_t::SUB, a, this->constant(16)));
+	return this->operation(dcpu16::op_t::BOR, back, on);
+}
+
+/* Node for the EX produced by an operation */
+int block::extra(dcpu16::op_t op, int b, int a)
+{
+	switch (op) {
+		case dcpu16::op_t::SHR:
+		case dcpu16::op_t::ASR:
+			return this->shifted_out(op, dcpu16::op_t::SHL, b, a);
+		case dcpu16::op_t::SHL:
+			return this->shifted_out(op, dcpu16::op_t::SHR, b, a);
+		default:
+			break;
+	}
+
+	if (commutative(op) && this->nodes[b].k == kind::CONST) std::swap(b, a);
+	if (this->nodes[a].k == kind::CONST) {
+		uint16_t res;
+		if (this->nodes[b].k == kind::CONST && fold(kind::EX, op, this->nodes[b].value, this->nodes[a].value, res)) {
+			return this->constant(res);
+		}
+		if (this->nodes[a].value == 0 && (op == dcpu16::op_t::ADD || op == dcpu16::op_t::SUB)) {
+			return this->constant(0);
+		}
+	}
+	return this->make(kind::EX, op, 0, b, a);
+}
+
+/* Address of an "array type" operand */
+int block::address(const std::string &op)
+{
+	size_t pos = op.find('+');
+	if (pos == std::string::npos) return this->value(simple_operand(op, 1, op.size() - 1));
+	int x = this->value(simple_operand(op, 1, pos));
+	int y = this->value(simple_operand(op, pos + 1, op.size() - 1));
+	return this->operation(dcpu16::op_t::ADD, x, y);
+}
+
+int block::value(const dcpu16::operand_t &x)
+{
+	switch (x.which()) {
+		case 0:
+			return this->load(this->address(boost::get<symbol>(x).str()));
+		case 1:
+			return this->reg(boost::get<dcpu16::reg_t>(x));
+		default:
+			return this->constant(boost::get<uint16_t>(x));
+	}
+}
+
+/* Whether n, or anything it is computed from, matches pred */
+template<typename F>
+bool block::depends(int n, F pred)
+{
+	this->visited.assign(this->nodes.size(), 0);
+	this->work.assign(1, n);
+	while (!this->work.empty()) {
+		int x = this->work.back();
+		this->work.pop_back();
+		if (x < 0 || this->visited[x]) continue;
+		this->visited[x] = 1;
+		if (pred(x)) return true;
+		this->work.push_back(this->nodes[x].b);
+		this->work.push_back(this->nodes[x].a);
+	}
+	return false;
+}
+
+/* Whether two addresses could be the same. Only (node + constant) addresses
+ * with the same node are told apart */
+bool block::may_alias(int x, int y) const
+{
+	auto split = [this](int n, int &base, uint16_t &offset) {
+		const auto &v = this->nodes[n];
+		if (v.k == kind::CONST) {
+			base = -1;
+			offset = v.value;
+		} else if (v.k == kind::OP && v.op == dcpu16::op_t::ADD && this->nodes[v.a].k == kind::CONST) {
+			base = v.b;
+			offset = this->nodes[v.a].value;
+		} else {
+			base = n;
+			offset = 0;
+		}
+	};
+	int xbase, ybase;
+	uint16_t xoff, yoff;
+	split(x, xbase, xoff);
+	split(y, ybase, yoff);
+	return xbase != ybase || xoff == yoff;
+}
+
+/* Whether register r's memory slot holds the value of n */
+bool block::in_slot(int r, int n) const
+{
+	if (this->slots[r] != -1) return this->slots[r] == n;
+	return this->nodes[n].k == kind::REG && this->nodes[n].value == r;
+}
+
+/**
+ * Writes a value to an operand.
+ * @param ex New value of EX, or -1 if unchanged.
+ * @return False if a memory write can't be added without losing track of
+ *         a value read earlier. The block has to end before it.
+ */
+bool block::assign(const dcpu16::operand_t &x, int val, int ex)
+{
+	if (x.which() != 0) {
+		if (ex != -1) this->regs[static_cast<size_t>(dcpu16::reg_t::EX)] = ex;
+		if (x.which() == 1) this->regs[static_cast<size_t>(boost::get<dcpu16::reg_t>(x))] = val;
+		return true; // literal is a nop
+	}
+
+	int addr = this->address(boost::get<symbol>(x).str());
+	auto aliased = [this, addr](int n) {
+		return this->nodes[n].k == kind::LOAD && this->may_alias(this->nodes[n].b, addr);
+	};
+
+	/* Registers holding values that depend on the memory being written
+	 * can't be recomputed afterwards, so write those back first */
+	auto next = this->regs;
+	if (ex != -1) next[static_cast<size_t>(dcpu16::reg_t::EX)] = ex;
+	std::vector<size_t> spills;
+	for (size_t r = 0; r < next.size(); r++) {
+		if (next[r] != -1 && !this->in_slot(r, next[r]) && this->depends(next[r], aliased)) spills.push_back(r);
+	}
+	std::vector<int> lost; // old slot contents
+	for (auto r : spills) {
+		int old = this->slots[r];
+		if (old == -1) {
+			auto it = std::find_if(this->nodes.begin(), this->nodes.end(),
+					[r](const node &v){return v.k == kind::REG && v.value == r;});
+			if (it != this->nodes.end()) old = it - this->nodes.begin();
+		}
+		if (old == -1) continue;
+		for (size_t s = 0; s < next.size(); s++) {
+			if (next[s] != -1 && this->depends(next[s], [old](int n){return n == old;})) return false;
+		}
+		lost.push_back(old);
+	}
+
+	this->regs = next;
+	for (auto r : spills) {
+		this->effects.push_back({effect_t::SPILL, static_cast<int>(r), this->regs[r]});
+		this->slots[r] = this->regs[r];
+	}
+	this->effects.push_back({effect_t::STORE, addr, val});
+	this->version++;
+
+	auto stale = [this, addr, &aliased, &lost](const std::pair<int, int> &m) {
+		return this->may_alias(m.first, addr) || this->depends(m.second, aliased)
+			|| this->depends(m.second, [&lost](int n){return std::find(lost.begin(), lost.end(), n) != lost.end();});
+	};
+	this->mem.erase(std::remove_if(this->mem.begin(), this->mem.end(), stale), this->mem.end());
+	if (!this->depends(val, aliased)) this->mem.emplace_back(addr, val);
+	return true;
+}
+
+/**
+ * Ends the block with a conditional.
+ * @param is_signed Compare as signed values, by flipping the sign bits so
+ *                  the unsigned comparison gives the same ordering.
+ */
+void block::set_test(j5::op_t op, bool inv, int b, int a, bool is_signed)
+{
+	if (is_signed) {
+		b = this->operation(dcpu16::op_t::XOR, b, this->constant(0x8000));
+		a = this->operation(dcpu16::op_t::XOR, a, this->constant(0x8000));
+	}
+	this->end = end_t::TEST;
+	this->test_op = op;
+	this->invert = inv;
+	this->test_b = b;
+	this->test_a = a;
+}
+
+/**
+ * Adds an instruction to the block.
+ * @return False if the instruction can't be added, either as it is not
+ *         supported or the block has to end first.
+ */
+bool block::add(const dcpu16::instruction &ins)
+{
+	if (this->ended() || !supported(ins)) return false;
+
+	switch (ins.code) {
+		case dcpu16::op_t::SET:
+			if (ins.b.which() == 1 && boost::get<dcpu16::reg_t>(ins.b) == dcpu16::reg_t::PC) {
+				if (ins.a.which() == 0) {
+					this->end = end_t::BRANCH;
+					this->label = boost::get<symbol>(ins.a);
+				} else {
+					this->end = end_t::STOP;
+				}
+				return true;
+			}
+			return this->assign(ins.b, this->value(ins.a), -1);
+		case dcpu16::op_t::ADD:
+		case dcpu16::op_t::SUB:
+		case dcpu16::op_t::MUL:
+		case dcpu16::op_t::MLI:
+		case dcpu16::op_t::DIV:
+		case dcpu16::op_t::DVI:
+		case dcpu16::op_t::SHR:
+		case dcpu16::op_t::ASR:
+		case dcpu16::op_t::SHL: {
+			int b = this->value(ins.b);
+			int a = this->value(ins.a);
+			return this->assign(ins.b, this->operation(ins.code, b, a), this->extra(ins.code, b, a));
+		}
+		case dcpu16::op_t::MOD:
+		case dcpu16::op_t::MDI:
+		case dcpu16::op_t::AND:
+		case dcpu16::op_t::BOR:
+		case dcpu16::op_t::XOR: {
+			int b = this->value(ins.b);
+			int a = this->value(ins.a);
+			return this->assign(ins.b, this->operation(ins.code, b, a), -1);
+		}
+		case dcpu16::op_t::OUT:
+			this->effects.push_back({effect_t::OUT, -1, this->value(ins.b)});
+			return true;
+		case dcpu16::op_t::IFB:
+		case dcpu16::op_t::IFC: {
+			int b = this->value(ins.b);
+			int a = this->value(ins.a);
+			this->set_test(j5::op_t::TSZ, ins.code == dcpu16::op_t::IFB, this->operation(dcpu16::op_t::AND, b, a), -1, false);
+			return true;
+		}
+		case dcpu16::op_t::IFE:
+			this->set_test(j5::op_t::TEQ, false, this->value(ins.b), this->value(ins.a), false);
+			return true;
+		case dcpu16::op_t::IFN:
+			this->set_test(j5::op_t::TEQ, true, this->value(ins.b), this->value(ins.a), false);
+			return true;
+		case dcpu16::op_t::IFG:
+			this->set_test(j5::op_t::TGT, false, this->value(ins.b), this->value(ins.a), false);
+			return true;
+		case dcpu16::op_t::IFA:
+			this->set_test(j5::op_t::TGT, false, this->value(ins.b), this->value(ins.a), true);
+			return true;
+		case dcpu16::op_t::IFL:
+			this->set_test(j5::op_t::TLT, false, this->value(ins.b), this->value(ins.a), false);
+			return true;
+		case dcpu16::op_t::IFU:
+			this->set_test(j5::op_t::TLT, false, this->value(ins.b), this->value(ins.a), true);
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Stack code generation for a block. Each value is built from its expression
+ * tree, values needed more than once are either kept on the stack (and
+ * reached with DUP, SWAP TUCK2 or COPY3) or computed again.
+ */
+class generator {
+public:
+	generator(block &blk, j5::program &code, bool keep, const liveness::reg_set &live)
+		: blk(blk), code(code), keep(keep), live(live)
+	{
+		this->requests.assign(blk.nodes.size(), 0);
+		this->slots.fill(-1);
+		this->limit = 64 + 16 * (blk.nodes.size() + blk.effects.size());
+
+		/* Result and EX of the same operation come out of one J5 sequence */
+		this->pairs.assign(blk.nodes.size(), -1);
+		for (size_t n = 0; n < blk.nodes.size(); n++) {
+			const auto &x = blk.nodes[n];
+			if (x.k != kind::EX || x.op == dcpu16::op_t::SHR || x.op == dcpu16::op_t::ASR || x.op == dcpu16::op_t::SHL) continue;
+			for (size_t m = 0; m < blk.nodes.size(); m++) {
+				const auto &y = blk.nodes[m];
+				if (y.k == kind::OP && y.op == x.op && y.b == x.b && y.a == x.a) {
+					this->pairs[n] = m;
+					this->pairs[m] = n;
+				}
+			}
+		}
+	}
+
+	bool run();
+
+private:
+	/* A value on the stack. Kept values are copies left for later use,
+	 * anything else is an operand about to be used. Kept values are always
+	 * below the operands, so operations find theirs together on top */
+	struct entry {
+		int n;
+		bool kept;
+	};
+
+	block &blk;
+	j5::program &code;
+	bool keep;
+	liveness::reg_set live; ///< Registers worth writing back
+	size_t limit;
+
+	std::vector<entry> stack;
+	std::vector<int> requests; ///< Number of times each value is still needed
+	std::vector<int> pairs; ///< Other half of an (OP, EX) pair, -1 if none
+	std::array<int, (size_t)dcpu16::reg_t::NUM_REGS> slots; ///< As block::slots, while the code runs
+
+	inline void emit(j5::op_t op)
+	{
+		this->code.push_back({symbol(), op, boost::blank()});
+	}
+	inline void emit(j5::op_t op, uint16_t v)
+	{
+		this->code.push_back({symbol(), op, v});
+	}
+	inline void pop(size_t n)
+	{
+		this->stack.resize(this->stack.size() - n);
+	}
+	bool in_slot(size_t r, int n) const
+	{
+		if (this->slots[r] != -1) return this->slots[r] == n;
+		return this->blk.nodes[n].k == kind::REG && this->blk.nodes[n].value == r;
+	}
+	int slot_value(size_t r) const;
+	size_t operands() const
+	{
+		auto kept = std::find_if(this->stack.rbegin(), this->stack.rend(), [](const entry &e){return e.kept;});
+		return kept - this->stack.rbegin();
+	}
+
+	void count(int n);
+	bool request(int n);
+	void emit_op(const node &x, bool both);
+	bool available_after(int n, std::vector<char> &seen) const;
+	void cleanup(bool all);
+	bool store(size_t r);
+	bool store_regs(std::vector<size_t> &pending);
+};
+
+/* Counts how often a value is needed. Operands are only counted once, as
+ * a kept value is only computed once */
+void generator::count(int root)
+{
+	auto &todo = this->blk.work;
+	todo.assign(1, root);
+	while (!todo.empty()) {
+		int n = todo.back();
+		todo.pop_back();
+		if (n < 0 || this->blk.nodes[n].k == kind::CONST) continue;
+		if (this->requests[n]++ > 0) continue;
+		if (this->pairs[n] != -1 && this->requests[this->pairs[n]] > 0) continue; // computed together
+		todo.push_back(this->blk.nodes[n].b);
+		todo.push_back(this->blk.nodes[n].a);
+	}
+}
+
+/* Node held in a register slot, -1 if it was never read */
+int generator::slot_value(size_t r) const
+{
+	if (this->slots[r] != -1) return this->slots[r];
+	for (size_t n = 0; n < this->blk.nodes.size(); n++) {
+		if (this->blk.nodes[n].k == kind::REG && this->blk.nodes[n].value == r) return n;
+	}
+	return -1;
+}
+
+/**
+ * Emits the J5 code for an operation, taking (b, a) off the stack.
+ * @param both Leave both (result, EX), rather than just the one for x.
+ */
+void generator::emit_op(const node &x, bool both)
+{
+	static const std::map<dcpu16::op_t, j5::op_t> J5_OPS {
+		{dcpu16::op_t::ADD, j5::op_t::ADD},
+		{dcpu16::op_t::SUB, j5::op_t::SUB},
+		{dcpu16::op_t::MUL, j5::op_t::MUL},
+		{dcpu16::op_t::MLI, j5::op_t::MULS},
+		{dcpu16::op_t::DIV, j5::op_t::DIV},
+		{dcpu16::op_t::DVI, j5::op_t::DIVS},
+		{dcpu16::op_t::MOD, j5::op_t::MOD},
+		{dcpu16::op_t::MDI, j5::op_t::MODS},
+		{dcpu16::op_t::AND, j5::op_t::AND},
+		{dcpu16::op_t::BOR, j5::op_t::OR},
+		{dcpu16::op_t::XOR, j5::op_t::XOR},
+		{dcpu16::op_t::SHR, j5::op_t::SHR},
+		{dcpu16::op_t::ASR, j5::op_t::ASR},
+		{dcpu16::op_t::SHL, j5::op_t::SHL},
+	};
+	this->emit(J5_OPS.at(x.op));
+
+	bool wide = x.op == dcpu16::op_t::MUL || x.op == dcpu16::op_t::MLI
+		|| x.op == dcpu16::op_t::DIV || x.op == dcpu16::op_t::DVI;
+	if (x.k == kind::OP && !both) {
+		if (wide) this->emit(j5::op_t::DROP); // (result, EX)
+		return;
+	}
+	if (!wide) {
+		// carry flag into EX, as for binop_code
+		this->emit(j5::op_t::SET, 0);
+		this->emit(j5::op_t::DUP);
+		this->emit(x.op == dcpu16::op_t::ADD ? j5::op_t::ADC : j5::op_t::SBC);
+	}
+	if (!both) {
+		this->emit(j5::op_t::SWAP);
+		this->emit(j5::op_t::DROP);
+	}
+}
+
+/**
+ * Puts a value on top of the stack.
+ * @return False if the value can't be got at.
+ */
+bool generator::request(int n)
+{
+	const node &x = this->blk.nodes[n];
+	if (this->code.size() > this->limit) return false; // recomputing too much
+	if (x.k == kind::CONST) {
+		this->emit(j5::op_t::SET, x.value);
+		this->stack.push_back({n, false});
+		return true;
+	}
+
+	this->requests[n]--;
+	for (size_t depth = 1; depth <= std::min<size_t>(3, this->stack.size()); depth++) {
+		auto &e = this->stack[this->stack.size() - depth];
+		if (e.n != n) continue;
+		if (depth == 1 && e.kept && this->requests[n] <= 0) {
+			e.kept = false; // last use
+			return true;
+		}
+		switch (depth) {
+			case 1:
+				this->emit(j5::op_t::DUP);
+				break;
+			case 2:
+				this->emit(j5::op_t::SWAP);
+				this->emit(j5::op_t::TUCK2);
+				break;
+			case 3:
+				this->emit(j5::op_t::COPY3);
+				break;
+		}
+		this->stack.push_back({n, false});
+		return true;
+	}
+
+	size_t r = 0;
+	while (r < this->slots.size() && !this->in_slot(r, n)) r++;
+	if (r < this->slots.size()) {
+		this->emit(j5::op_t::SET, reg2memaddr(static_cast<dcpu16::reg_t>(r)));
+		this->emit(j5::op_t::LOAD);
+	} else {
+		switch (x.k) {
+			case kind::LOAD:
+				if (!this->request(x.b)) return false;
+				this->emit(j5::op_t::LOAD);
+				this->pop(1);
+				break;
+			case kind::OP:
+			case kind::EX: {
+				int other = this->pairs[n];
+				bool both = this->keep && other != -1 && this->requests[other] > 0 && this->operands() == 0;
+				if (!this->request(x.b) || !this->request(x.a)) return false;
+				this->emit_op(x, both);
+				this->pop(2);
+				if (both) {
+					// keep the other half, below this one
+					if (x.k == kind::OP) this->emit(j5::op_t::SWAP);
+					this->stack.push_back({other, true});
+				}
+				break;
+			}
+			default:
+				return false; // register value has been overwritten
+		}
+	}
+	this->stack.push_back({n, false});
+	if (this->keep && this->requests[n] > 0) {
+		/* Tuck a copy under the other operands */
+		size_t above = this->operands();
+		switch (above) {
+			case 1:
+				this->emit(j5::op_t::DUP);
+				break;
+			case 2:
+				this->emit(j5::op_t::TUCK2);
+				break;
+			case 3:
+				this->emit(j5::op_t::TUCK3);
+				break;
+			default:
+				return true; // out of reach, compute it again when needed
+		}
+		this->stack.insert(this->stack.end() - above, {n, true});
+	}
+	return true;
+}
+
+/* Drops kept values that are no longer needed (or all of them) */
+void generator::cleanup(bool all)
+{
+	auto dead = [this, all](const entry &e) {
+		return e.kept && (all || this->requests[e.n] <= 0);
+	};
+	for (;;) {
+		size_t s = this->stack.size();
+		if (s >= 1 && dead(this->stack[s - 1])) {
+			this->emit(j5::op_t::DROP);
+			this->stack.pop_back();
+		} else if (s >= 2 && dead(this->stack[s - 2])) {
+			this->emit(j5::op_t::SWAP);
+			this->emit(j5::op_t::DROP);
+			this->stack.erase(this->stack.end() - 2);
+		} else if (s >= 3 && dead(this->stack[s - 3])) {
+			this->emit(j5::op_t::RSD3);
+			this->emit(j5::op_t::DROP);
+			this->stack.erase(this->stack.end() - 3);
+		} else {
+			break;
+		}
+	}
+}
+
+/* Whether a value can still be got at once the registers are written back */
+bool generator::available_after(int n, std::vector<char> &seen) const
+{
+	if (seen[n]) return true; // already checked (or being checked)
+	seen[n] = 1;
+	const auto &x = this->blk.nodes[n];
+	if (x.k == kind::CONST) return true;
+	if (std::find(this->blk.regs.begin(), this->blk.regs.end(), n) != this->blk.regs.end()) return true;
+	switch (x.k) {
+		case kind::REG:
+			return this->blk.in_slot(x.value, n);
+		case kind::LOAD:
+			return this->available_after(x.b, seen);
+		default:
+			return this->available_after(x.b, seen) && this->available_after(x.a, seen);
+	}
+}
+
+bool generator::store(size_t r)
+{
+	if (!this->request(this->blk.regs[r])) return false;
+	this->emit(j5::op_t::SET, reg2memaddr(static_cast<dcpu16::reg_t>(r)));
+	this->emit(j5::op_t::STORE);
+	this->pop(1);
+	this->slots[r] = this->blk.regs[r];
+	this->cleanup(false);
+	return true;
+}
+
+/**
+ * Writes back changed registers. Registers whose old value is still needed
+ * for another are written after it, if they need each other's old values
+ * they are all put on the stack first.
+ */
+bool generator::store_regs(std::vector<size_t> &pending)
+{
+	while (!pending.empty()) {
+		auto free = std::find_if(pending.begin(), pending.end(), [&](size_t r) {
+			int old = this->slot_value(r);
+			return old == -1 || std::none_of(pending.begin(), pending.end(), [&](size_t s) {
+				return s != r && this->blk.depends(this->blk.regs[s], [old](int n){return n == old;});
+			});
+		});
+		if (free == pending.end()) break;
+		if (!this->store(*free)) return false;
+		pending.erase(free);
+	}
+
+	for (auto r : pending) {
+		if (!this->request(this->blk.regs[r])) return false;
+	}
+	for (auto r = pending.rbegin(); r != pending.rend(); ++r) {
+		this->emit(j5::op_t::SET, reg2memaddr(static_cast<dcpu16::reg_t>(*r)));
+		this->emit(j5::op_t::STORE);
+		this->pop(1);
+		this->slots[*r] = this->blk.regs[*r];
+	}
+	this->cleanup(false);
+	return true;
+}
+
+bool generator::run()
+{
+	std::vector<size_t> pending;
+	for (const auto &e : this->blk.effects) {
+		if (e.type == effect_t::STORE) this->count(e.addr);
+		this->count(e.val);
+	}
+	for (size_t r = 0; r < this->blk.regs.size(); r++) {
+		if (this->blk.regs[r] != -1 && this->live.test(r) && !this->blk.in_slot(r, this->blk.regs[r])) {
+			pending.push_back(r);
+			this->count(this->blk.regs[r]);
+		}
+	}
+	bool test = this->blk.end == end_t::TEST;
+	if (test) {
+		this->count(this->blk.test_b);
+		if (this->blk.test_a != -1) this->count(this->blk.test_a);
+	}
+
+	for (const auto &e : this->blk.effects) {
+		switch (e.type) {
+			case effect_t::STORE:
+				if (!this->request(e.val) || !this->request(e.addr)) return false;
+				this->emit(j5::op_t::STORE);
+				this->pop(2);
+				break;
+			case effect_t::OUT:
+				if (!this->request(e.val)) return false;
+				this->emit(j5::op_t::OUT);
+				this->emit(j5::op_t::DROP);
+				this->pop(1);
+				break;
+			case effect_t::SPILL:
+				if (!this->request(e.val)) return false;
+				this->emit(j5::op_t::SET, reg2memaddr(static_cast<dcpu16::reg_t>(e.addr)));
+				this->emit(j5::op_t::STORE);
+				this->pop(1);
+				this->slots[e.addr] = e.val;
+				break;
+		}
+		this->cleanup(false);
+	}
+
+	/* Test on values registers are about to lose, before writing them */
+	std::vector<char> seen(this->blk.nodes.size(), 0);
+	bool early = test && !(this->available_after(this->blk.test_b, seen)
+			&& (this->blk.test_a == -1 || this->available_after(this->blk.test_a, seen)));
+	size_t operands = !test ? 0 : this->blk.test_a == -1 ? 1 : 2;
+	auto test_operands = [this]() {
+		/* Swapped as the LT/GT instructions do top <> next */
+		if (this->blk.test_a != -1 && !this->request(this->blk.test_a)) return false;
+		return this->request(this->blk.test_b);
+	};
+	if (early && !test_operands()) return false;
+	if (!this->store_regs(pending)) return false;
+
+	switch (this->blk.end) {
+		case end_t::TEST:
+			if (early) {
+				this->cleanup(true);
+				size_t s = this->stack.size();
+				if (s < operands || this->stack[s - 1].n != this->blk.test_b
+						|| (operands == 2 && this->stack[s - 2].n != this->blk.test_a)) {
+					return false;
+				}
+			} else if (!test_operands()) {
+				return false;
+			}
+			this->emit(this->blk.test_op);
+			for (size_t i = 0; i < operands; i++) this->emit(j5::op_t::DROP);
+			this->pop(operands);
+			this->cleanup(true);
+			/* The branches are left to the caller, see block::conditional */
+			if (!this->stack.empty()) return false;
+			break;
+		case end_t::BRANCH:
+			this->cleanup(true);
+			this->code.push_back(j5::make_instruction(j5::op_t::BRANCH, this->blk.label));
+			break;
+		case end_t::STOP:
+			this->cleanup(true);
+			this->emit(j5::op_t::STOP);
+			break;
+		case end_t::NONE:
+			this->cleanup(true);
+			break;
+	}
+	return this->stack.empty();
+}
+
+/**
+ * Generates the stack code for the block.
+ * @param code Where to put the code.
+ * @param keep Keep values that are needed again on the stack, rather than
+ *             computing them again.
+ * @param live Registers that might be read afterwards, only those are
+ *             written back.
+ * @return False if some value couldn't be got at.
+ */
+bool block::generate(j5::program &code, bool keep, const liveness::reg_set &live)
+{
+	generator gen(*this, code, keep, live);
+	return gen.run();
+}
+
+}
@@ -0,0 +1,131 @@
+#ifndef DATAFLOW_HPP
+#define DATAFLOW_HPP
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "liveness.hpp"
+#include "register_machine.hpp"
+#include "stack_machine.hpp"
+
+namespace dataflow {
+
+enum class kind : uint8_t {
+	CONST, ///< Literal value
+	REG,   ///< Value of a register at the start of the block
+	LOAD,  ///< Memory read
+	OP,    ///< Result of a DCPU-16 operation on (b, a)
+	EX,    ///< EX produced by a DCPU-16 operation on (b, a)
+};
+
+/**
+ * A value in the block. Each node is only created once (anything computed
+ * twice is the same node), so nodes are in SSA form and can be shared.
+ */
+struct node {
+	kind k;
+	dcpu16::op_t op; ///< OP, EX
+	uint16_t value;  ///< CONST: the value, REG: the register, LOAD: memory version
+	int b, a;        ///< Operands, -1 if unused. The address of a LOAD is b
+};
+
+enum class effect_t : uint8_t {
+	STORE, ///< Memory write of val to addr
+	OUT,   ///< Output val
+	SPILL, ///< Early register write, as a memory write would clobber its value
+};
+
+struct effect {
+	effect_t type;
+	int addr; ///< STORE: address node, SPILL: register
+	int val;
+};
+
+enum class end_t : uint8_t {
+	NONE,
+	TEST,   ///< Conditional, skips the next instruction
+	BRANCH, ///< Jumps to a label
+	STOP,
+};
+
+/**
+ * Dataflow graph of a straight line run of DCPU-16 instructions. Registers
+ * are tracked as the node they currently hold and are only written back at
+ * the end, constants are folded and identical expressions are shared. Memory
+ * writes and output are kept in order.
+ *
+ * Register memory slots are assumed not to be accessed as ordinary memory.
+ */
+class block {
+public:
+	block();
+
+	void clear();
+	bool add(const dcpu16::instruction &ins);
+	bool generate(j5::program &code, bool keep, const liveness::reg_set &live);
+
+	inline bool empty() const
+	{
+		return this->nodes.empty() && this->effects.empty() && this->end == end_t::NONE;
+	}
+	/* A conditional, branch or stop finishes the block */
+	inline bool ended() const
+	{
+		return this->end != end_t::NONE;
+	}
+	/**
+	 * Whether the block ends with a conditional. The generated code only
+	 * sets the zero flag, the branches to skip the next instruction are up
+	 * to the caller.
+	 * @param invert Set if the next instruction runs when the flag is clear.
+	 */
+	inline bool conditional(bool &invert) const
+	{
+		invert = this->invert;
+		return this->end == end_t::TEST;
+	}
+
+private:
+	std::vector<node> nodes;
+	std::vector<effect> effects;
+	std::array<int, (size_t)dcpu16::reg_t::NUM_REGS> regs; ///< Current value of each register, -1 if untouched
+	std::array<int, (size_t)dcpu16::reg_t::NUM_REGS> slots; ///< Value in each register's memory slot, -1 if unchanged
+	std::vector<std::pair<int, int>> mem; ///< Known memory contents, (address, value)
+	uint16_t version; ///< Number of memory writes so far
+
+	end_t end;
+	j5::op_t test_op;
+	bool invert;
+	int test_b, test_a;
+	symbol label;
+
+	std::vector<char> visited;
+	std::vector<int> work;
+
+	static bool supported(const dcpu16::instruction &ins);
+
+	int make(kind k, dcpu16::op_t op, uint16_t value, int b, int a);
+	int constant(uint16_t v);
+	int reg(dcpu16::reg_t r);
+	int load(int addr);
+	int operation(dcpu16::op_t op, int b, int a);
+	int extra(dcpu16::op_t op, int b, int a);
+	int shifted_out(dcpu16::op_t shift, dcpu16::op_t opposite, int b, int a);
+
+	int address(const std::string &op);
+	int value(const dcpu16::operand_t &x);
+	bool assign(const dcpu16::operand_t &x, int val, int ex);
+	void set_test(j5::op_t op, bool inv, int b, int a, bool is_signed);
+
+	template<typename F>
+	bool depends(int n, F pred);
+	bool may_alias(int x, int y) const;
+	bool in_slot(int r, int n) const;
+
+	friend class generator;
+};
+
+}
+
+#endif /* DATAFLOW_HPP */
@@ -0,0 +1,374 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <unistd.h>
+
+#include "convert_machine.hpp"
+#include "optimise.hpp"
+#include "register_convert.hpp"
+#include "register_machine.hpp"
+#include "util.hpp"
+
+log_level_t GLOBAL_LOG_LEVEL = LOG_NOTHING;
+
+static const size_t MAX_OPTIMISE = 3;
+
+/* Steps the register machine may take to catch up with one block */
+static const size_t MAX_BLOCK_STEPS = 1000000;
+
+/* Memory the generated programs use. Indexed accesses are kept in range by
+ * masking the index registers, and loop counters live above the data */
+static const uint16_t DATA_BASE = 0x3000;
+static const uint16_t DATA_SIZE = 4;
+static const uint16_t COUNTER_BASE = 0x3010;
+
+std::ostream& print_source(std::ostream &os, const dcpu16::operand_t &x)
+{
+	switch (x.which()) {
+		case 0: return os << boost::get<symbol>(x);
+		case 1: return os << boost::get<dcpu16::reg_t>(x);
+		default: return os << boost::get<uint16_t>(x);
+	}
+}
+
+/* Source form of a program, as accepted by tokenise_source */
+std::string program_source(const dcpu16::program &prog)
+{
+	std::ostringstream os;
+	for (const auto &ins : prog) {
+		if (!ins.label.empty()) os << ':' << ins.label << ' ';
+		os << dcpu16::OP_T_STR.at((size_t)ins.code) << ' ';
+		print_source(os, ins.b);
+		if (ins.code != dcpu16::op_t::OUT) print_source(os << ", ", ins.a);
+		os << '\n';
+	}
+	return os.str();
+}
+
+/**
+ * Random program that always terminates. Straight line code with every
+ * arithmetic and conditional op, forward branches and counted loops, so
+ * blocks start and end in all the ways the converter has to deal with.
+ */
+class program_generator {
+public:
+	explicit program_generator(uint32_t seed) : rng(seed), labels(0), loops(0) {}
+
+	dcpu16::program generate(size_t length)
+	{
+		this->prog.clear();
+		for (size_t r = 0; r < 8; r++) {
+			auto reg = static_cast<dcpu16::reg_t>(r);
+			this->add(dcpu16::op_t::SET, reg, static_cast<uint16_t>(this->is_index(reg) ? this->rng() % DATA_SIZE : this->rng()));
+		}
+		while (this->prog.size() < length) {
+			switch (this->rng() % 10) {
+				case 0: this->forward_branch(); break;
+				case 1: this->loop(); break;
+				default: this->straight(1 + this->rng() % 4); break;
+			}
+		}
+		/* Make everything visible in the output too */
+		for (size_t r = 0; r < (size_t)dcpu16::reg_t::NUM_REGS; r++) {
+			auto reg = static_cast<dcpu16::reg_t>(r);
+			if (reg == dcpu16::reg_t::PC || reg == dcpu16::reg_t::SP || reg == dcpu16::reg_t::IA) continue;
+			this->add(dcpu16::op_t::OUT, reg, dcpu16::operand_t());
+		}
+		for (uint16_t i = 0; i < DATA_SIZE; i++) {
+			this->add(dcpu16::op_t::OUT, this->memory(DATA_BASE + i), dcpu16::operand_t());
+		}
+		return std::move(this->prog);
+	}
+
+private:
+	std::mt19937 rng;
+	dcpu16::program prog;
+	size_t labels;
+	size_t loops;
+	std::string pending_label;
+
+	static bool is_index(dcpu16::reg_t r)
+	{
+		return r == dcpu16::reg_t::I || r == dcpu16::reg_t::J;
+	}
+
+	static dcpu16::operand_t memory(uint16_t addr)
+	{
+		return dcpu16::get_operand(string_format("[0x%x]", addr));
+	}
+
+	void add(dcpu16::op_t code, dcpu16::operand_t b, dcpu16::operand_t a)
+	{
+		this->prog.push_back({code, b, a, this->pending_label});
+		this->pending_label.clear();
+	}
+
+	dcpu16::operand_t operand(bool dest)
+	{
+		switch (this->rng() % 8) {
+			case 0:
+			case 1:
+			case 2:
+			case 3: return static_cast<dcpu16::reg_t>(this->rng() % 8);
+			case 4: if (!dest) return dcpu16::reg_t::EX; /* FALLTHROUGH */
+			case 5: return this->memory(DATA_BASE + this->rng() % DATA_SIZE);
+			case 6: return dcpu16::get_operand(string_format("[0x%x+%s]", DATA_BASE, this->rng() % 2 ? "I" : "J"));
+			default: {
+				static const std::vector<uint16_t> INTERESTING {0, 1, 2, 15, 16, 0x7fff, 0x8000, 0xffff};
+				return this->rng() % 2 ? INTERESTING[this->rng() % INTERESTING.size()] : static_cast<uint16_t>(this->rng());
+			}
+		}
+	}
+
+	void instruction()
+	{
+		auto r = this->rng() % 10;
+		if (r < 2) {
+			auto code = static_cast<dcpu16::op_t>((size_t)dcpu16::op_t::IFB + this->rng() % 8);
+			this->add(code, this->operand(false), this->operand(false));
+			/* Whatever is skipped should be an ordinary instruction */
+			this->instruction();
+			return;
+		}
+		if (r < 3) {
+			/* OUT of a literal prints an instruction, so never use one */
+			auto x = this->operand(false);
+			if (x.which() == 2) x = dcpu16::reg_t::A;
+			this->add(dcpu16::op_t::OUT, x, dcpu16::operand_t());
+			return;
+		}
+		auto code = static_cast<dcpu16::op_t>((size_t)dcpu16::op_t::SET + this->rng() % ((size_t)dcpu16::op_t::SHL + 1));
+		auto b = this->operand(true);
+		/* Indexed destinations would make the index masking below awkward */
+		if (b.which() == 0 && boost::get<symbol>(b).str().find('+') != std::string::npos) {
+			b = this->memory(DATA_BASE + this->rng() % DATA_SIZE);
+		}
+		dcpu16::operand_t a = this->operand(false);
+		/* Shift amounts are any of the 16 bits, but those around 16 and 32 are where the EX is worked out differently */
+		bool shift = code == dcpu16::op_t::SHR || code == dcpu16::op_t::ASR || code == dcpu16::op_t::SHL;
+		if (shift && a.which() == 2 && this->rng() % 2) a = static_cast<uint16_t>(this->rng() % 48);
+		this->add(code, b, a);
+		if (b.which() == 1 && this->is_index(boost::get<dcpu16::reg_t>(b))) {
+			this->add(dcpu16::op_t::AND, b, static_cast<uint16_t>(DATA_SIZE - 1));
+		}
+	}
+
+	void straight(size_t n)
+	{
+		for (size_t i = 0; i < n; i++) this->instruction();
+	}
+
+	std::string label()
+	{
+		return "L" + std::to_string(this->labels++);
+	}
+
+	void forward_branch()
+	{
+		std::string target = this->label();
+		this->add(dcpu16::op_t::SET, dcpu16::reg_t::PC, dcpu16::get_operand(target));
+		this->straight(1 + this->rng() % 2); // dead code
+		this->pending_label = target;
+		this->straight(1);
+	}
+
+	/* Body runs a few times, counted in memory the body never touches */
+	void loop()
+	{
+		auto counter = this->memory(COUNTER_BASE + this->loops++);
+		this->add(dcpu16::op_t::SET, counter, static_cast<uint16_t>(1 + this->rng() % 4));
+		std::string top = this->label();
+		this->pending_label = top;
+		this->straight(1 + this->rng() % 4);
+		this->add(dcpu16::op_t::SUB, counter, static_cast<uint16_t>(1));
+		this->add(dcpu16::op_t::IFN, counter, static_cast<uint16_t>(0));
+		this->add(dcpu16::op_t::SET, dcpu16::reg_t::PC, dcpu16::get_operand(top));
+	}
+};
+
+/**
+ * Runs the register machine and the converted program side by side, one
+ * converted block at a time, comparing registers, memory and output after
+ * each block.
+ * @param cost Set to the converted program's cost.
+ * @return Description of the first difference, empty if there were none.
+ */
+std::string lockstep(const dcpu16::program &prog, size_t optimise, size_t &cost)
+{
+	dcpu16::machine ref;
+	convertmachine conv;
+	ref.load(prog);
+	conv.load(prog, optimise, true);
+
+	std::ostringstream ref_out, conv_out;
+	auto old_buf = std::cout.rdbuf();
+	auto restore = [old_buf]() { std::cout.rdbuf(old_buf); };
+
+	const uint16_t slots_begin = reg2memaddr(static_cast<dcpu16::reg_t>((size_t)dcpu16::reg_t::NUM_REGS - 1));
+	for (bool running = true; running;) {
+		uint16_t block = conv.next_pc();
+		std::cout.rdbuf(conv_out.rdbuf());
+		try {
+			running = conv.step();
+		} catch (...) {
+			restore();
+			throw;
+		}
+
+		std::cout.rdbuf(ref_out.rdbuf());
+		size_t steps = 0;
+		bool ref_running = true;
+		do {
+			ref_running = ref.step();
+		} while (ref_running && (!running || ref.next_pc() != conv.next_pc()) && ++steps < MAX_BLOCK_STEPS);
+		restore();
+
+		std::string where = string_format("block %u (", block) + program_source({prog.at(block)});
+		where.back() = ')';
+		if (steps == MAX_BLOCK_STEPS) return where + ": register machine never reached the next block";
+		if (running != ref_running) {
+			return where + ": " + (running ? "register" : "converted") + " program stopped early";
+		}
+		for (size_t r = 0; r < (size_t)dcpu16::reg_t::NUM_REGS; r++) {
+			auto reg = static_cast<dcpu16::reg_t>(r);
+			if (reg == dcpu16::reg_t::PC || reg == dcpu16::reg_t::SP || reg == dcpu16::reg_t::IA) continue;
+			if (!conv.is_live(reg)) continue; // never read again, so may never be written
+			if (ref.reg(reg) != conv.reg(reg)) {
+				std::ostringstream os;
+				os << where << ": " << reg << " is " << conv.reg(reg) << ", expected " << ref.reg(reg);
+				return os.str();
+			}
+		}
+		for (uint32_t addr = 0; addr < 0x10000; addr++) {
+			if (addr == slots_begin) addr = 0x2000;
+			if (ref.memory(addr) != conv.memory(addr)) {
+				return where + string_format(": [0x%x] is %u, expected %u", addr, conv.memory(addr), ref.memory(addr));
+			}
+		}
+		if (ref_out.str() != conv_out.str()) return where + ": output differs";
+	}
+	cost = conv.cost();
+	return std::string();
+}
+
+/**
+ * Checks a program at every optimisation level. Each level's cost is only
+ * added to costs if they all match, so the totals stay comparable.
+ * @return Whether every level matched the register machine.
+ */
+bool check_program(const std::string &name, const dcpu16::program &prog, std::vector<size_t> &costs)
+{
+	std::vector<size_t> prog_costs(costs.size());
+	for (size_t optimise = 0; optimise <= MAX_OPTIMISE; optimise++) {
+		size_t &cost = prog_costs[optimise];
+		std::string diff;
+		try {
+			diff = lockstep(prog, optimise, cost);
+		} catch (const char *e) {
+			diff = e;
+		} catch (const std::string &e) {
+			diff = e;
+		}
+		if (!diff.empty()) {
+			std::cerr << name << " -o" << optimise << ": " << diff << '\n';
+			return false;
+		}
+	}
+	std::transform(costs.begin(), costs.end(), prog_costs.begin(), costs.begin(), std::plus<size_t>());
+	return true;
+}
+
+void printUsage(const char *arg0)
+{
+	static const char *USAGE = ""
+		"%s - checks converted code against the register machine\n"
+		"\n"
+		"Usage: %s [-n count] [-s seed] [-l length] [-p rules] [file...]\n"
+		"\n"
+		"Runs each program through the register machine and the converter\n"
+		"at every optimisation level in lockstep, stopping at the first\n"
+		"difference in registers, memory or output after a block.\n"
+		"\n"
+		"-n count  - Number of random programs (default 1000)\n"
+		"-s seed   - Seed of the first random program (default 0)\n"
+		"-l length - Length of the random programs (default 50)\n"
+		"-p rules  - Peephole rules to use instead of the built in ones\n"
+		"file      - Check these programs instead of random ones\n";
+	printf(USAGE, arg0, arg0);
+}
+
+int main(int argc, char **argv)
+{
+	size_t count = 1000;
+	uint32_t first_seed = 0;
+	size_t length = 50;
+	int c = 0;
+	while ((c = getopt(argc, argv, "hn:s:l:p:")) != -1) {
+		switch (c) {
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 's':
+				first_seed = atoi(optarg);
+				break;
+			case 'l':
+				length = atoi(optarg);
+				break;
+			case 'p': {
+				std::ifstream file(optarg);
+				if (!file) {
+					std::cerr << "Error opening " << optarg << '\n';
+					return 1;
+				}
+				std::string rules((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+				try {
+					peephole_rules().load(rules);
+				} catch (const std::string &e) {
+					std::cerr << e << '\n';
+					return 1;
+				}
+				break;
+			}
+			case 'h':
+				printUsage(argv[0]);
+				return 0;
+			default:
+				printUsage(argv[0]);
+				return 1;
+		}
+	}
+
+	std::vector<size_t> costs(MAX_OPTIMISE + 1);
+	size_t failures = 0;
+	size_t checked = 0;
+	if (optind < argc) {
+		for (int i = optind; i < argc; i++) {
+			std::ifstream file(argv[i]);
+			if (!file) {
+				std::cerr << "Error opening " << argv[i] << '\n';
+				return 1;
+			}
+			std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			if (!check_program(argv[i], dcpu16::tokenise_source(source), costs)) failures++;
+			checked++;
+		}
+	} else {
+		for (uint32_t seed = first_seed; seed < first_seed + count; seed++) {
+			dcpu16::program prog = program_generator(seed).generate(length);
+			if (!check_program("seed " + std::to_string(seed), prog, costs)) {
+				std::cerr << program_source(prog);
+				failures++;
+			}
+			checked++;
+		}
+	}
+
+	std::cout << checked - failures << '/' << checked << " programs matched at every level\n";
+	for (size_t optimise = 0; optimise <= MAX_OPTIMISE; optimise++) {
+		double change = costs[0] == 0 ? 0 : 100.0 * ((double)costs[optimise] - costs[0]) / costs[0];
+		std::cout << "-o" << optimise << " cost " << costs[optimise] << string_format(" (%+.1f%%)", change) << '\n';
+	}
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,275 @@
+#include <algorithm>
+
+#include "liveness.hpp"
+#include "register_convert.hpp"
+#include "util.hpp"
+
+namespace liveness {
+
+/* Registers the analysis follows, the rest are always live */
+static bool tracked(dcpu16::reg_t r)
+{
+	return r <= dcpu16::reg_t::J || r == dcpu16::reg_t::EX;
+}
+
+static reg_set untracked()
+{
+	reg_set regs;
+	for (size_t r = 0; r < regs.size(); r++) {
+		if (!tracked(static_cast<dcpu16::reg_t>(r))) regs.set(r);
+	}
+	return regs;
+}
+
+static bool sets_ex(dcpu16::op_t op)
+{
+	switch (op) {
+		case dcpu16::op_t::ADD:
+		case dcpu16::op_t::SUB:
+		case dcpu16::op_t::MUL:
+		case dcpu16::op_t::MLI:
+		case dcpu16::op_t::DIV:
+		case dcpu16::op_t::DVI:
+		case dcpu16::op_t::SHR:
+		case dcpu16::op_t::ASR:
+		case dcpu16::op_t::SHL:
+		case dcpu16::op_t::ADX:
+		case dcpu16::op_t::SBX:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Adds the registers read to use an operand.
+ * @param written Whether the operand is only written, so a plain register
+ *                isn't read (a memory operand still reads its address).
+ */
+static void operand_uses(const dcpu16::operand_t &x, bool written, reg_set &uses)
+{
+	if (x.which() == 1) {
+		if (!written) uses.set((size_t)boost::get<dcpu16::reg_t>(x));
+		return;
+	}
+	if (x.which() != 0) return;
+
+	/* [r], [r+n], r+n etc, anything else in there is a number or label */
+	const std::string &op = boost::get<symbol>(x).str();
+	size_t begin = dcpu16::is_array_type(op) ? 1 : 0;
+	size_t end = dcpu16::is_array_type(op) ? op.size() - 1 : op.size();
+	while (begin <= end) {
+		size_t pos = std::min(op.find('+', begin), end);
+		auto r = std::find(dcpu16::REG_T_STR.begin(), dcpu16::REG_T_STR.end(), op.substr(begin, pos - begin));
+		if (r != dcpu16::REG_T_STR.end()) uses.set(r - dcpu16::REG_T_STR.begin());
+		begin = pos + 1;
+	}
+}
+
+void uses_defs(const dcpu16::instruction &ins, reg_set &uses, reg_set &defs)
+{
+	switch (ins.code) {
+		case dcpu16::op_t::SET:
+		case dcpu16::op_t::ADD:
+		case dcpu16::op_t::SUB:
+		case dcpu16::op_t::MUL:
+		case dcpu16::op_t::MLI:
+		case dcpu16::op_t::DIV:
+		case dcpu16::op_t::DVI:
+		case dcpu16::op_t::MOD:
+		case dcpu16::op_t::MDI:
+		case dcpu16::op_t::AND:
+		case dcpu16::op_t::BOR:
+		case dcpu16::op_t::XOR:
+		case dcpu16::op_t::SHR:
+		case dcpu16::op_t::ASR:
+		case dcpu16::op_t::SHL:
+		case dcpu16::op_t::ADX:
+		case dcpu16::op_t::SBX:
+			operand_uses(ins.a, false, uses);
+			operand_uses(ins.b, ins.code == dcpu16::op_t::SET, uses);
+			if (ins.code == dcpu16::op_t::ADX || ins.code == dcpu16::op_t::SBX) uses.set((size_t)dcpu16::reg_t::EX);
+			if (sets_ex(ins.code)) defs.set((size_t)dcpu16::reg_t::EX);
+			if (ins.b.which() == 1 && tracked(boost::get<dcpu16::reg_t>(ins.b))) {
+				defs.set((size_t)boost::get<dcpu16::reg_t>(ins.b));
+			}
+			break;
+		case dcpu16::op_t::IFB:
+		case dcpu16::op_t::IFC:
+		case dcpu16::op_t::IFE:
+		case dcpu16::op_t::IFN:
+		case dcpu16::op_t::IFG:
+		case dcpu16::op_t::IFA:
+		case dcpu16::op_t::IFL:
+		case dcpu16::op_t::IFU:
+			operand_uses(ins.b, false, uses);
+			operand_uses(ins.a, false, uses);
+			break;
+		case dcpu16::op_t::OUT:
+			operand_uses(ins.b, false, uses);
+			break;
+		default:
+			break;
+	}
+}
+
+/**
+ * Where control can go after instruction pc, nowhere for a stop.
+ * @return False if that isn't known.
+ */
+bool analysis::successors(const dcpu16::program &prog, size_t pc, std::vector<size_t> &succ) const
+{
+	const auto &ins = prog[pc];
+	if (ins.code == dcpu16::op_t::JSR || ins.code == dcpu16::op_t::STI || ins.code == dcpu16::op_t::STD) return false;
+	if (ins.b.which() == 1 && boost::get<dcpu16::reg_t>(ins.b) == dcpu16::reg_t::PC) {
+		if (ins.code != dcpu16::op_t::SET) return false;
+		if (ins.a.which() == 1 && boost::get<dcpu16::reg_t>(ins.a) == dcpu16::reg_t::PC) return true; // stop
+		if (ins.a.which() != 0) return false;
+		auto label = this->labels.find(boost::get<symbol>(ins.a));
+		if (label == this->labels.end()) return false;
+		succ.push_back(label->second);
+		return true;
+	}
+	succ.push_back(pc + 1);
+	if (ins.code >= dcpu16::op_t::IFB && ins.code <= dcpu16::op_t::IFU) succ.push_back(std::min(pc + 2, prog.size()));
+	return true;
+}
+
+analysis::analysis(const dcpu16::program &prog) : live(prog.size() + 1, untracked()), live_out(prog.size())
+{
+	for (size_t pc = 0; pc < prog.size(); pc++) {
+		if (!prog[pc].label.empty()) this->labels.emplace(prog[pc].label, pc);
+	}
+
+	std::vector<reg_set> uses(prog.size()), defs(prog.size());
+	std::vector<std::vector<size_t>> succ(prog.size());
+	std::vector<bool> unknown(prog.size());
+	for (size_t pc = 0; pc < prog.size(); pc++) {
+		uses_defs(prog[pc], uses[pc], defs[pc]);
+		unknown[pc] = !this->successors(prog, pc, succ[pc]);
+	}
+
+	/* Backwards until nothing changes, loops need more than one pass */
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (size_t pc = prog.size(); pc-- > 0;) {
+			reg_set out = unknown[pc] ? reg_set().set() : untracked();
+			for (auto s : succ[pc]) out |= this->live[s];
+			reg_set in = uses[pc] | (out & ~defs[pc]);
+			if (in != this->live[pc]) {
+				this->live[pc] = in;
+				changed = true;
+			}
+			this->live_out[pc] = out;
+		}
+	}
+}
+
+reg_set analysis::at(symbol label) const
+{
+	auto pos = this->labels.find(label);
+	if (pos == this->labels.end()) return reg_set().set();
+	return this->live[pos->second];
+}
+
+/* Register whose memory slot a SET is the address of, NUM_REGS if none */
+static dcpu16::reg_t slot(const j5::instruction &ins)
+{
+	if (ins.code != j5::op_t::SET || ins.op.which() != 1) return dcpu16::reg_t::NUM_REGS;
+	uint16_t addr = boost::get<uint16_t>(ins.op);
+	for (size_t r = 0; r < (size_t)dcpu16::reg_t::NUM_REGS; r++) {
+		auto reg = static_cast<dcpu16::reg_t>(r);
+		if (tracked(reg) && reg2memaddr(reg) == addr) return reg;
+	}
+	return dcpu16::reg_t::NUM_REGS;
+}
+
+/**
+ * Dead store elimination for register slots. Works back through a block
+ * (local branches and all) from what is live wherever it is left, and turns
+ * the SET/STORE writing a register no one reads before it is written again
+ * into a DROP of the value, leaving the peephole to tidy up what made it.
+ * Other memory accesses are assumed not to touch the slots, as dataflow does.
+ * @param live_exit Live registers wherever the block is left.
+ */
+j5::program eliminate_dead_stores(j5::program prog, const exit_liveness &live_exit)
+{
+	std::map<symbol, size_t> labels;
+	for (size_t k = 0; k < prog.size(); k++) {
+		if (prog[k].code == j5::op_t::LABEL) labels[prog[k].label] = k;
+	}
+	std::vector<reg_set> live(prog.size() + 1);
+	std::map<symbol, reg_set> exits;
+	auto leaving = [&](symbol label) {
+		auto pos = exits.find(label);
+		if (pos == exits.end()) pos = exits.emplace(label, live_exit(label)).first;
+		return pos->second;
+	};
+	/* Where a branch goes, all live if it's already been laid out */
+	auto target = [&](const j5::instruction &ins) {
+		if (ins.op.which() != 2) return reg_set().set();
+		symbol label = boost::get<symbol>(ins.op);
+		if (!j5::is_local_label(label)) return leaving(label);
+		auto pos = labels.find(label);
+		if (pos == labels.end()) throw "Undefined local label '" + label.str() + "'";
+		return live[pos->second];
+	};
+
+	live[prog.size()] = leaving(symbol());
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (size_t k = prog.size(); k-- > 0;) {
+			const auto &ins = prog[k];
+			reg_set now;
+			switch (ins.code) {
+				case j5::op_t::STOP:
+					break;
+				case j5::op_t::BRANCH:
+					now = target(ins);
+					break;
+				case j5::op_t::BRZERO:
+					now = live[k + 1] | target(ins);
+					break;
+				default:
+					now = live[k + 1];
+					break;
+			}
+			auto r = slot(ins);
+			if (r != dcpu16::reg_t::NUM_REGS && k + 1 < prog.size()) {
+				if (prog[k + 1].code == j5::op_t::LOAD) now.set((size_t)r);
+				if (prog[k + 1].code == j5::op_t::STORE) now.reset((size_t)r);
+			}
+			if (now != live[k]) {
+				live[k] = now;
+				changed = true;
+			}
+		}
+	}
+
+	j5::program out;
+	out.reserve(prog.size());
+	size_t removed = 0;
+	for (size_t k = 0; k < prog.size(); k++) {
+		auto r = slot(prog[k]);
+		if (r != dcpu16::reg_t::NUM_REGS && k + 1 < prog.size() && prog[k + 1].code == j5::op_t::STORE
+				&& !live[k + 2].test((size_t)r)) {
+			/* Sums made only for the slot go with it, as a bias coming off */
+			while (out.size() >= 2 && prog[k].label.empty() && out.back().label.empty()
+					&& (out.back().code == j5::op_t::ADD || out.back().code == j5::op_t::SUB)
+					&& out[out.size() - 2].code == j5::op_t::SET && out[out.size() - 2].op.which() == 1
+					&& out[out.size() - 2].label.empty()) {
+				out.resize(out.size() - 2);
+			}
+			out.push_back({prog[k].label, j5::op_t::DROP, boost::blank()});
+			j5::inherit_origin(out.back(), prog[k]);
+			k++;
+			removed++;
+			continue;
+		}
+		out.push_back(prog[k]);
+	}
+	if (removed > 0) log<LOG_DEBUG2>("# Dead stores: ", removed);
+	return out;
+}
+
+}
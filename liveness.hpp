@@ -0,0 +1,63 @@
+#ifndef LIVENESS_HPP
+#define LIVENESS_HPP
+
+#include <bitset>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "register_machine.hpp"
+#include "stack_machine.hpp"
+
+namespace liveness {
+
+using reg_set = std::bitset<(size_t)dcpu16::reg_t::NUM_REGS>;
+
+/**
+ * Which registers might still be read before being written again, at each
+ * instruction of a program. Worked out over the control flow graph, so it
+ * holds whichever way a block is reached. PC, SP and IA aren't followed and
+ * are always live, as is everything where control goes somewhere unknown
+ * (SET PC, A and the like).
+ */
+class analysis {
+public:
+	analysis() = default;
+	explicit analysis(const dcpu16::program &prog);
+
+	/* Live registers before instruction pc, or at the end of the program */
+	inline reg_set before(size_t pc) const
+	{
+		return this->live.at(pc);
+	}
+	/* Live registers after each instruction, whichever way it goes */
+	inline const std::vector<reg_set> &after() const
+	{
+		return this->live_out;
+	}
+	/* Live registers at a label, all of them if there is no such label */
+	reg_set at(symbol label) const;
+
+private:
+	std::vector<reg_set> live; ///< Before each instruction, then the end
+	std::vector<reg_set> live_out;
+	std::map<symbol, size_t> labels;
+
+	bool successors(const dcpu16::program &prog, size_t pc, std::vector<size_t> &succ) const;
+};
+
+/* Registers an instruction reads, and the tracked ones it overwrites */
+void uses_defs(const dcpu16::instruction &ins, reg_set &uses, reg_set &defs);
+
+/**
+ * Live registers when a block is left by branching to the label, or by
+ * falling through to the next block for an empty label.
+ */
+using exit_liveness = std::function<reg_set(symbol label)>;
+
+j5::program eliminate_dead_stores(j5::program prog, const exit_liveness &live_exit);
+
+}
+
+#endif /* LIVENESS_HPP */
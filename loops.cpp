@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <map>
+
+#include "loops.hpp"
+
+namespace loops {
+
+/* Label an instruction can go to, empty if it doesn't name one */
+static symbol branch_target(const dcpu16::instruction &ins)
+{
+	bool sets_pc = ins.code == dcpu16::op_t::SET && ins.b.which() == 1
+		&& boost::get<dcpu16::reg_t>(ins.b) == dcpu16::reg_t::PC;
+	if ((!sets_pc && ins.code != dcpu16::op_t::JSR) || ins.a.which() != 0) return symbol();
+	return boost::get<symbol>(ins.a);
+}
+
+/* Whether an instruction can change registers uses_defs doesn't know about */
+static bool clobbers(const dcpu16::instruction &ins)
+{
+	return ins.code == dcpu16::op_t::JSR || ins.code == dcpu16::op_t::STI || ins.code == dcpu16::op_t::STD;
+}
+
+std::vector<loop> find_loops(const dcpu16::program &prog)
+{
+	std::map<symbol, size_t> labels;
+	for (size_t pc = 0; pc < prog.size(); pc++) {
+		if (!prog[pc].label.empty()) labels.emplace(prog[pc].label, pc);
+	}
+
+	std::vector<std::pair<size_t, size_t>> jumps; ///< From, to
+	std::map<size_t, size_t> back; ///< Furthest branch back to each label
+	for (size_t pc = 0; pc < prog.size(); pc++) {
+		auto to = labels.find(branch_target(prog[pc]));
+		if (to == labels.end()) continue;
+		jumps.emplace_back(pc, to->second);
+		if (to->second <= pc) back[to->second] = pc + 1;
+	}
+
+	std::vector<loop> found;
+	for (const auto &b : back) {
+		loop l{b.first, b.second, liveness::reg_set()};
+		bool side_entry = std::any_of(jumps.begin(), jumps.end(), [&l](const std::pair<size_t, size_t> &j) {
+			return (j.first < l.header || j.first >= l.end) && j.second > l.header && j.second < l.end;
+		});
+		if (side_entry) continue;
+
+		liveness::reg_set uses, defs;
+		bool unknown = false;
+		for (size_t pc = l.header; pc < l.end; pc++) {
+			liveness::uses_defs(prog[pc], uses, defs);
+			unknown |= clobbers(prog[pc]);
+		}
+		if (!unknown) {
+			for (size_t r = 0; r <= (size_t)dcpu16::reg_t::J; r++) {
+				l.invariant[r] = uses[r] && !defs[r];
+			}
+		}
+		found.push_back(l);
+	}
+	std::stable_sort(found.begin(), found.end(), [](const loop &a, const loop &b) {
+		return a.end - a.header < b.end - b.header;
+	});
+	return found;
+}
+
+const loop *innermost(const std::vector<loop> &found, size_t pc)
+{
+	auto it = std::find_if(found.begin(), found.end(), [pc](const loop &l) {
+		return l.header <= pc && pc < l.end;
+	});
+	return it != found.end() ? &*it : nullptr;
+}
+
+}
@@ -0,0 +1,30 @@
+#ifndef LOOPS_HPP
+#define LOOPS_HPP
+
+#include <vector>
+
+#include "liveness.hpp"
+#include "register_machine.hpp"
+
+namespace loops {
+
+/**
+ * A loop in a register program: a label that a later SET PC branches back
+ * to, running up to the last such branch. Only loops that are entered at the
+ * top are found, any other way in and the range isn't a loop.
+ */
+struct loop {
+	size_t header; ///< Index of the labelled first instruction
+	size_t end; ///< One past the last branch back to the header
+	liveness::reg_set invariant; ///< Registers read in the loop but never written
+};
+
+/* Loops in a program, innermost (shortest) first */
+std::vector<loop> find_loops(const dcpu16::program &prog);
+
+/* Innermost loop containing instruction pc, null if there isn't one */
+const loop *innermost(const std::vector<loop> &found, size_t pc);
+
+}
+
+#endif /* LOOPS_HPP */
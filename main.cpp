@@ -1,43 +1,64 @@
 #include <fstream>
 #include <iostream>
-#include <iterator>
+#include <memory>
 #include <unistd.h>
 
 #include "convert_machine.hpp"
+#include "optimise.hpp"
+#include "output.hpp"
+#include "perf_counters.hpp"
+#include "profile.hpp"
 #include "register_machine.hpp"
+#include "sampler.hpp"
 #include "stack_machine.hpp"
 #include "util.hpp"
 
 log_level_t GLOBAL_LOG_LEVEL = LOG_INFO; // default, not actually a constant
 
-std::string readFile(const std::string &filename)
-{
-	std::ifstream file(filename);
-	if (!file) throw "Error opening input file";
-	file.unsetf(std::ios_base::skipws);
-	std::istream_iterator<char> begin(file), end;
-	std::string buffer(begin, end);
-	return buffer;
-}
-
-
 void printUsage(const char *arg0)
 {
 	static const char *USAGE = ""
 		"%s - an interpreter of some sort.\n"
 		"Does something with stacks\n"
 		"\n"
-		"Usage: %s [-v lvl] [-f] [-o num] [-scr] file\n"
+		"Usage: %s [-v lvl] [-f] [-o num] [-m bytes] [-p rules] [-t costs] [-P file] [-F file] [-H] [-B] [-scr] file\n"
 		"\n"
 		"-v lvl  -  Output verbosity - 0-3\n"
 		"-f      -  Fast speed\n"
-		"-o num  -  Only has affect with -c. Level 1 indicates single\n"
-		"           peephole pass, Level 2 does Koopman-style optimisation\n"
+		"-o num  -  Only has affect with -c. Level 1 converts through a\n"
+		"           dataflow graph (constant/copy propagation and common\n"
+		"           subexpressions), keeps registers on the stack within\n"
+		"           a block and runs the peephole rules until none\n"
+		"           apply, Level 2 does Koopman-style optimisation,\n"
+		"           Level 3 tries different conversions and orders of\n"
+		"           passes for each block and keeps the cheapest\n"
+		"-m bytes - Only has affect with -c. Memory budget for translated\n"
+		"           blocks, least recently used blocks are evicted first\n"
+		"           (default 0, unbounded)\n"
+		"-p rules - Only has affect with -c. File of peephole rules to\n"
+		"           use instead of the built in ones\n"
+		"-t costs - Only has affect with -c. File of instruction costs\n"
+		"           (\"LOAD 3\" per line), for working out the program\n"
+		"           cost and for level 3 to go by\n"
+		"-P file -  Count how often each instruction and block runs, and\n"
+		"           which way conditionals go, and write the counts to\n"
+		"           file, hottest first\n"
+		"-F file -  Sample where the program is every 100us and write the\n"
+		"           samples to file as folded stacks, for flamegraph.pl.\n"
+		"           With -c each stack instruction is under the register\n"
+		"           instruction it was converted from. Use with -f\n"
+		"-H      -  Count cycles, instructions, branch misses and cache\n"
+		"           misses of running and of converting blocks with the\n"
+		"           CPU's performance counters, and print them per\n"
+		"           instruction run to stderr. Linux only\n"
+		"-B      -  Write output values as two bytes each, little\n"
+		"           endian, instead of a line of text each\n"
 		"-c      -  Convert register code\n"
 		"-s      -  Stack (J5) interpreter\n"
 		"-r      -  Register (DCPU-16) interpreter\n"
 		"-h      -  This help text\n"
-		"file    -  ASM source file to run\n";
+		"file    -  ASM source file to run. If it's - (stdin) or a pipe\n"
+		"           it's run as it's read\n";
 	printf(USAGE, arg0, arg0);
 }
 
@@ -47,15 +68,125 @@ enum class mode {
 	CONVERT,
 };
 
+/* Logs each instruction of a streamed program as it's read, like the whole program is otherwise */
+template <typename Reader>
+Reader logged(const Reader &reader)
+{
+	return [reader](auto &prog) {
+		if (!reader(prog)) return false;
+		log<LOG_INFO>(prog.back());
+		return true;
+	};
+}
+
+/* What to measure a run with, each null if it isn't wanted */
+struct instruments {
+	profile *prof;
+	const char *profilepath;
+	sampler *samp;
+	const char *samplepath;
+	perf_counters *counters;
+
+	template <typename Machine>
+	void attach(Machine &mach) const
+	{
+		mach.attach(this->prof);
+		mach.attach(this->counters);
+		mach.attach(this->samp);
+		if (this->samp != nullptr) this->samp->start();
+	}
+
+	/* Writes out what was measured of a run, guest_name being what the machine runs */
+	template <typename Machine>
+	void report(const Machine &mach, const char *guest_name) const
+	{
+		if (this->prof != nullptr) {
+			std::ofstream out(this->profilepath);
+			if (!out) throw std::string("Error opening ") + this->profilepath;
+			this->prof->report(out, mach.loaded());
+		}
+		if (this->samp != nullptr) {
+			this->samp->stop();
+			std::ofstream out(this->samplepath);
+			if (!out) throw std::string("Error opening ") + this->samplepath;
+			this->samp->write(out);
+		}
+		if (this->counters != nullptr) this->counters->report(std::cerr, guest_name);
+	}
+};
+
+/**
+ * Where the guest's output goes. It's written to stdout in big writes of its
+ * own, unless the log is being written there while it runs or it's being run
+ * slowly enough to watch.
+ * @param stream Whether the program is run as it's read, so its listing is
+ *               logged as it runs.
+ */
+std::unique_ptr<output> guest_output(bool stream, bool speedlimit, output::format fmt)
+{
+	if (GLOBAL_LOG_LEVEL >= LOG_DEBUG || (stream && GLOBAL_LOG_LEVEL >= LOG_INFO)) {
+		return std::unique_ptr<output>(new stream_output(std::cout, fmt));
+	}
+	return std::unique_ptr<output>(new fd_output(STDOUT_FILENO, fmt, speedlimit ? 0 : fd_output::DEFAULT_CAPACITY));
+}
+
+/* Sends what mach outputs to out, after anything already logged */
+template <typename Machine>
+void connect(Machine &mach, output &out)
+{
+	std::cout.flush();
+	mach.output_to(out);
+}
+
+/* Runs a source that's still coming, starting before the end has been read */
+void run_stream(std::istream &in, mode m, bool speedlimit, size_t optimise, bool cache, size_t cache_budget,
+		const instruments &tools, output &out)
+{
+	switch (m) {
+		case mode::REGISTER: {
+			dcpu16::machine mach;
+			tools.attach(mach);
+			connect(mach, out);
+			mach.run(logged(dcpu16::read_program(in)), speedlimit);
+			tools.report(mach, "DCPU-16");
+			break;
+		}
+		case mode::STACK: {
+			j5::machine mach;
+			tools.attach(mach);
+			connect(mach, out);
+			mach.run(logged(j5::read_program(in)), speedlimit);
+			tools.report(mach, "J5");
+			break;
+		}
+		case mode::CONVERT: {
+			convertmachine mach(cache_budget);
+			tools.attach(mach);
+			connect(mach, out);
+			mach.run_reg(logged(dcpu16::read_program(in)), speedlimit, optimise, cache);
+			tools.report(mach, "stack");
+			break;
+		}
+	}
+}
+
 int main(int argc, char **argv)
 {
+	std::ios::sync_with_stdio(false);
 	bool speedlimit = true;
 	size_t optimise = 0;
 	bool nocache = false;
+	size_t cache_budget = 0;
 	mode m;
 	const char *filepath = "";
+	const char *rulespath = "";
+	const char *costspath = "";
+	const char *profilepath = "";
+	const char *samplepath = "";
+	bool hwcounters = false;
+	output::format fmt = output::format::TEXT;
 	int c = 0;
-	while ((c = getopt(argc, argv, "hnfv:o:c:s:r:")) != -1) {
+	while ((c = getopt(argc, argv, "hnfHBv:o:m:p:t:P:F:c:s:r:")) != -1) {
 		switch (c) {
 			case 'v':
 				GLOBAL_LOG_LEVEL = static_cast<log_level_t>(atoi(optarg));
@@ -81,6 +212,27 @@ int main(int argc, char **argv)
 			case 'o':
 				optimise = atoi(optarg);
 				break;
+			case 'm':
+				cache_budget = atoi(optarg);
+				break;
+			case 'p':
+				rulespath = optarg;
+				break;
+			case 't':
+				costspath = optarg;
+				break;
+			case 'P':
+				profilepath = optarg;
+				break;
+			case 'F':
+				samplepath = optarg;
+				break;
+			case 'H':
+				hwcounters = true;
+				break;
+			case 'B':
+				fmt = output::format::BINARY;
+				break;
 			case 'h':
 				printUsage(argv[0]);
 				return 0;
@@ -95,33 +247,63 @@ int main(int argc, char **argv)
 	}
 
 	try {
-		std::string source = readFile(filepath);
+		if (strcmp(rulespath, "") != 0) peephole_rules().load(mapped_file(rulespath).text().to_string());
+		if (strcmp(costspath, "") != 0) cost_table().load(mapped_file(costspath).text().to_string());
+		profile counts;
+		sampler samples;
+		std::unique_ptr<perf_counters> counters;
+		if (hwcounters) counters.reset(new perf_counters());
+		instruments tools{strcmp(profilepath, "") != 0 ? &counts : nullptr, profilepath,
+			strcmp(samplepath, "") != 0 ? &samples : nullptr, samplepath, counters.get()};
+		std::unique_ptr<output> out = guest_output(is_stream(filepath), speedlimit, fmt);
+		if (is_stream(filepath)) {
+			if (strcmp(filepath, "-") == 0) {
+				run_stream(std::cin, m, speedlimit, optimise, !nocache, cache_budget, tools, *out);
+			} else {
+				std::ifstream in(filepath);
+				if (!in) throw std::string("Error opening ") + filepath;
+				run_stream(in, m, speedlimit, optimise, !nocache, cache_budget, tools, *out);
+			}
+			if (fmt == output::format::TEXT) std::cout << '\n';
+			return 0;
+		}
+
+		mapped_file file(filepath);
+		boost::string_view source = file.text();
 
 		switch (m) {
 			case mode::REGISTER: {
 				dcpu16::program prog = dcpu16::tokenise_source(source);
 				for (const auto &ins : prog) log<LOG_INFO>(ins);
 				dcpu16::machine mach;
+				tools.attach(mach);
+				connect(mach, *out);
 				mach.run(prog, speedlimit);
-
+				tools.report(mach, "DCPU-16");
 				break;
 			}
 			case mode::STACK: {
 				j5::program prog = j5::tokenise_source(source);
 				for (const auto &ins : prog) log<LOG_INFO>(ins);
 				j5::machine mach;
+				tools.attach(mach);
+				connect(mach, *out);
 				mach.run(prog, speedlimit);
+				tools.report(mach, "J5");
 				break;
 			}
 			case mode::CONVERT: {
 				dcpu16::program prog = dcpu16::tokenise_source(source);
 				for (const auto &ins : prog) log<LOG_INFO>(ins);
-				convertmachine mach;
+				convertmachine mach(cache_budget);
+				tools.attach(mach);
+				connect(mach, *out);
 				mach.run_reg(prog, speedlimit, optimise, !nocache);
+				tools.report(mach, "stack");
 				break;
 			}
 		}
-		std::cout << '\n';
+		if (fmt == output::format::TEXT) std::cout << '\n';
 
 	} catch(const char *e) {
 		log<LOG_NOTHING>(e);
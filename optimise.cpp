@@ -1,160 +1,524 @@
+#include <algorithm>
 #include <iostream>
-#include <numeric>
+#include <map>
+#include <sstream>
 
 #include "optimise.hpp"
 #include "util.hpp"
 
-template <typename Vector, typename F, std::size_t... Is>
-auto callWithSlice(std::size_t i, Vector& v, F&& f, std::index_sequence<Is...>)
+void peephole::add(const std::string &name, const std::vector<j5::op_t> &pattern, rewrite_t rewrite)
 {
-    return f(v, v.begin() + i + Is...);
+	if (pattern.empty()) throw "Peephole rule '" + name + "' has an empty pattern";
+	this->by_last[(size_t)pattern.back()].push_back(this->rules.size());
+	this->rules.push_back({name, pattern, std::move(rewrite), std::make_unique<std::atomic<size_t>>(0)});
+	this->longest = std::max(this->longest, pattern.size());
 }
 
-template <std::size_t N, typename Vector, typename F>
-auto patchVector(Vector v, F&& f)
+/**
+ * Tries the rules against the code ending at prog[end - 1].
+ * @param replacement Filled with the new code if a rule matched.
+ * @return The rule that matched, or nullptr.
+ */
+peephole::rule *peephole::match(const j5::program &prog, size_t end, j5::program &replacement)
 {
-    for (size_t i = 0; v.size() >= N && i < v.size() - N + 1; ++i) {
-        callWithSlice(i, v, std::forward<F>(f), std::make_index_sequence<N>{});
-    }
-	return v;
+	for (size_t idx : this->by_last[(size_t)prog[end - 1].code]) {
+		rule &r = this->rules[idx];
+		size_t n = r.pattern.size();
+		if (n > end) continue;
+		const j5::instruction *m = &prog[end - n];
+		bool same = true;
+		for (size_t k = 0; k < n && same; k++) {
+			/* Only the first instruction may be a branch target */
+			same = m[k].code == r.pattern[k] && (k == 0 || m[k].label.empty());
+		}
+		if (!same) continue;
+
+		replacement.clear();
+		if (!r.rewrite(m, replacement)) continue;
+		if (replacement.size() >= n) throw "Peephole rule '" + r.name + "' doesn't shorten the code";
+		for (auto &ins : replacement) j5::inherit_origin(ins, m[0]);
+		if (!m[0].label.empty()) {
+			/* Nothing left to carry the label */
+			if (replacement.empty()) continue;
+			replacement[0].label = m[0].label;
+		}
+		(*r.hits)++;
+		return &r;
+	}
+	return nullptr;
 }
 
-const auto opt_addone = [](auto &v, auto a, auto b) {
-	if (a->code == j5::op_t::SET && a->op.which() == 1 && boost::get<uint16_t>(a->op) == 1 && b->code == j5::op_t::ADD) {
-		*a = j5::make_instruction(j5::op_t::INC);
-		v.erase(b);
+/**
+ * Runs every rule over the code in one sweep. Instructions are moved to the
+ * output one at a time, and each time the rules ending with that opcode are
+ * tried against the end of the output. The code from a rewrite goes back on
+ * the input, so it gets matched against what comes before it too. Rewrites
+ * always shorten the code, so they fit in the space already read, and as
+ * the output only changes at its end, nothing is left to match at the end.
+ */
+j5::program peephole::run(j5::program prog)
+{
+	size_t w = 0; // prog[0, w) is output
+	size_t r = 0; // prog[r, size) is input
+	j5::program replacement;
+	replacement.reserve(this->longest);
+	while (r < prog.size()) {
+		if (w != r) prog[w] = std::move(prog[r]);
+		w++;
+		r++;
+		const rule *hit = this->match(prog, w, replacement);
+		if (hit == nullptr) continue;
+		w -= hit->pattern.size();
+		r -= replacement.size();
+		std::move(replacement.begin(), replacement.end(), prog.begin() + r);
 	}
-};
+	prog.resize(w);
+	return prog;
+}
 
-const auto opt_subone = [](auto &v, auto a, auto b) {
-	if (a->code == j5::op_t::SET && a->op.which() == 1 && boost::get<uint16_t>(a->op) == 1 && b->code == j5::op_t::SUB) {
-		*a = j5::make_instruction(j5::op_t::DEC);
-		v.erase(b);
+void peephole::report() const
+{
+	for (const auto &r : this->rules) {
+		if (*r.hits > 0) log<LOG_DEBUG>("Peephole ", r.name, ": ", r.hits->load());
 	}
+}
+
+/**
+ * Rules used unless a rule file is given. Each line is
+ *   name: pattern => replacement
+ * where pattern and replacement are J5 instructions separated by commas.
+ * A SET operand is a number to match or produce, or a $variable, which
+ * matches anything but has to be the same everywhere it is used. A SET
+ * with no operand in a pattern matches any SET. ';' starts a comment.
+ */
+static const char *DEFAULT_RULES = R"(
+addone:    SET 1, ADD => INC
+subone:    SET 1, SUB => DEC
+testzero:  SET 0, TEQ, DROP => TSZ
+storeload: SET $a, STORE, SET $a, LOAD => DUP, SET $a, STORE
+dupswap:   DUP, SWAP => DUP
+swapswap:  SWAP, SWAP =>
+setdrop:   SET, DROP =>
+dupdrop:   DUP, DROP =>
+tuckdrop:  TUCK2, DROP => SWAP
+copydrop:  COPY3, DROP =>
+loaddrop:  LOAD, DROP => DROP
+)";
+
+/* One instruction of a rule */
+struct rule_op {
+	j5::op_t code;
+	j5::operand_t value; ///< Operand to match or produce, blank for none or a variable
+	int var;             ///< Variable standing for the operand, -1 for none
 };
 
-const auto opt_testzero = [](auto &v, auto a, auto b, auto c) {
-	if (a->code == j5::op_t::SET && a->op.which() == 0 && boost::get<uint16_t>(a->op) == 1 && b->code == j5::op_t::TEQ) {
-		assert(c->code == j5::op_t::DROP);
-		*a = j5::make_instruction(j5::op_t::TSZ);
-		v.erase(b);
-		v.erase(c);
+/**
+ * Stack effect of a sequence.
+ * @return Change in stack height, and how many values it needs to start with.
+ */
+static std::pair<int, int> stack_effect(const std::vector<rule_op> &ops)
+{
+	int height = 0;
+	int need = 0;
+	for (const auto &op : ops) {
+		need = std::max(need, j5::machine::STACK_POP.at(op.code) - height);
+		height += j5::machine::STACK_DIFF.at(op.code);
 	}
-};
+	return {height, need};
+}
 
-const auto opt_storeload = [](auto &v, auto a, auto b, auto c, auto d) {
-	if (a->code == j5::op_t::SET && c->code == j5::op_t::SET
-			&& b->code == j5::op_t::STORE && d->code == j5::op_t::LOAD
-			&& a->op == c->op) {
-		*b = *a;
-		*a = j5::make_instruction(j5::op_t::DUP);
-		*c = j5::make_instruction(j5::op_t::STORE);
-		v.erase(d);
+/* Parses one side of a rule, adding any new variables to vars if allowed */
+static std::vector<rule_op> parse_rule_ops(std::vector<std::string>::const_iterator it,
+		std::vector<std::string>::const_iterator end, std::vector<std::string> &vars, bool pattern)
+{
+	std::vector<rule_op> ops;
+	for (; it != end; ++it) {
+		auto opit = std::find(j5::OP_T_STR.begin(), j5::OP_T_STR.end(), *it);
+		if (opit == j5::OP_T_STR.end()) throw "Unknown op code: " + *it;
+		rule_op op = {static_cast<j5::op_t>(std::distance(j5::OP_T_STR.begin(), opit)), boost::blank(), -1};
+		switch (op.code) {
+			case j5::op_t::BRANCH:
+			case j5::op_t::BRZERO:
+			case j5::op_t::STOP:
+			case j5::op_t::LABEL:
+				throw "Can't rewrite control flow (" + *it + ")";
+			default:
+				break;
+		}
+
+		bool has_operand = op.code == j5::op_t::SET && it + 1 != end
+			&& std::find(j5::OP_T_STR.begin(), j5::OP_T_STR.end(), *(it + 1)) == j5::OP_T_STR.end();
+		if (has_operand) {
+			const std::string &tok = *++it;
+			if (tok.front() == '$') {
+				auto var = std::find(vars.begin(), vars.end(), tok);
+				if (var == vars.end()) {
+					if (!pattern) throw "Unknown variable " + tok;
+					var = vars.insert(var, tok);
+				}
+				op.var = std::distance(vars.begin(), var);
+			} else {
+				op.value = j5::get_operand(tok);
+				if (op.value.which() != 1) throw "Operand must be a number or variable: " + tok;
+			}
+		} else if (op.code == j5::op_t::SET && !pattern) {
+			throw std::string("SET needs an operand");
+		}
+		ops.push_back(op);
 	}
-};
+	return ops;
+}
 
-const auto opt_dupswap = [](auto &v, auto a, auto b) {
-	if (a->code == j5::op_t::DUP && b->code == j5::op_t::SWAP) {
-		v.erase(b);
+/**
+ * Replaces the rules with ones read from source, in the format of
+ * DEFAULT_RULES. Every rule must keep the stack effect of its pattern
+ * without reaching any deeper, and be shorter.
+ */
+void peephole::load(const std::string &source)
+{
+	this->rules.clear();
+	for (auto &r : this->by_last) r.clear();
+	this->longest = 0;
+	this->text = source;
+
+	std::stringstream ss(source);
+	std::string line;
+	for (size_t lineno = 1; std::getline(ss, line); lineno++) {
+		auto words = split_words(line);
+		if (words.empty()) continue;
+		try {
+			if (words.front().back() != ':') throw std::string("Missing rule name");
+			std::string name = words.front().substr(0, words.front().size() - 1);
+			auto arrow = std::find(words.begin(), words.end(), "=>");
+			if (arrow == words.end()) throw std::string("Missing =>");
+
+			std::vector<std::string> vars;
+			auto pattern = parse_rule_ops(words.begin() + 1, arrow, vars, true);
+			auto replacement = parse_rule_ops(arrow + 1, words.end(), vars, false);
+			if (pattern.empty()) throw std::string("Empty pattern");
+			if (replacement.size() >= pattern.size()) throw std::string("Replacement isn't shorter");
+			auto before = stack_effect(pattern);
+			auto after = stack_effect(replacement);
+			if (before.first != after.first || after.second > before.second) {
+				throw string_format("Stack effect %+d (needs %d) becomes %+d (needs %d)",
+						before.first, before.second, after.first, after.second);
+			}
+
+			std::vector<j5::op_t> codes;
+			for (const auto &op : pattern) codes.push_back(op.code);
+			size_t num_vars = vars.size();
+			this->add(name, codes, [pattern, replacement, num_vars](const j5::instruction *m, j5::program &out) {
+				std::vector<const j5::operand_t *> bound(num_vars, nullptr);
+				for (size_t k = 0; k < pattern.size(); k++) {
+					if (pattern[k].var >= 0) {
+						auto &b = bound[pattern[k].var];
+						if (b == nullptr) {
+							b = &m[k].op;
+						} else if (*b != m[k].op) {
+							return false;
+						}
+					} else if (pattern[k].value.which() != 0 && pattern[k].value != m[k].op) {
+						return false;
+					}
+				}
+				for (const auto &op : replacement) {
+					out.push_back(j5::make_instruction(op.code, op.var >= 0 ? *bound[op.var] : op.value));
+				}
+				return true;
+			});
+		} catch (const std::string &e) {
+			throw "Peephole rules line " + std::to_string(lineno) + ": " + e;
+		} catch (const char *e) {
+			throw "Peephole rules line " + std::to_string(lineno) + ": " + e;
+		}
 	}
-};
+}
+
+peephole &peephole_rules()
+{
+	static peephole rules = []{
+		peephole p;
+		p.load(DEFAULT_RULES);
+		return p;
+	}();
+	return rules;
+}
+
+/* Memory is slow, branches less so */
+cost_model::cost_model()
+{
+	this->costs.fill(1);
+	this->costs[(size_t)j5::op_t::LOAD] = 3;
+	this->costs[(size_t)j5::op_t::STORE] = 3;
+	this->costs[(size_t)j5::op_t::BRANCH] = 2;
+	this->costs[(size_t)j5::op_t::BRZERO] = 2;
+}
 
-const auto opt_swapswap = [](auto &v, auto a, auto b) {
-	if (a->code == j5::op_t::SWAP && b->code == j5::op_t::SWAP) {
-		v.erase(a);
-		v.erase(b);
+/**
+ * Changes costs to those read from source, one "OPCODE cost" per line.
+ * Anything not mentioned keeps its cost.
+ */
+void cost_model::load(const std::string &source)
+{
+	std::stringstream ss(source);
+	std::string line;
+	for (size_t lineno = 1; std::getline(ss, line); lineno++) {
+		auto words = split_words(line);
+		if (words.empty()) continue;
+		auto op = std::find(j5::OP_T_STR.begin(), j5::OP_T_STR.end(), words.front());
+		if (words.size() != 2 || op == j5::OP_T_STR.end() || !std::all_of(words[1].begin(), words[1].end(), ::isdigit)) {
+			throw "Costs line " + std::to_string(lineno) + ": expected an opcode and its cost";
+		}
+		this->costs[op - j5::OP_T_STR.begin()] = std::stoul(words[1]);
 	}
-};
+}
 
-const auto opt_setdrop = [](auto &v, auto a, auto b) {
-	if (a->code == j5::op_t::SET && b->code == j5::op_t::DROP) {
-		v.erase(a);
-		v.erase(b);
+size_t cost_model::cost(const j5::program &prog) const
+{
+	size_t total = 0;
+	for (const auto &ins : prog) {
+		if (ins.code != j5::op_t::LABEL) total += this->cost(ins.code);
 	}
-};
+	return total;
+}
+
+cost_model &cost_table()
+{
+	static cost_model costs;
+	return costs;
+}
 
 j5::program peephole_optimise(j5::program prog)
 {
-	prog = patchVector<2>(prog, opt_addone);
-	prog = patchVector<2>(prog, opt_subone);
-	prog = patchVector<3>(prog, opt_testzero);
-	prog = patchVector<4>(prog, opt_storeload);
-	prog = patchVector<2>(prog, opt_dupswap);
-	prog = patchVector<2>(prog, opt_swapswap);
-	prog = patchVector<2>(prog, opt_setdrop);
-	return prog;
+	return peephole_rules().run(std::move(prog));
 }
 
+static bool is_local_branch(const j5::instruction &ins)
+{
+	return (ins.code == j5::op_t::BRANCH || ins.code == j5::op_t::BRZERO)
+		&& ins.op.which() == 2 && j5::is_local_label(boost::get<symbol>(ins.op));
+}
+
+/* Totals over every block scheduled, for stack_schedule_report */
+static std::atomic<size_t> schedule_pairs(0);
+static std::atomic<size_t> schedule_out_of_reach(0);
+
+/**
+ * Koopman-style stack scheduling. Keeps a copy on the stack of a value
+ * stored to or loaded from an address, so a later load from it can use the
+ * copy instead of going to memory.
+ *
+ * One pass over the block tracks the stack height, and for each address
+ * the latest place a copy could be made along with the height below it. Any
+ * instruction reaching below that height (or a store that may be to the
+ * same address, or a branch or label) means the copy can't be kept. At a
+ * load the copy is brought to the top with DUP/SWAP/RSD3 if it is no deeper
+ * than 3, otherwise the load stays. Copies have to be used in LIFO order,
+ * so a pair that would cross one already kept is left alone. The code is
+ * then rebuilt in a single pass, so it all takes linear time (times the
+ * number of addresses in use at once).
+ */
 j5::program stack_schedule(j5::program prog)
 {
-	std::vector<std::pair<size_t, size_t>> pairs;
-	for (size_t i = 0; i < prog.size() - 1; i++) {
-		if (prog[i].code != j5::op_t::SET || prog[i + 1].code != j5::op_t::STORE) continue;
-		for (size_t j = i + 2; j < prog.size() - 1; j++) {
-			if (prog[j].code != j5::op_t::SET || prog[j + 1].code != j5::op_t::LOAD || prog[i].op != prog[j].op) continue;
+	struct candidate {
+		j5::operand_t addr;
+		size_t pos;     ///< Instruction where the copy is made
+		bool load;      ///< Copy of a loaded value, made after the load, rather than a stored one made before
+		int base;       ///< Stack height below the copy
+	};
+	std::vector<candidate> live;
+	std::vector<std::pair<size_t, size_t>> kept; ///< Outermost pairs so far, in order and disjoint
+	std::vector<int> moved(prog.size(), 0);      ///< For loads using a copy, its depth
+	std::vector<char> dup_before(prog.size(), 0), dup_after(prog.size(), 0);
+
+	/* Whether a copy made at i and used at j would cross one already kept */
+	auto crosses = [&kept](size_t i) {
+		auto it = std::lower_bound(kept.begin(), kept.end(), std::make_pair(i, size_t(0)));
+		return it != kept.begin() && std::prev(it)->second > i;
+	};
+
+	int height = 0;
+	size_t pairs = 0;
+	for (size_t k = 0; k < prog.size(); k++) {
+		const auto &ins = prog[k];
+		bool access = ins.code == j5::op_t::SET && k + 1 < prog.size()
+			&& (prog[k + 1].code == j5::op_t::LOAD || prog[k + 1].code == j5::op_t::STORE);
+		if (!access) {
+			switch (ins.code) {
+				case j5::op_t::LABEL:
+				case j5::op_t::BRANCH:
+				case j5::op_t::BRZERO:
+				case j5::op_t::STOP:
+				case j5::op_t::STORE: // to a computed address
+					live.clear();
+					break;
+				default: {
+					int low = height - j5::machine::STACK_POP.at(ins.code);
+					live.erase(std::remove_if(live.begin(), live.end(), [low](const auto &c){return c.base > low;}), live.end());
+					break;
+				}
+			}
+			height += j5::machine::STACK_DIFF.at(ins.code);
+			continue;
+		}
 
-			log<LOG_DEBUG2>("Found pair: ", prog[i], " - distance: ", j-i, "(", i, "->", j, ")");
-			pairs.push_back({i, j});
-			break;
+		bool load = prog[k + 1].code == j5::op_t::LOAD;
+		auto c = std::find_if(live.begin(), live.end(), [&ins](const auto &c){return c.addr == ins.op;});
+		if (load && c != live.end()) {
+			int depth = height - c->base + 1;
+			if (depth > 3) {
+				schedule_out_of_reach++;
+			} else if (ins.label.empty() && !crosses(c->pos)) {
+				(c->load ? dup_after : dup_before)[c->pos] = 1;
+				moved[k] = depth;
+				while (!kept.empty() && kept.back().first > c->pos) kept.pop_back(); // nested inside
+				kept.emplace_back(c->pos, k);
+				pairs++;
+			}
+		}
+		if (!load) {
+			/* Nothing may be left in the way of the stored value */
+			int low = height - 1;
+			live.erase(std::remove_if(live.begin(), live.end(), [low](const auto &c){return c.base > low;}), live.end());
+			c = std::find_if(live.begin(), live.end(), [&ins](const auto &c){return c.addr == ins.op;});
+		}
+		/* The latest value at the address is the one to keep */
+		candidate next = {ins.op, k, load, load ? height : height - 1};
+		if (c != live.end()) {
+			*c = next;
+		} else {
+			live.push_back(next);
 		}
+		height += load ? 1 : -1;
+		k++;
 	}
-	// sort by shortest distance
-	std::sort(pairs.begin(), pairs.end(), [](const auto &a, const auto &b){return a.second-a.first < b.second-b.first;});
-
-	for (auto p_it = pairs.begin(); p_it != pairs.end(); ++p_it) {
-		size_t i = p_it->first;
-		size_t j = p_it->second;
-		assert(j > i);
-
-		int stack_depth_start = std::count_if(pairs.begin(), pairs.end(), [i](auto &p){
-				return p.first < i && i < p.second;
-		});
-		int stack_depth_end = std::count_if(pairs.begin(), pairs.end(), [j](auto &p){
-				return p.first < j && j < p.second;
-		});
-		if (stack_depth_start > 2 || stack_depth_end > 2) continue;
-
-		j5::op_t ins;
-		switch (stack_depth_start) {
-			case 0: ins = j5::op_t::DUP; break;
-			case 1: ins = j5::op_t::TUCK2; break;
-			case 2: ins = j5::op_t::TUCK3; break;
-			default: throw "Not reached";
-		}
-
-		// reversed because of distances
-		prog.erase(prog.begin() + j + 1);
-		prog.erase(prog.begin() + j);
-		prog.insert(prog.begin() + i, j5::make_instruction(ins));
-
-		int stack_diff = std::accumulate(
-				prog.begin() + i + 3, // "dup", set, store
-				prog.begin() + j + 1, // +1
-				0,
-				[](const auto &a, const auto &b) {
-					return a + j5::machine::STACK_DIFF.at(b.code);
-				}
-		);
 
-		if (stack_diff > 2) throw "Not reached"; // TODO: not attempt?
-		switch (stack_diff) {
-			case 1:
-				prog.insert(prog.begin() + j + 1, j5::make_instruction(j5::op_t::SWAP));
-				break;
-			case 2:
-				prog.insert(prog.begin() + j + 1, j5::make_instruction(j5::op_t::RSD3));
-				break;
+	if (pairs == 0) return prog;
+	log<LOG_DEBUG2>("# Stack scheduling: ", pairs, " loads taken from the stack");
+	schedule_pairs += pairs;
+
+	j5::program out;
+	out.reserve(prog.size() + pairs);
+	for (size_t k = 0; k < prog.size(); k++) {
+		/* What's added comes from the load it replaces, or the value's first use */
+		const j5::instruction origin = prog[k];
+		if (dup_before[k]) {
+			out.push_back(j5::make_instruction(j5::op_t::DUP, boost::blank(), prog[k].label));
+			j5::inherit_origin(out.back(), origin);
+			prog[k].label.clear();
+		}
+		bool after = dup_after[k];
+		if (moved[k] > 0) {
+			if (moved[k] == 2) out.push_back(j5::make_instruction(j5::op_t::SWAP));
+			if (moved[k] == 3) out.push_back(j5::make_instruction(j5::op_t::RSD3));
+			if (moved[k] > 1) j5::inherit_origin(out.back(), origin);
+			k++;
+		} else if (after) {
+			out.push_back(std::move(prog[k]));
+			out.push_back(std::move(prog[++k]));
+		} else {
+			out.push_back(std::move(prog[k]));
+		}
+		if (after) {
+			out.push_back(j5::make_instruction(j5::op_t::DUP));
+			j5::inherit_origin(out.back(), origin);
+		}
+	}
+	return out;
+}
+
+void stack_schedule_report()
+{
+	log<LOG_DEBUG>("Stack scheduling: ", schedule_pairs.load(), " LOAD/STORE pairs taken from the stack, ",
+			schedule_out_of_reach.load(), " too deep");
+}
+
+/* Whether running from k reaches the label without doing anything */
+static bool falls_to(const j5::program &prog, size_t k, symbol label)
+{
+	for (; k < prog.size() && prog[k].code == j5::op_t::LABEL; k++) {
+		if (prog[k].label == label) return true;
+	}
+	return false;
+}
+
+/* One pass of removing pointless branches. Returns whether anything changed */
+static bool relax_branches(j5::program &prog)
+{
+	std::map<symbol, size_t> uses;
+	for (const auto &ins : prog) {
+		if (is_local_branch(ins)) uses[boost::get<symbol>(ins.op)]++;
+	}
+	auto label_at = [&prog](size_t k, symbol label) {
+		return k < prog.size() && prog[k].code == j5::op_t::LABEL && prog[k].label == label;
+	};
+
+	bool changed = false;
+	j5::program out;
+	out.reserve(prog.size());
+	for (size_t k = 0; k < prog.size(); k++) {
+		const auto &ins = prog[k];
+		if (!is_local_branch(ins) || !ins.label.empty()) {
+			out.push_back(ins);
+			continue;
+		}
+		symbol target = boost::get<symbol>(ins.op);
+
+		/* Branch to straight after itself, e.g. skipping nothing */
+		if (falls_to(prog, k + 1, target)) {
+			changed = true;
+			continue;
 		}
 
-		/* adjust upcoming pairs */
-		for (auto tmp = p_it + 1; tmp != pairs.end(); ++tmp) {
-			if (tmp->first >= i) tmp->first += 1;
-			if (tmp->second >= i) tmp->second += 1;
-			if (tmp->first >= j) tmp->first -= 2;
-			if (tmp->second >= j) tmp->second -= 2;
-			if (stack_diff > 0 && tmp->first > j) tmp->first += 1;
-			if (stack_diff > 0 && tmp->second > j) tmp->second += 1;
+		/* A conditional skipping an unconditional branch,
+		 * BRZERO .run; BRANCH .skip; .run: BRANCH x; .skip:
+		 * only needs to take that branch itself */
+		if (ins.code == j5::op_t::BRZERO && k + 3 < prog.size() && uses[target] == 1
+				&& prog[k + 1].code == j5::op_t::BRANCH && is_local_branch(prog[k + 1]) && prog[k + 1].label.empty()
+				&& label_at(k + 2, target)
+				&& prog[k + 3].code == j5::op_t::BRANCH && prog[k + 3].label.empty()
+				&& uses[boost::get<symbol>(prog[k + 1].op)] == 1
+				&& falls_to(prog, k + 4, boost::get<symbol>(prog[k + 1].op))) {
+			out.push_back(j5::make_instruction(j5::op_t::BRZERO, prog[k + 3].op));
+			j5::inherit_origin(out.back(), ins);
+			k += 3;
+			changed = true;
+			continue;
 		}
+		out.push_back(ins);
 	}
-	return prog;
+	prog = std::move(out);
+	return changed;
+}
+
+/**
+ * Last pass over converted code, once nothing else will move it around.
+ * Drops branches that have become pointless and turns a conditional
+ * skipping a branch into a conditional branch, then resolves local labels
+ * into relative offsets.
+ * @param positions If not null, set to where each local label ended up.
+ */
+j5::program layout_branches(j5::program prog, std::map<symbol, size_t> *positions)
+{
+	while (relax_branches(prog)) {}
+
+	std::map<symbol, size_t> labels;
+	j5::program out;
+	out.reserve(prog.size());
+	for (const auto &ins : prog) {
+		if (ins.code == j5::op_t::LABEL) {
+			labels[ins.label] = out.size();
+		} else {
+			out.push_back(ins);
+		}
+	}
+	for (size_t k = 0; k < out.size(); k++) {
+		if (!is_local_branch(out[k])) continue;
+		symbol target = boost::get<symbol>(out[k].op);
+		auto pos = labels.find(target);
+		if (pos == labels.end()) throw "Undefined local label '" + target.str() + "'";
+		out[k].op = static_cast<uint16_t>(pos->second - k);
+	}
+	if (positions != nullptr) *positions = std::move(labels);
+	return out;
 }
@@ -1,9 +1,88 @@
 #ifndef OPTIMISE_HPP
 #define OPTIMISE_HPP
 
+#include <array>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "stack_machine.hpp"
 
+/**
+ * Table of peephole rules, each a sequence of opcodes and a function that
+ * checks the operands and gives the code to replace the match with.
+ * Rules are indexed by the last opcode of their pattern, so only the ones
+ * that could end at an instruction are tried there.
+ */
+class peephole {
+public:
+	/**
+	 * @param match The instructions matching the pattern.
+	 * @param out Where to put the replacement, which must be shorter.
+	 * @return Whether the rule applies.
+	 */
+	using rewrite_t = std::function<bool(const j5::instruction *match, j5::program &out)>;
+
+	peephole() : longest(0) {}
+
+	void add(const std::string &name, const std::vector<j5::op_t> &pattern, rewrite_t rewrite);
+	void load(const std::string &source);
+	/* Rule file the rules were loaded from */
+	inline const std::string &source() const
+	{
+		return this->text;
+	}
+	j5::program run(j5::program prog);
+	/* Logs how many times each rule has fired */
+	void report() const;
+
+private:
+	struct rule {
+		std::string name;
+		std::vector<j5::op_t> pattern;
+		rewrite_t rewrite;
+		std::unique_ptr<std::atomic<size_t>> hits; ///< Blocks may be converted on several threads at once
+	};
+
+	rule *match(const j5::program &prog, size_t end, j5::program &replacement);
+
+	std::vector<rule> rules;
+	std::array<std::vector<size_t>, (size_t)j5::op_t::NUM_OPS> by_last; ///< Rules ending with each opcode
+	size_t longest; ///< Longest pattern
+	std::string text;
+};
+
+/**
+ * What each J5 instruction costs to run, which convertmachine charges and
+ * -o3 picks the cheapest code by.
+ */
+class cost_model {
+public:
+	cost_model();
+
+	void load(const std::string &source);
+	inline size_t cost(j5::op_t code) const
+	{
+		return this->costs[(size_t)code];
+	}
+	/* Cost of running all of the code once */
+	size_t cost(const j5::program &prog) const;
+
+private:
+	std::array<size_t, (size_t)j5::op_t::NUM_OPS> costs;
+};
+
+/* The rules used by peephole_optimise */
+peephole &peephole_rules();
+/* The costs in use */
+cost_model &cost_table();
 j5::program peephole_optimise(j5::program prog);
 j5::program stack_schedule(j5::program prog);
+/* Logs how many loads stack scheduling has taken from the stack */
+void stack_schedule_report();
+j5::program layout_branches(j5::program prog, std::map<symbol, size_t> *positions = nullptr);
 
 #endif /* OPTIMISE_HPP */
@@ -0,0 +1,66 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#include "output.hpp"
+
+output::output(format fmt, size_t capacity) : fmt(fmt), capacity(capacity)
+{
+	this->buf.reserve(capacity + 8);
+}
+
+void output::text(boost::string_view s)
+{
+	this->buf.append(s.data(), s.size());
+	if (this->buf.size() >= this->capacity) this->flush();
+}
+
+void output::flush()
+{
+	if (this->buf.empty()) return;
+	this->put(this->buf.data(), this->buf.size());
+	this->buf.clear();
+}
+
+fd_output::~fd_output()
+{
+	try {
+		this->flush();
+	} catch (...) {
+		/* Too late to tell anyone, machines flush when they finish anyway */
+	}
+}
+
+void fd_output::put(const char *data, size_t n)
+{
+	while (n > 0) {
+		ssize_t done = ::write(this->fd, data, n);
+		if (done < 0) {
+			if (errno == EINTR) continue;
+			throw std::string("Error writing output: ") + strerror(errno);
+		}
+		data += done;
+		n -= done;
+	}
+}
+
+stream_output::~stream_output()
+{
+	this->flush();
+}
+
+void stream_output::put(const char *data, size_t n)
+{
+	this->os.write(data, n);
+}
+
+void memory_output::put(const char *data, size_t n)
+{
+	this->captured.append(data, n);
+}
+
+output &cout_output()
+{
+	static stream_output out(std::cout);
+	return out;
+}
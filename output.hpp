@@ -0,0 +1,107 @@
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+#include <boost/utility/string_view.hpp>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+/**
+ * Where a machine's OUT goes. Values are gathered in a buffer and handed on
+ * a buffer full at a time, or straight away if the capacity is 0, and
+ * whatever is left when the machine stops running. Where they go is up to
+ * the subclass.
+ */
+class output {
+public:
+	enum class format {
+		TEXT,   ///< Each value in decimal on a line of its own
+		BINARY, ///< Each value as two bytes, little endian
+	};
+
+	virtual ~output() = default;
+	output(const output&) = delete;
+	output &operator=(const output&) = delete;
+
+	inline void value(uint16_t v)
+	{
+		if (this->fmt == format::BINARY) {
+			this->buf += static_cast<char>(v & 0xff);
+			this->buf += static_cast<char>(v >> 8);
+		} else {
+			char digits[6];
+			char *p = digits + sizeof(digits);
+			*--p = '\n';
+			do {
+				*--p = '0' + v % 10;
+				v /= 10;
+			} while (v != 0);
+			this->buf.append(p, digits + sizeof(digits) - p);
+		}
+		if (this->buf.size() >= this->capacity) this->flush();
+	}
+	/* Text as it is, in either format */
+	void text(boost::string_view s);
+	void flush();
+protected:
+	/**
+	 * @param capacity Bytes to gather before handing them on, 0 to hand
+	 *                 on each value as it comes.
+	 */
+	output(format fmt, size_t capacity);
+	/* Hands on some output, all of it before returning */
+	virtual void put(const char *data, size_t n) = 0;
+private:
+	format fmt;
+	size_t capacity;
+	std::string buf;
+};
+
+/* Writes to a file descriptor with write(2), so there's no stdio or iostream in the way */
+class fd_output : public output {
+public:
+	static const size_t DEFAULT_CAPACITY = 1 << 16;
+
+	explicit fd_output(int fd, format fmt = format::TEXT, size_t capacity = DEFAULT_CAPACITY)
+		: output(fmt, capacity), fd(fd) {}
+	~fd_output();
+protected:
+	void put(const char *data, size_t n) override;
+private:
+	int fd;
+};
+
+/* Writes to a stream, by default as each value comes so it stays in order with anything else written to it */
+class stream_output : public output {
+public:
+	explicit stream_output(std::ostream &os, format fmt = format::TEXT, size_t capacity = 0)
+		: output(fmt, capacity), os(os) {}
+	~stream_output();
+protected:
+	void put(const char *data, size_t n) override;
+private:
+	std::ostream &os;
+};
+
+/* Keeps everything in memory, for checking or comparing afterwards */
+class memory_output : public output {
+public:
+	explicit memory_output(format fmt = format::TEXT) : output(fmt, DEFAULT_CAPACITY) {}
+
+	/* Everything so far */
+	inline const std::string &str()
+	{
+		this->flush();
+		return this->captured;
+	}
+protected:
+	void put(const char *data, size_t n) override;
+private:
+	static const size_t DEFAULT_CAPACITY = 1 << 12;
+	std::string captured;
+};
+
+/* std::cout as an output, which machines write to unless given another */
+output &cout_output();
+
+#endif /* OUTPUT_HPP */
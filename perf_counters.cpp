@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "perf_counters.hpp"
+#include "util.hpp"
+
+static const std::array<const char *, perf_counters::NUM_EVENTS> EVENT_NAMES {{
+	"task-clock ns", "cycles", "instructions", "branch-misses", "cache-misses",
+}};
+
+static const std::array<const char *, perf_counters::NUM_PHASES> PHASE_NAMES {{
+	"idle", "run", "translate",
+}};
+
+#ifdef __linux__
+/**
+ * Counts ev for this thread in user space only, so it works unprivileged.
+ * Each read gives the count, then the time enabled and the time running.
+ * @param group Counter leading the group to put a hardware counter in, -1 for none.
+ * @return -1 if there's no such counter.
+ */
+static int open_counter(perf_counters::event ev, int group)
+{
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	switch (ev) {
+		case perf_counters::TASK_CLOCK:
+			attr.type = PERF_TYPE_SOFTWARE;
+			attr.config = PERF_COUNT_SW_TASK_CLOCK;
+			break;
+		case perf_counters::CYCLES:        attr.config = PERF_COUNT_HW_CPU_CYCLES;    break;
+		case perf_counters::INSTRUCTIONS:  attr.config = PERF_COUNT_HW_INSTRUCTIONS;  break;
+		case perf_counters::BRANCH_MISSES: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+		case perf_counters::CACHE_MISSES:  attr.config = PERF_COUNT_HW_CACHE_MISSES;  break;
+		default: return -1;
+	}
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	if (attr.type != PERF_TYPE_HARDWARE) group = -1;
+	int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+	/* A group too big for the CPU to count at once is refused, so count it on its own and scale */
+	if (fd == -1 && group != -1) fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	return fd;
+}
+#endif
+
+perf_counters::perf_counters()
+{
+	this->fds.fill(-1);
+#ifdef __linux__
+	int leader = -1;
+	for (size_t i = 0; i < NUM_EVENTS; i++) {
+		this->fds[i] = open_counter(static_cast<event>(i), leader);
+		if (this->fds[i] == -1) log<LOG_DEBUG>("No ", EVENT_NAMES[i], " counter: ", strerror(errno));
+		if (i != TASK_CLOCK && leader == -1) leader = this->fds[i];
+	}
+#endif
+	this->last = this->read();
+}
+
+perf_counters::~perf_counters()
+{
+#ifdef __linux__
+	for (int fd : this->fds) {
+		if (fd != -1) close(fd);
+	}
+#endif
+}
+
+bool perf_counters::available() const
+{
+	return std::any_of(this->fds.begin(), this->fds.end(), [](int fd) { return fd != -1; });
+}
+
+perf_counters::reading perf_counters::read() const
+{
+	reading r{};
+#ifdef __linux__
+	for (size_t i = 0; i < NUM_EVENTS; i++) {
+		uint64_t buf[3];
+		if (this->fds[i] != -1 && ::read(this->fds[i], buf, sizeof(buf)) == sizeof(buf)) {
+			r[i].value = buf[0];
+			r[i].enabled = buf[1];
+			r[i].running = buf[2];
+		}
+	}
+#endif
+	return r;
+}
+
+/**
+ * Counts from now on towards phase p. Switching costs a read syscall per
+ * counter, so it's done once per run and once per block translated, never
+ * per instruction.
+ */
+void perf_counters::switch_to(phase p)
+{
+	reading now = this->read();
+	for (size_t i = 0; i < NUM_EVENTS; i++) {
+		count &total = this->totals[this->current][i];
+		total.value += now[i].value - this->last[i].value;
+		total.enabled += now[i].enabled - this->last[i].enabled;
+		total.running += now[i].running - this->last[i].running;
+	}
+	this->last = now;
+	this->current = p;
+}
+
+/**
+ * Writes the counts of each phase that ran, in all and per guest
+ * instruction. Translation is divided by the instructions run too, as what
+ * it costs each instruction on average. A counter that only counted for
+ * part of the phase is scaled up to all of it, and says so.
+ * @param guest_name What the guest instructions are, for the heading.
+ */
+void perf_counters::report(std::ostream &os, const char *guest_name) const
+{
+	if (!this->available()) {
+		os << "No performance counters available\n";
+		return;
+	}
+	os << this->guest << ' ' << guest_name << " instructions run\n";
+	os << string_format("%-10s %-14s %16s %15s\n", "phase", "counter", "total", "per instruction");
+	for (size_t p = RUN; p < NUM_PHASES; p++) {
+		if (std::all_of(this->totals[p].begin(), this->totals[p].end(), [](const count &c) { return c.enabled == 0; })) {
+			continue;
+		}
+		for (size_t i = 0; i < NUM_EVENTS; i++) {
+			if (this->fds[i] == -1) continue;
+			const count &c = this->totals[p][i];
+			if (c.running == 0) {
+				os << string_format("%-10s %-14s %16s\n", PHASE_NAMES[p], EVENT_NAMES[i], "not counted");
+				continue;
+			}
+			double n = c.running < c.enabled ? (double)c.value * c.enabled / c.running : c.value;
+			std::string row = string_format("%-10s %-14s %16.0f %15.3f", PHASE_NAMES[p], EVENT_NAMES[i], n,
+					this->guest > 0 ? n / this->guest : 0.0);
+			if (c.running < c.enabled) row += string_format("  scaled, counted %.0f%% of the time", 100.0 * c.running / c.enabled);
+			os << row << '\n';
+		}
+	}
+}
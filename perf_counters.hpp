@@ -0,0 +1,65 @@
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <array>
+#include <cstdint>
+#include <iostream>
+
+/**
+ * Hardware performance counters (Linux perf_event_open) for the interpreter
+ * itself, kept per phase of running a program. A machine with counters
+ * attached switches phase as it goes, so that each phase gets the counts
+ * from when it was switched to until the next switch. Counters the kernel
+ * or CPU doesn't provide, e.g. in a VM, just aren't reported. The hardware
+ * counters are opened as one group so they count over the same time, and
+ * scaled up if the kernel had to share the CPU's counters out between them
+ * and others.
+ */
+class perf_counters {
+public:
+	enum phase {
+		IDLE,      ///< Not counted, e.g. reading and tokenising
+		RUN,       ///< Interpreting instructions
+		TRANSLATE, ///< Converting blocks to stack code, with -c
+		NUM_PHASES,
+	};
+	enum event {
+		TASK_CLOCK, ///< Nanoseconds on the CPU, a software counter so almost always there
+		CYCLES,
+		INSTRUCTIONS,
+		BRANCH_MISSES,
+		CACHE_MISSES,
+		NUM_EVENTS,
+	};
+	/* A counter's value, and how long it was enabled and actually counting */
+	struct count {
+		uint64_t value = 0;
+		uint64_t enabled = 0;
+		uint64_t running = 0;
+	};
+	using reading = std::array<count, NUM_EVENTS>;
+
+	perf_counters();
+	~perf_counters();
+	perf_counters(const perf_counters&) = delete;
+	perf_counters &operator=(const perf_counters&) = delete;
+
+	bool available() const;
+	void switch_to(phase p);
+	/* n more guest instructions were run, to normalise the counts by */
+	inline void executed(uint64_t n)
+	{
+		this->guest += n;
+	}
+	void report(std::ostream &os, const char *guest_name) const;
+private:
+	std::array<int, NUM_EVENTS> fds;
+	std::array<reading, NUM_PHASES> totals{};
+	reading last{};
+	phase current = IDLE;
+	uint64_t guest = 0;
+
+	reading read() const;
+};
+
+#endif /* PERF_COUNTERS_HPP */
@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <numeric>
+#include <sstream>
+
+#include "profile.hpp"
+#include "util.hpp"
+
+profile::translation &profile::translated(size_t pc, const j5::program &code)
+{
+	auto it = this->translations.find(pc);
+	if (it == this->translations.end()) {
+		it = this->translations.emplace(pc, translation{code, std::vector<counts>(code.size())}).first;
+	}
+	return it->second;
+}
+
+/* Instructions run in all, the stack code they were converted to for a converted program */
+uint64_t profile::total() const
+{
+	return std::accumulate(this->blocks.begin(), this->blocks.end(), (uint64_t)0,
+			[](uint64_t n, const block_counts &b) { return n + b.instructions; });
+}
+
+/* Stack instructions run with the given opcode, of the code converted blocks were converted to */
+uint64_t profile::total(j5::op_t code) const
+{
+	uint64_t n = 0;
+	for (const auto &t : this->translations) {
+		for (size_t k = 0; k < t.second.code.size(); k++) {
+			if (t.second.code[k].code == code) n += t.second.ran[k].runs;
+		}
+	}
+	return n;
+}
+
+/* Indices of the non-zero entries, most first */
+template<typename T, typename F>
+static std::vector<size_t> hottest(const std::vector<T> &v, F count)
+{
+	std::vector<size_t> order;
+	for (size_t i = 0; i < v.size(); i++) {
+		if (count(v[i]) > 0) order.push_back(i);
+	}
+	std::stable_sort(order.begin(), order.end(), [&v, &count](size_t a, size_t b) {
+		return count(v[a]) > count(v[b]);
+	});
+	return order;
+}
+
+template<typename Instruction>
+static std::string describe(const Instruction &ins)
+{
+	std::ostringstream ss;
+	ss << ins;
+	return ss.str();
+}
+
+/* Ends a row with which way the instruction went, if it's a conditional */
+static void end_row(std::ostream &os, std::string row, const profile::counts &c)
+{
+	if (c.taken + c.not_taken == 0) {
+		row.erase(row.find_last_not_of(' ') + 1);
+		os << row << '\n';
+		return;
+	}
+	os << row << string_format("%12llu %12llu\n", (unsigned long long)c.taken, (unsigned long long)c.not_taken);
+}
+
+template<typename Program>
+static void report_blocks(std::ostream &os, const std::vector<profile::block_counts> &blocks, const Program &prog,
+		const char *what)
+{
+	uint64_t total = std::accumulate(blocks.begin(), blocks.end(), (uint64_t)0,
+			[](uint64_t n, const profile::block_counts &b) { return n + b.instructions; });
+	os << "Blocks by " << what << " run (" << total << " in all)\n";
+	os << string_format("%14s %7s %12s %6s  %s\n", "run", "%", "entries", "line", "first instruction");
+	for (size_t pc : hottest(blocks, [](const profile::block_counts &b) { return b.instructions; })) {
+		const auto &b = blocks[pc];
+		os << string_format("%14llu %6.2f%% %12llu %6u  ", (unsigned long long)b.instructions,
+				100.0 * b.instructions / total, (unsigned long long)b.entries, prog.at(pc).line)
+			<< describe(prog.at(pc)) << '\n';
+	}
+	os << '\n';
+}
+
+template<typename Program>
+static void report_instructions(std::ostream &os, const std::vector<profile::counts> &instructions, const Program &prog)
+{
+	uint64_t total = std::accumulate(instructions.begin(), instructions.end(), (uint64_t)0,
+			[](uint64_t n, const profile::counts &c) { return n + c.runs; });
+	os << "Instructions by runs\n";
+	os << string_format("%14s %7s %6s  %-40s %12s %12s\n", "runs", "%", "line", "instruction", "taken", "not taken");
+	for (size_t pc : hottest(instructions, [](const profile::counts &c) { return c.runs; })) {
+		const auto &c = instructions[pc];
+		end_row(os, string_format("%14llu %6.2f%% %6u  %-40s ", (unsigned long long)c.runs, 100.0 * c.runs / total,
+				prog.at(pc).line, describe(prog.at(pc)).c_str()), c);
+	}
+}
+
+/**
+ * Writes the counts, hottest first, each annotated with its source line.
+ * For a converted program that's the blocks and the stack code they were
+ * converted to, otherwise the blocks and instructions of the program itself.
+ * @param prog The program that was run.
+ */
+void profile::report(std::ostream &os, const dcpu16::program &prog) const
+{
+	if (this->translations.empty()) {
+		report_blocks(os, this->blocks, prog, "instructions");
+		report_instructions(os, this->instructions, prog);
+		return;
+	}
+
+	report_blocks(os, this->blocks, prog, "stack instructions");
+	struct site {
+		size_t block;
+		size_t n;
+		const counts *c;
+	};
+	std::vector<site> sites;
+	uint64_t total = 0;
+	for (const auto &t : this->translations) {
+		for (size_t n = 0; n < t.second.ran.size(); n++) {
+			if (t.second.ran[n].runs > 0) sites.push_back({t.first, n, &t.second.ran[n]});
+			total += t.second.ran[n].runs;
+		}
+	}
+	std::stable_sort(sites.begin(), sites.end(), [](const site &a, const site &b) { return a.c->runs > b.c->runs; });
+	os << "Stack instructions by runs\n";
+	os << string_format("%14s %7s %6s %5s  %-34s %12s %12s\n", "runs", "%", "line", "+n", "instruction", "taken", "not taken");
+	for (const auto &s : sites) {
+		const j5::instruction &ins = this->translations.at(s.block).code.at(s.n);
+		uint32_t line = ins.reg_pc != -1 ? ins.line : prog.at(s.block).line;
+		end_row(os, string_format("%14llu %6.2f%% %6u %5zu  %-34s ", (unsigned long long)s.c->runs, 100.0 * s.c->runs / total,
+				line, s.n, describe(ins).c_str()), *s.c);
+	}
+}
+
+void profile::report(std::ostream &os, const j5::program &prog) const
+{
+	report_blocks(os, this->blocks, prog, "instructions");
+	report_instructions(os, this->instructions, prog);
+}
@@ -0,0 +1,82 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "register_machine.hpp"
+#include "stack_machine.hpp"
+
+/**
+ * Execution counts for a guest program, kept by a machine while it runs if
+ * one is attached. Counting is a couple of increments per instruction, so
+ * it's cheap enough to leave on.
+ */
+class profile {
+public:
+	struct counts {
+		uint64_t runs = 0;
+		uint64_t taken = 0; ///< IFx whose condition held, BRZERO that branched
+		uint64_t not_taken = 0;
+	};
+	struct block_counts {
+		uint64_t entries = 0;
+		uint64_t instructions = 0; ///< Run while in the block, including any translated code
+	};
+	/* A block as converted, with counts for each stack instruction of it */
+	struct translation {
+		j5::program code;
+		std::vector<counts> ran;
+	};
+
+	/* Counts instructions from here on towards the block starting at pc */
+	inline void enter(size_t pc)
+	{
+		this->current = &at(this->blocks, pc);
+		this->current->entries++;
+	}
+	/* Instruction pc of the current block ran */
+	inline counts &ran(size_t pc)
+	{
+		this->current->instructions++;
+		counts &c = at(this->instructions, pc);
+		c.runs++;
+		return c;
+	}
+	/* Stack instruction n of a block's translation ran */
+	inline counts &ran(translation &t, size_t n)
+	{
+		this->current->instructions++;
+		counts &c = at(t.ran, n);
+		c.runs++;
+		return c;
+	}
+	static inline void branch(counts &c, bool taken)
+	{
+		(taken ? c.taken : c.not_taken)++;
+	}
+	/* Where the counts for the translation of the block at pc go, keeping a copy of the code to report */
+	translation &translated(size_t pc, const j5::program &code);
+
+	uint64_t total() const;
+	uint64_t total(j5::op_t code) const;
+
+	void report(std::ostream &os, const dcpu16::program &prog) const;
+	void report(std::ostream &os, const j5::program &prog) const;
+private:
+	template<typename T>
+	static inline T &at(std::vector<T> &v, size_t n)
+	{
+		if (n >= v.size()) v.resize(n + 1);
+		return v[n];
+	}
+
+	std::vector<counts> instructions; ///< By pc
+	std::vector<block_counts> blocks; ///< By pc of the first instruction
+	std::map<size_t, translation> translations; ///< By pc of the register block
+	block_counts *current = nullptr;
+};
+
+#endif /* PROFILE_HPP */
@@ -1,4 +1,9 @@
+#include <algorithm>
+#include <map>
+
+#include "optimise.hpp"
 #include "register_convert.hpp"
+#include "util.hpp"
 
 /**
  * Converts register to a memory address for the stack machine to use.
@@ -12,229 +17,885 @@ uint16_t reg2memaddr(dcpu16::reg_t r)
 	return 0x2000 - (static_cast<size_t>(r) + 1);
 }
 
+/**
+ * Parses a register or literal from part of an operand string, without
+ * copying it out first.
+ * @param s Operand string.
+ * @param begin Start of the part to parse.
+ * @param end End of the part to parse.
+ */
+dcpu16::operand_t simple_operand(const std::string &s, size_t begin, size_t end)
+{
+	size_t len = end - begin;
+	for (size_t r = 0; r < dcpu16::REG_T_STR.size(); r++) {
+		if (s.compare(begin, len, dcpu16::REG_T_STR[r]) == 0) return static_cast<dcpu16::reg_t>(r);
+	}
+
+	unsigned base = 10;
+	if (len > 2 && s[begin] == '0' && tolower(s[begin + 1]) == 'x') {
+		base = 16;
+		begin += 2;
+	}
+	uint16_t val;
+	if (!parse_number(boost::string_view(s).substr(begin, end - begin), base, val)) {
+		throw "String memory addressing attempted";
+	}
+	return val;
+}
+
 /**
  * Takes an "array type" and puts the index of it on the stack
  */
-prog_snippet index_on_stack(dcpu16::operand_t x)
+void index_on_stack(j5_emitter &out, const dcpu16::operand_t &x)
 {
 	assert(x.which() == 0); // arrays are, sadly, strings
-	std::string op = boost::get<std::string>(x);
+	const std::string &op = boost::get<symbol>(x).str();
 	if (!dcpu16::is_array_type(op)) {
 		throw "Attempted to load a label onto the stack" + op;
 	}
 
-	prog_snippet ret;
-	std::string interior = op.substr(1, op.length() - 2);
-	dcpu16::operand_t i = dcpu16::get_operand(interior);
-	switch (i.which()) {
-		case 0: {
-			size_t pos = interior.find('+');
-			if (pos == std::string::npos) {
-				throw "String memory addressing attempted";
-			}
-			auto p1 = value_on_stack(dcpu16::get_operand(interior.substr(0, pos)));
-			auto p2 = value_on_stack(dcpu16::get_operand(interior.substr(pos + 1)));
-			ret.insert(ret.end(), p1.begin(), p1.end());
-			ret.insert(ret.end(), p2.begin(), p2.end());
-			ret.emplace_back(j5::make_instruction(j5::op_t::ADD));
-			break;
-		}
-		case 1: {
-			uint16_t val = reg2memaddr(boost::get<dcpu16::reg_t>(i));
-			ret.emplace_back(j5::make_instruction(j5::op_t::SET, val));
-			ret.emplace_back(j5::make_instruction(j5::op_t::LOAD)); // deref
-			break;
-		}
-		case 2: {
-			uint16_t val = boost::get<uint16_t>(i);
-			ret.emplace_back(j5::make_instruction(j5::op_t::SET, val));
-			break;
-		}
+	size_t pos = op.find('+');
+	if (pos == std::string::npos) {
+		value_on_stack(out, simple_operand(op, 1, op.size() - 1));
+	} else {
+		value_on_stack(out, simple_operand(op, 1, pos));
+		value_on_stack(out, simple_operand(op, pos + 1, op.size() - 1));
+		out.emit(j5::op_t::ADD);
 	}
-	return ret;
 }
 
 /*
  * Pushes the *address* of a register operand onto the stack (no other sideeffects)
  */
-prog_snippet address_on_stack(dcpu16::operand_t x)
+void address_on_stack(j5_emitter &out, const dcpu16::operand_t &x)
 {
-	prog_snippet ret;
 	switch (x.which()) {
 		case 0: // string
-			ret = index_on_stack(x);
+			index_on_stack(out, x);
 			break;
-		case 1: {
-			uint16_t val = reg2memaddr(boost::get<dcpu16::reg_t>(x));
-			ret.emplace_back(j5::make_instruction(j5::op_t::SET, val));
+		case 1:
+			out.emit(j5::op_t::SET, reg2memaddr(boost::get<dcpu16::reg_t>(x)));
 			break;
-		}
 		case 2:
-			uint16_t val = boost::get<uint16_t>(x);
-			ret.emplace_back(j5::make_instruction(j5::op_t::SET, val));
+			out.emit(j5::op_t::SET, boost::get<uint16_t>(x));
 			break;
 	}
-	return ret;
 }
 
 /*
  * Pushes the value of a register operand onto the stack (no other sideeffects)
  * What happens next is anyone's guess :)
  */
-prog_snippet value_on_stack(dcpu16::operand_t x)
+void value_on_stack(j5_emitter &out, const dcpu16::operand_t &x)
 {
-	prog_snippet ret = address_on_stack(x);
+	address_on_stack(out, x);
 	if (x.which() == 0 || x.which() == 1) {
-		ret.emplace_back(j5::make_instruction(j5::op_t::LOAD));
+		out.emit(j5::op_t::LOAD);
 	}
-	return ret;
 }
 
-prog_snippet set_snippet(const dcpu16::instruction &ins)
+void set_code(j5_emitter &out, const dcpu16::instruction &ins)
 {
 	// SET PC, x is special
 	// TODO: handle numeric (& +/-??)
 	if (ins.b.which() == 1 && boost::get<dcpu16::reg_t>(ins.b) == dcpu16::reg_t::PC) {
 		if (ins.a.which() == 0) {
-			return {j5::make_instruction(j5::op_t::BRANCH, boost::get<std::string>(ins.a))};
+			out.emit(j5::op_t::BRANCH, boost::get<symbol>(ins.a));
+			return;
 		} else if (ins.a.which() == 1 && boost::get<dcpu16::reg_t>(ins.a) == dcpu16::reg_t::PC) { // SET PC, PC
-			return {j5::make_instruction(j5::op_t::STOP)};
+			out.emit(j5::op_t::STOP);
+			return;
 		}
 	}
 
-	if (ins.b.which() == 2) return {}; // setting to literal == nop
-	prog_snippet ret;
-	auto a_snip = value_on_stack(ins.a);
-	auto b_snip = address_on_stack(ins.b);
-	ret.insert(ret.end(), a_snip.begin(), a_snip.end());
-	ret.insert(ret.end(), b_snip.begin(), b_snip.end());
-	ret.emplace_back(j5::make_instruction(j5::op_t::STORE));
-	return ret;
+	if (ins.b.which() == 2) return; // setting to literal == nop
+	value_on_stack(out, ins.a);
+	address_on_stack(out, ins.b);
+	out.emit(j5::op_t::STORE);
 }
 
-prog_snippet out_snippet(const dcpu16::instruction &ins)
+void out_code(j5_emitter &out, const dcpu16::instruction &ins)
 {
-	prog_snippet ret = value_on_stack(ins.b);
-	ret.emplace_back(j5::make_instruction(j5::op_t::OUT));
-	ret.emplace_back(j5::make_instruction(j5::op_t::DROP));
-	return ret;
+	value_on_stack(out, ins.b);
+	out.emit(j5::op_t::OUT);
+	out.emit(j5::op_t::DROP);
 }
 
-// TODO EX register
-prog_snippet add_snippet(const dcpu16::instruction &ins)
+/**
+ * Generic b = b <op> a conversion.
+ * @param ops Instructions that take (b, a) off the stack and leave the
+ *            result, or (result, EX) if sets_ex.
+ * @param sets_ex Whether the ops also produce a new value for EX.
+ */
+void binop_code(j5_emitter &out, const dcpu16::instruction &ins, const prog_snippet &ops, bool sets_ex)
 {
-	if (ins.b.which() == 2) {
-		return {}; // nop
+	if (ins.b.which() == 2 && !sets_ex) {
+		return; // nop
 	}
-	prog_snippet b_snip = value_on_stack(ins.b);
-	prog_snippet a_snip = value_on_stack(ins.a);
-	prog_snippet ret;
-	ret.insert(ret.end(), b_snip.begin(), b_snip.end());
-	ret.insert(ret.end(), a_snip.begin(), a_snip.end());
-	ret.emplace_back(j5::make_instruction(j5::op_t::ADD));
+	value_on_stack(out, ins.b);
+	value_on_stack(out, ins.a);
+	out.emit(ops);
 
-	prog_snippet addr_snip = address_on_stack(ins.b);
-	ret.insert(ret.end(), addr_snip.begin(), addr_snip.end());
-	ret.emplace_back(j5::make_instruction(j5::op_t::STORE));
-	return ret;
+	if (sets_ex) {
+		out.emit(j5::op_t::SET, reg2memaddr(dcpu16::reg_t::EX));
+		out.emit(j5::op_t::STORE);
+	}
+	if (ins.b.which() == 2) {
+		// setting a literal is ignored, but EX is still updated
+		out.emit(j5::op_t::DROP);
+		return;
+	}
+	address_on_stack(out, ins.b);
+	out.emit(j5::op_t::STORE);
 }
 
-prog_snippet sub_snippet(const dcpu16::instruction &ins)
+/* Operation sequences for binop_code. The carry flag is turned into EX
+ * by adding/subtracting it from zero */
+static const prog_snippet ADD_OPS {
+	j5::make_instruction(j5::op_t::ADD),
+	j5::make_instruction(j5::op_t::SET, 0),
+	j5::make_instruction(j5::op_t::DUP),
+	j5::make_instruction(j5::op_t::ADC), // EX = 0 + 0 + carry
+};
+
+static const prog_snippet SUB_OPS {
+	j5::make_instruction(j5::op_t::SUB),
+	j5::make_instruction(j5::op_t::SET, 0),
+	j5::make_instruction(j5::op_t::DUP),
+	j5::make_instruction(j5::op_t::SBC), // EX = 0 - 0 - borrow, 0xffff on underflow
+};
+
+/* b + a + EX, either addition overflowing sets EX to 1 */
+static const prog_snippet ADX_OPS {
+	j5::make_instruction(j5::op_t::ADD),
+	j5::make_instruction(j5::op_t::SET, 0),
+	j5::make_instruction(j5::op_t::DUP),
+	j5::make_instruction(j5::op_t::ADC),  // (s, c1)
+	j5::make_instruction(j5::op_t::SWAP),
+	j5::make_instruction(j5::op_t::SET, reg2memaddr(dcpu16::reg_t::EX)),
+	j5::make_instruction(j5::op_t::LOAD),
+	j5::make_instruction(j5::op_t::ADD),  // (c1, s')
+	j5::make_instruction(j5::op_t::SET, 0),
+	j5::make_instruction(j5::op_t::DUP),
+	j5::make_instruction(j5::op_t::ADC),  // (c1, s', c2)
+	j5::make_instruction(j5::op_t::RSD3), // (s', c2, c1)
+	j5::make_instruction(j5::op_t::OR),
+};
+
+/* b - a + EX, EX is 0xffff on underflow, 1 on overflow. The two carries
+ * cancel out if the subtraction underflows and the addition overflows */
+static const prog_snippet SBX_OPS {
+	j5::make_instruction(j5::op_t::SUB),
+	j5::make_instruction(j5::op_t::SET, 0),
+	j5::make_instruction(j5::op_t::DUP),
+	j5::make_instruction(j5::op_t::SBC),  // (s, -c1)
+	j5::make_instruction(j5::op_t::SWAP),
+	j5::make_instruction(j5::op_t::SET, reg2memaddr(dcpu16::reg_t::EX)),
+	j5::make_instruction(j5::op_t::LOAD),
+	j5::make_instruction(j5::op_t::ADD),  // (-c1, s')
+	j5::make_instruction(j5::op_t::SWAP),
+	j5::make_instruction(j5::op_t::SET, 0),
+	j5::make_instruction(j5::op_t::ADC),  // (s', c2 - c1)
+};
+
+/**
+ * Shifts. EX gets the bits shifted out, which is b shifted the other way by
+ * 16 - a, or for shifts past 16, b shifted the same way by a - 16. Either
+ * shift is by 16 or more when the other applies, so leaves 0 and the two
+ * are ORed together. An ASR would leave the sign though, so first b is
+ * masked down to its low a bits, which are all that's shifted below 16.
+ * @param shift Shift to perform.
+ * @param ex_shift Opposite shift, giving the bits lost by shift.
+ */
+static prog_snippet shift_ops(j5::op_t shift, j5::op_t ex_shift)
 {
-	if (ins.b.which() == 2) {
-		return {}; // nop
+	prog_snippet ops {
+		j5::make_instruction(j5::op_t::DUP),
+		j5::make_instruction(j5::op_t::COPY3),
+		j5::make_instruction(j5::op_t::SWAP), // (b, a, b, a)
+		j5::make_instruction(shift),
+		j5::make_instruction(j5::op_t::RSU3), // (r, b, a)
+		j5::make_instruction(j5::op_t::SWAP),
+		j5::make_instruction(j5::op_t::DUP),
+		j5::make_instruction(j5::op_t::COPY3), // (r, a, b, b, a)
+	};
+	if (shift == j5::op_t::ASR) {
+		ops.insert(ops.end(), {
+			j5::make_instruction(j5::op_t::SET, 0xffff),
+			j5::make_instruction(j5::op_t::SWAP),
+			j5::make_instruction(j5::op_t::SHL),
+			j5::make_instruction(j5::op_t::NOT),
+			j5::make_instruction(j5::op_t::AND),
+			j5::make_instruction(j5::op_t::COPY3), // (r, a, b, b & low a bits, a)
+		});
 	}
-	prog_snippet b_snip = value_on_stack(ins.b);
-	prog_snippet a_snip = value_on_stack(ins.a);
-	prog_snippet ret;
-	ret.insert(ret.end(), b_snip.begin(), b_snip.end());
-	ret.insert(ret.end(), a_snip.begin(), a_snip.end());
-	ret.emplace_back(j5::make_instruction(j5::op_t::SUB));
-
-	prog_snippet addr_snip = address_on_stack(ins.b);
-	ret.insert(ret.end(), addr_snip.begin(), addr_snip.end());
-	ret.emplace_back(j5::make_instruction(j5::op_t::STORE));
-	return ret;
+	ops.insert(ops.end(), {
+		j5::make_instruction(j5::op_t::SET, 16),
+		j5::make_instruction(j5::op_t::SUB),
+		j5::make_instruction(shift),
+		j5::make_instruction(j5::op_t::RSD3), // (r, b, past 16, a)
+		j5::make_instruction(j5::op_t::SET, 16),
+		j5::make_instruction(j5::op_t::SWAP),
+		j5::make_instruction(j5::op_t::SUB),
+		j5::make_instruction(j5::op_t::RSD3),
+		j5::make_instruction(j5::op_t::SWAP),
+		j5::make_instruction(ex_shift),
+		j5::make_instruction(j5::op_t::OR),
+	});
+	return ops;
 }
 
-prog_snippet if_snippet(const dcpu16::instruction &ins, j5::op_t test_op, bool invert)
+static const prog_snippet SHR_OPS = shift_ops(j5::op_t::SHR, j5::op_t::SHL);
+static const prog_snippet ASR_OPS = shift_ops(j5::op_t::ASR, j5::op_t::SHL);
+static const prog_snippet SHL_OPS = shift_ops(j5::op_t::SHL, j5::op_t::SHR);
+
+/**
+ * Appends the branches for a conditional. When the zero flag is set (i.e.
+ * the test passed, unless inverted) the next instruction is executed.
+ */
+void if_branches(j5_emitter &out, bool invert)
 {
-	prog_snippet b_snip = value_on_stack(ins.b);
-	prog_snippet a_snip = value_on_stack(ins.a);
-	prog_snippet ret;
+	symbol skip = out.skip_next();
+	if (invert) {
+		out.emit(j5::op_t::BRZERO, skip);
+	} else {
+		symbol run = out.new_label();
+		out.emit(j5::op_t::BRZERO, run);
+		out.emit(j5::op_t::BRANCH, skip);
+		out.emit_label(run);
+	}
+}
 
+/**
+ * Comparison conditionals.
+ * @param is_signed Compare as signed values, by flipping the sign bits so
+ *                  the unsigned comparison gives the same ordering.
+ */
+void if_code(j5_emitter &out, const dcpu16::instruction &ins, j5::op_t test_op, bool invert, bool is_signed)
+{
 	/* Swapped as the LT/GT instructions do top <> next
 	 * Other instructions don't care */
-	ret.insert(ret.end(), a_snip.begin(), a_snip.end());
-	ret.insert(ret.end(), b_snip.begin(), b_snip.end());
-
-	ret.emplace_back(j5::make_instruction(test_op));
-	ret.emplace_back(j5::make_instruction(j5::op_t::DROP));
-	ret.emplace_back(j5::make_instruction(j5::op_t::DROP));
-	if (invert) {
-		/* Actual length is handled in the main loop, as this
-		 * requires the generated length of the next instruction. */
-		ret.emplace_back(j5::make_instruction(j5::op_t::BRZERO, 42));
-	} else {
-		ret.emplace_back(j5::make_instruction(j5::op_t::BRZERO, 2));
-		ret.emplace_back(j5::make_instruction(j5::op_t::BRANCH, 42));
+	for (const auto *x : {&ins.a, &ins.b}) {
+		value_on_stack(out, *x);
+		if (is_signed) {
+			out.emit(j5::op_t::SET, 0x8000);
+			out.emit(j5::op_t::XOR);
+		}
 	}
-	return ret;
+
+	out.emit(test_op);
+	out.emit(j5::op_t::DROP);
+	out.emit(j5::op_t::DROP);
+	if_branches(out, invert);
+}
+
+/* IFB/IFC, test b & a against zero */
+void ifbit_code(j5_emitter &out, const dcpu16::instruction &ins, bool invert)
+{
+	value_on_stack(out, ins.b);
+	value_on_stack(out, ins.a);
+	out.emit(j5::op_t::AND);
+	out.emit(j5::op_t::TSZ);
+	out.emit(j5::op_t::DROP);
+	if_branches(out, invert);
 }
 
 /**
  * Whole point of this program. :)
  * Takes a register instruction and converts to a stack instruction.
  * @param r Register instruction.
- * @return List of stack instructions equivalent to the register instruction.
+ * @param out Where to put the equivalent stack instructions.
  */
-prog_snippet convert_instruction(const dcpu16::instruction &r)
-{
-	using namespace std::placeholders;
-
-	static const std::map<dcpu16::op_t, std::function<prog_snippet(const dcpu16::instruction &)>> conv_map {
-		{dcpu16::op_t::SET, &set_snippet},
-		{dcpu16::op_t::ADD, &add_snippet},
-		{dcpu16::op_t::SUB, &sub_snippet},
-		{dcpu16::op_t::OUT, &out_snippet},
-		{dcpu16::op_t::IFN, std::bind(&if_snippet, _1, j5::op_t::TEQ, true)},
-		{dcpu16::op_t::IFG, std::bind(&if_snippet, _1, j5::op_t::TGT, false)},
-		{dcpu16::op_t::IFE, std::bind(&if_snippet, _1, j5::op_t::TEQ, false)},
-		{dcpu16::op_t::IFL, std::bind(&if_snippet, _1, j5::op_t::TLT, false)},
-	};
-	auto keyval = conv_map.find(r.code);
-	if (keyval != conv_map.end()) {
-		auto converted = keyval->second(r);
-		if (r.label != "") {
-			// TODO: preserve label if prevous conversion resulted in a nop
-			converted.front().label = r.label;
+void convert_instruction(const dcpu16::instruction &r, j5_emitter &out)
+{
+	static const prog_snippet MUL_OPS {j5::make_instruction(j5::op_t::MUL)};
+	static const prog_snippet MLI_OPS {j5::make_instruction(j5::op_t::MULS)};
+	static const prog_snippet DIV_OPS {j5::make_instruction(j5::op_t::DIV)};
+	static const prog_snippet DVI_OPS {j5::make_instruction(j5::op_t::DIVS)};
+	static const prog_snippet MOD_OPS {j5::make_instruction(j5::op_t::MOD)};
+	static const prog_snippet MDI_OPS {j5::make_instruction(j5::op_t::MODS)};
+	static const prog_snippet AND_OPS {j5::make_instruction(j5::op_t::AND)};
+	static const prog_snippet BOR_OPS {j5::make_instruction(j5::op_t::OR)};
+	static const prog_snippet XOR_OPS {j5::make_instruction(j5::op_t::XOR)};
+
+	out.begin_instruction();
+	size_t start = out.code.size();
+	switch (r.code) {
+		case dcpu16::op_t::SET: set_code(out, r); break;
+		case dcpu16::op_t::ADD: binop_code(out, r, ADD_OPS, true); break;
+		case dcpu16::op_t::SUB: binop_code(out, r, SUB_OPS, true); break;
+		case dcpu16::op_t::MUL: binop_code(out, r, MUL_OPS, true); break;
+		case dcpu16::op_t::MLI: binop_code(out, r, MLI_OPS, true); break;
+		case dcpu16::op_t::DIV: binop_code(out, r, DIV_OPS, true); break;
+		case dcpu16::op_t::DVI: binop_code(out, r, DVI_OPS, true); break;
+		case dcpu16::op_t::MOD: binop_code(out, r, MOD_OPS, false); break;
+		case dcpu16::op_t::MDI: binop_code(out, r, MDI_OPS, false); break;
+		case dcpu16::op_t::AND: binop_code(out, r, AND_OPS, false); break;
+		case dcpu16::op_t::BOR: binop_code(out, r, BOR_OPS, false); break;
+		case dcpu16::op_t::XOR: binop_code(out, r, XOR_OPS, false); break;
+		case dcpu16::op_t::SHR: binop_code(out, r, SHR_OPS, true); break;
+		case dcpu16::op_t::ASR: binop_code(out, r, ASR_OPS, true); break;
+		case dcpu16::op_t::SHL: binop_code(out, r, SHL_OPS, true); break;
+		case dcpu16::op_t::ADX: binop_code(out, r, ADX_OPS, true); break;
+		case dcpu16::op_t::SBX: binop_code(out, r, SBX_OPS, true); break;
+		case dcpu16::op_t::OUT: out_code(out, r); break;
+		case dcpu16::op_t::IFB: ifbit_code(out, r, true); break;
+		case dcpu16::op_t::IFC: ifbit_code(out, r, false); break;
+		case dcpu16::op_t::IFN: if_code(out, r, j5::op_t::TEQ, true, false); break;
+		case dcpu16::op_t::IFG: if_code(out, r, j5::op_t::TGT, false, false); break;
+		case dcpu16::op_t::IFA: if_code(out, r, j5::op_t::TGT, false, true); break;
+		case dcpu16::op_t::IFE: if_code(out, r, j5::op_t::TEQ, false, false); break;
+		case dcpu16::op_t::IFL: if_code(out, r, j5::op_t::TLT, false, false); break;
+		case dcpu16::op_t::IFU: if_code(out, r, j5::op_t::TLT, false, true); break;
+		default:
+			throw "Unimplemented conversion of " + dcpu16::OP_T_STR.at((size_t)r.code);
+	}
+	if (!r.label.empty() && out.code.size() > start) {
+		// TODO: preserve label if prevous conversion resulted in a nop
+		out.code[start].label = r.label;
+	}
+}
+
+void dataflow_converter::add(const dcpu16::instruction &ins)
+{
+	/* A conditional skips the code of the next instruction, so that has
+	 * to be converted on its own */
+	bool single = this->after_if;
+	this->after_if = ins.code >= dcpu16::op_t::IFB && ins.code <= dcpu16::op_t::IFU;
+	if (!ins.label.empty() || single) this->flush();
+
+	size_t index = this->next++;
+	if (!this->graph.add(ins)) {
+		this->flush();
+		if (!this->graph.add(ins)) {
+			this->out.from(index, ins.line);
+			convert_instruction(ins, this->out);
+			return;
 		}
-		return converted;
+	}
+	this->instructions.push_back(&ins);
+	this->last = index;
+	if (single || this->graph.ended()) this->flush();
+}
+
+/* Generates the code for the instructions so far */
+void dataflow_converter::flush()
+{
+	if (this->instructions.empty()) return;
+
+	/* Registers are written back for whatever follows the last instruction */
+	liveness::reg_set live;
+	if (this->live != nullptr) {
+		live = this->live[this->last];
+	} else {
+		live.set();
+	}
+
+	this->code.clear();
+	bool ok = this->graph.generate(this->code, true, live);
+	if (!ok) {
+		this->code.clear();
+		ok = this->graph.generate(this->code, false, live);
+	}
+	size_t first = this->last + 1 - this->instructions.size();
+	if (ok) {
+		log<LOG_DEBUG2>("# Dataflow: ", this->instructions.size(), " instructions -> ", this->code.size());
+		this->out.from(first, this->instructions.front()->line);
+		this->out.begin_instruction();
+		size_t start = this->out.code.size();
+		this->out.emit(this->code);
+		bool invert;
+		if (this->graph.conditional(invert)) if_branches(this->out, invert);
+		if (this->out.code.size() > start) this->out.code[start].label = this->instructions.front()->label;
 	} else {
-		throw "Unimplemented conversion of " + dcpu16::OP_T_STR.at((size_t)r.code);
+		log<LOG_DEBUG2>("# Dataflow: failed, converting ", this->instructions.size(), " instructions directly");
+		for (auto ins : this->instructions) {
+			this->out.from(first++, ins->line);
+			convert_instruction(*ins, this->out);
+		}
 	}
+	this->instructions.clear();
+	this->graph.clear();
 }
 
 j5::program reg2stack(dcpu16::program p)
 {
-	std::vector<j5::program> snippets;
-	for (const auto &i : p) {
-		auto snippet = convert_instruction(i);
-
-		/* Deal with generated BRZERO from if statements
-		 * requiring the length of the next instruction */
-		// TODO: Look at p instead of snippets?
-		if (snippets.size() != 0) {
-			auto &last = snippets.back();
-			auto brzero_idx = std::find_if(last.begin(), last.end(),
-					[](const j5::instruction &i){return i.code == j5::op_t::BRZERO;});
-			if (brzero_idx != last.end()) {
-				brzero_idx->op = snippet.size() + 1 + 2;
+	j5_emitter out(p.size());
+	for (size_t n = 0; n < p.size(); n++) {
+		out.from(n, p[n].line);
+		convert_instruction(p[n], out);
+	}
+	out.finish();
+	return layout_branches(std::move(out.code));
+}
+
+/**
+ * Finds the register accessed by a SET/LOAD or SET/STORE pair.
+ * @param s Code to look in.
+ * @param i Position of the SET.
+ * @param end End of the code belonging to the instruction.
+ * @return Register, or NUM_REGS if this isn't a register access.
+ */
+static dcpu16::reg_t reg_access(const prog_snippet &s, size_t i, size_t end)
+{
+	if (i + 1 >= end || s[i].code != j5::op_t::SET || s[i].op.which() != 1) return dcpu16::reg_t::NUM_REGS;
+	if (s[i + 1].code != j5::op_t::LOAD && s[i + 1].code != j5::op_t::STORE) return dcpu16::reg_t::NUM_REGS;
+	uint16_t addr = boost::get<uint16_t>(s[i].op);
+	for (auto r = dcpu16::reg_t::A; r < dcpu16::reg_t::PC; r = static_cast<dcpu16::reg_t>(static_cast<size_t>(r) + 1)) {
+		if (reg2memaddr(r) == addr) return r;
+	}
+	return dcpu16::reg_t::NUM_REGS;
+}
+
+/* Whether the instruction leaves the block, local labels are within it */
+static bool is_block_exit(const j5::instruction &ins)
+{
+	if (ins.code == j5::op_t::STOP) return true;
+	return ins.code == j5::op_t::BRANCH && ins.op.which() == 2 && !j5::is_local_label(boost::get<symbol>(ins.op));
+}
+
+/* Copies the stack register at depth (from the top, 1) to the top */
+static void read_stack_reg(j5_emitter &out, int depth)
+{
+	switch (depth) {
+		case 1:
+			out.emit(j5::op_t::DUP);
+			break;
+		case 2:
+			out.emit(j5::op_t::SWAP);
+			out.emit(j5::op_t::TUCK2);
+			break;
+		case 3:
+			out.emit(j5::op_t::COPY3);
+			break;
+	}
+}
+
+/* Adds (ADD) or takes off (SUB) a stack register's bias, if it has one */
+static void apply_bias(j5_emitter &out, j5::op_t op, uint16_t bias)
+{
+	if (bias == 0) return;
+	out.emit(j5::op_t::SET, bias);
+	out.emit(op);
+}
+
+/**
+ * What the values above the stack registers have added to them, going
+ * through a block with biased registers (see loop_stack_regs). Sums and
+ * differences carry the bias along, so a register biased by its base is
+ * already the address, and an update like ADD I, 1 is written back still
+ * biased. Anything else needs the bias taken off first, which is free if
+ * the value came from adding a constant, as the constant can take it off.
+ */
+class carried_biases {
+public:
+	explicit carried_biases(j5_emitter &out) : out(out) {}
+
+	/* Starts again with height values, none of them biased */
+	void reset(int height)
+	{
+		this->values.assign(height, {0, NONE});
+	}
+	/* A register read, biased by bias */
+	void push(uint16_t bias)
+	{
+		this->values.push_back({bias, NONE});
+	}
+	/* Gives the value on top the bias of the register it is written to */
+	void write(uint16_t bias)
+	{
+		value &v = this->values.back();
+		if (v.bias != bias) {
+			if (v.set != NONE) {
+				this->adjust(v.set, bias - v.bias);
+			} else {
+				apply_bias(this->out, j5::op_t::ADD, bias - v.bias);
+			}
+		}
+		this->values.pop_back();
+	}
+	/* Takes the bias off everything, for labels and branches */
+	bool settle_all()
+	{
+		for (size_t depth = 1; depth <= this->values.size(); depth++) {
+			if (!this->settle(depth, true)) return false;
+		}
+		return true;
+	}
+	/**
+	 * Emits an instruction, after taking the bias off anything it uses that
+	 * can't keep it.
+	 * @param carry Whether the carry the instruction sets is used.
+	 * @param first Start of the instruction's code, which has to be kept.
+	 * @return False if a bias couldn't be taken off.
+	 */
+	bool emit(const j5::instruction &ins, bool carry, size_t first);
+
+private:
+	static const size_t NONE = SIZE_MAX;
+	struct value {
+		uint16_t bias;
+		size_t set; ///< Position of a SET that can take the bias off, NONE if there isn't one
+	};
+
+	void adjust(size_t set, uint16_t by)
+	{
+		auto &op = this->out.code[set].op;
+		op = static_cast<uint16_t>(boost::get<uint16_t>(op) + by);
+	}
+	value &at(size_t depth)
+	{
+		return this->values[this->values.size() - depth];
+	}
+	bool settle(size_t depth, bool may_emit);
+
+	j5_emitter &out;
+	std::vector<value> values; ///< Bottom first
+};
+
+/**
+ * Takes the bias off the value at depth (from the top, 1).
+ * @param may_emit Whether code can be added to do it, which sets the carry.
+ */
+bool carried_biases::settle(size_t depth, bool may_emit)
+{
+	value &v = this->at(depth);
+	if (v.bias != 0 && v.set != NONE) {
+		this->adjust(v.set, -v.bias);
+	} else if (v.bias != 0) {
+		if (!may_emit || depth > 3) return false;
+		if (depth == 2) this->out.emit(j5::op_t::SWAP);
+		if (depth == 3) this->out.emit(j5::op_t::RSD3);
+		apply_bias(this->out, j5::op_t::SUB, v.bias);
+		if (depth == 2) this->out.emit(j5::op_t::SWAP);
+		if (depth == 3) this->out.emit(j5::op_t::RSU3);
+	}
+	v = {0, NONE};
+	return true;
+}
+
+bool carried_biases::emit(const j5::instruction &ins, bool carry, size_t first)
+{
+	auto &vs = this->values;
+	auto top = [&vs](size_t depth) -> value & {return vs[vs.size() - depth];};
+	const size_t pos = this->out.code.size();
+	bool kept = true; // whether the values keep their biases through it
+	switch (ins.code) {
+		case j5::op_t::SET:
+			vs.push_back({0, ins.op.which() == 1 ? pos : NONE});
+			break;
+		case j5::op_t::DROP:
+			vs.pop_back();
+			break;
+		case j5::op_t::DUP:
+			top(1).set = NONE;
+			vs.push_back(top(1));
+			break;
+		case j5::op_t::SWAP:
+			std::swap(top(1), top(2));
+			break;
+		case j5::op_t::RSD3: // (z, x, y) -> (x, y, z)
+			std::rotate(vs.end() - 3, vs.end() - 2, vs.end());
+			break;
+		case j5::op_t::RSU3: // (z, x, y) -> (y, z, x)
+			std::rotate(vs.end() - 3, vs.end() - 1, vs.end());
+			break;
+		case j5::op_t::TUCK2: // (x, y) -> (y, x, y)
+			top(1).set = NONE;
+			vs.insert(vs.end() - 2, top(1));
+			break;
+		case j5::op_t::TUCK3: // (z, x, y) -> (y, z, x, y)
+			top(1).set = NONE;
+			vs.insert(vs.end() - 3, top(1));
+			break;
+		case j5::op_t::COPY3: // (z, x, y) -> (z, x, y, z)
+			top(3).set = NONE;
+			vs.push_back(top(3));
+			break;
+		case j5::op_t::ADD:
+		case j5::op_t::SUB:
+			kept = !carry;
+			if (!kept) break;
+			/* A register biased by the constant it's added to is already the sum */
+			if (ins.code == j5::op_t::ADD && top(1).set == pos - 1 && pos - 1 > first && top(2).bias != 0
+					&& boost::get<uint16_t>(this->out.code[pos - 1].op) == top(2).bias) {
+				this->out.code.pop_back();
+				vs.pop_back();
+				top(1) = {0, NONE};
+				return true;
 			}
+			top(2).bias += ins.code == j5::op_t::ADD ? top(1).bias : -top(1).bias;
+			if (top(2).set == NONE && ins.code == j5::op_t::ADD) top(2).set = top(1).set;
+			vs.pop_back();
+			break;
+		case j5::op_t::INC:
+		case j5::op_t::DEC:
+			kept = !carry;
+			break;
+		case j5::op_t::TEQ:
+			/* Equal either way if both have the same bias */
+			if (top(1).bias != top(2).bias && top(1).set != NONE) {
+				this->adjust(top(1).set, top(2).bias - top(1).bias);
+				top(1).bias = top(2).bias;
+			} else if (top(1).bias != top(2).bias && top(2).set != NONE) {
+				this->adjust(top(2).set, top(1).bias - top(2).bias);
+				top(2).bias = top(1).bias;
+			}
+			kept = top(1).bias == top(2).bias;
+			if (kept) top(1).set = top(2).set = NONE;
+			break;
+		default:
+			kept = false;
+			break;
+	}
+
+	/* Anything else uses the values as they are, and ADC/SBC the carry */
+	if (!kept) {
+		const size_t pops = j5::machine::STACK_POP.at(ins.code);
+		const bool reads_carry = ins.code == j5::op_t::ADC || ins.code == j5::op_t::SBC;
+		for (size_t depth = 1; depth <= pops; depth++) {
+			if (!this->settle(depth, !reads_carry)) return false;
 		}
-		snippets.push_back(snippet);
+		vs.resize(vs.size() - pops);
+		vs.resize(vs.size() + pops + j5::machine::STACK_DIFF.at(ins.code), {0, NONE});
+	}
+	this->out.code.push_back(ins);
+	if (ins.code != j5::op_t::LABEL) this->out.code.back().label.clear();
+	return true;
+}
+
+/* Writes changed stack registers back to memory, leaving them on the stack */
+static void write_back_stack_regs(j5_emitter &out, const std::vector<dcpu16::reg_t> &regs,
+		const std::vector<uint16_t> &bias, const std::vector<bool> &dirty)
+{
+	for (size_t k = 0; k < regs.size(); k++) {
+		if (!dirty[k]) continue;
+		read_stack_reg(out, regs.size() - k);
+		apply_bias(out, j5::op_t::SUB, bias[k]);
+		out.emit(j5::op_t::SET, reg2memaddr(regs[k]));
+		out.emit(j5::op_t::STORE);
+	}
+}
+
+/* Writes stack registers back to memory (if changed), leaving the stack empty */
+static void spill_stack_regs(j5_emitter &out, const std::vector<dcpu16::reg_t> &regs,
+		const std::vector<uint16_t> &bias, const std::vector<bool> &dirty)
+{
+	for (size_t k = regs.size(); k-- > 0;) {
+		if (dirty[k]) {
+			apply_bias(out, j5::op_t::SUB, bias[k]);
+			out.emit(j5::op_t::SET, reg2memaddr(regs[k]));
+			out.emit(j5::op_t::STORE);
+		} else {
+			out.emit(j5::op_t::DROP);
+		}
+	}
+}
+
+/**
+ * Rewrites register accesses to refer to the stack registers, which sit at
+ * the bottom of the stack (last one on top) with everything else above them.
+ * Exits to a block with the same stack registers (including this one, when
+ * looping) leave them there for it, after writing back any changes.
+ * @param in Converted block.
+ * @param out Where to put the rewritten block.
+ * @param exits Layouts of the following blocks, or null to always spill.
+ * @param biases What each register has added to it on the stack (see
+ *               loop_stack_regs), empty for nothing.
+ * @return Whether every access could be reached with the stack operations.
+ */
+static bool rewrite_stack_regs(const j5_emitter &in, j5_emitter &out, const std::vector<dcpu16::reg_t> &regs,
+		const exit_layouts &exits, const std::vector<uint16_t> &biases = {})
+{
+	const int num_regs = regs.size();
+	const std::vector<uint16_t> bias = biases.empty() ? std::vector<uint16_t>(regs.size(), 0) : biases;
+	std::vector<bool> dirty(regs.size(), false);
+	for (size_t n = 0; n < in.num_instructions(); n++) {
+		for (size_t i = in.start(n); i < in.end(n); i++) {
+			auto pos = std::find(regs.begin(), regs.end(), reg_access(in.code, i, in.end(n)));
+			if (pos != regs.end() && in.code[i + 1].code == j5::op_t::STORE) dirty[pos - regs.begin()] = true;
+		}
+	}
+	symbol own_label = in.code[in.start(0)].label;
+	auto leave = [&](symbol target) {
+		if (exits && !target.empty() && target == own_label) {
+			return; // loops back to the warm entry, anything dirty still is
+		} else if (exits && exits(target) == regs) {
+			write_back_stack_regs(out, regs, bias, dirty);
+		} else {
+			spill_stack_regs(out, regs, bias, dirty);
+		}
+	};
+
+	/* Values above the stack registers at each local label, where every way
+	 * in has to agree so the registers are at the same depth */
+	std::map<symbol, int> label_heights;
+	carried_biases carried(out);
+	for (size_t n = 0; n < in.num_instructions(); n++) {
+		out.begin_instruction();
+		size_t start = out.code.size();
+		if (in.start(n) != in.end(n)) out.from(in.code[in.start(n)]);
+		if (n == 0) {
+			for (size_t k = 0; k < regs.size(); k++) {
+				out.emit(j5::op_t::SET, reg2memaddr(regs[k]));
+				out.emit(j5::op_t::LOAD);
+				apply_bias(out, j5::op_t::ADD, bias[k]);
+			}
+			if (!regs.empty()) out.emit_label(WARM_ENTRY);
+		}
+
+		int height = 0; // values above the stack registers
+		bool reachable = true; // by falling through from the last instruction
+		carried.reset(0);
+		for (size_t i = in.start(n); i < in.end(n); i++) {
+			const auto &ins = in.code[i];
+			out.from(ins);
+			auto pos = std::find(regs.begin(), regs.end(), reg_access(in.code, i, in.end(n)));
+			if (pos != regs.end()) {
+				// depth from top (1) of the register
+				int depth = height + num_regs - (pos - regs.begin());
+				uint16_t b = bias[pos - regs.begin()];
+				if (depth > 3) return false;
+				if (in.code[i + 1].code == j5::op_t::LOAD) {
+					read_stack_reg(out, depth);
+					carried.push(b);
+					height++;
+				} else {
+					carried.write(b);
+					// new value is on top, so register is at least depth 2
+					if (depth == 3) {
+						out.emit(j5::op_t::RSD3);
+						out.emit(j5::op_t::DROP);
+						out.emit(j5::op_t::SWAP);
+					} else {
+						out.emit(j5::op_t::SWAP);
+						out.emit(j5::op_t::DROP);
+					}
+					height--;
+				}
+				i++;
+				continue;
+			}
+
+			if (is_block_exit(ins)) {
+				if (height != 0) return false;
+				if (ins.code == j5::op_t::STOP) {
+					spill_stack_regs(out, regs, bias, dirty);
+				} else {
+					leave(boost::get<symbol>(ins.op));
+				}
+			} else if (ins.code == j5::op_t::LABEL) {
+				auto at = label_heights.emplace(ins.label, height).first;
+				if (!reachable) {
+					height = at->second;
+				} else if (at->second != height || !carried.settle_all()) {
+					return false;
+				}
+				carried.reset(height);
+				reachable = true;
+			} else if ((ins.code == j5::op_t::BRZERO || ins.code == j5::op_t::BRANCH) && ins.op.which() == 2
+					&& j5::is_local_label(boost::get<symbol>(ins.op))) {
+				/* Both sides of a local branch need the registers in the same place */
+				auto at = label_heights.emplace(boost::get<symbol>(ins.op), height).first;
+				if (at->second != height || !carried.settle_all()) return false;
+			} else if (ins.code == j5::op_t::BRZERO || ins.code == j5::op_t::BRANCH) {
+				if (height != 0) return false;
+			}
+			if (ins.code == j5::op_t::BRANCH || ins.code == j5::op_t::STOP) reachable = false;
+			/* The carry an ADD or SUB sets is only used straight after, for EX */
+			bool carry = std::any_of(in.code.begin() + i + 1, in.code.begin() + std::min(i + 4, in.end(n)),
+					[](const j5::instruction &c){return c.code == j5::op_t::ADC || c.code == j5::op_t::SBC;});
+			if (!carried.emit(ins, carry, start)) return false;
+			height += j5::machine::STACK_DIFF.at(ins.code);
+		}
+		if (in.start(n) != in.end(n)) out.code[start].label = in.code[in.start(n)].label;
+	}
+
+	/* Falls through to the next block, maybe by skipping the last
+	 * instruction, in which case its code ends with the skip label */
+	size_t last = in.num_instructions() - 1;
+	if (!is_block_exit(in.code[in.end(last) - 1])) {
+		out.begin_instruction();
+		leave(symbol());
+	}
+	return true;
+}
+
+/* Number of accesses to each register's memory slot */
+std::map<dcpu16::reg_t, size_t> count_reg_accesses(const prog_snippet &code)
+{
+	std::map<dcpu16::reg_t, size_t> uses;
+	for (size_t i = 0; i < code.size(); i++) {
+		auto r = reg_access(code, i, code.size());
+		if (r != dcpu16::reg_t::NUM_REGS) uses[r]++;
+	}
+	return uses;
+}
+
+/**
+ * Register allocation for a block. Keeps the most used registers on the
+ * stack instead of going through their memory slots each time, reading them
+ * with DUP/COPY3 etc. They are loaded at the start of the block and spilt
+ * back to memory whenever the block is left, unless the next block can use
+ * them as they are.
+ * @param out Converted block, modified in place.
+ * @param max_regs Maximum number of registers to keep on the stack.
+ * @param exits Layouts of the following blocks, or null to always spill.
+ * @param loop Stack registers of the loop the block is in, used if they
+ *             fit so they stay on the stack all the way round.
+ * @return The stack registers, bottom first.
+ */
+std::vector<dcpu16::reg_t> allocate_stack_regs(j5_emitter &out, size_t max_regs, const exit_layouts &exits,
+		const loop_stack_regs *loop)
+{
+	/* Needs a clean start, an empty instruction has nowhere to keep a label */
+	if (out.num_instructions() == 0) return {};
+	for (size_t n = 0; n < out.num_instructions(); n++) {
+		if (out.start(n) == out.end(n)) return {};
+	}
+
+	if (loop != nullptr && !loop->regs.empty() && loop->regs.size() <= max_regs) {
+		j5_emitter trial(out.num_instructions() + 1);
+		if (rewrite_stack_regs(out, trial, loop->regs, exits, loop->bias)) {
+			log<LOG_DEBUG2>("# Loop stack registers: ", loop->regs.size());
+			out = std::move(trial);
+			return loop->regs;
+		}
+	}
+
+	std::map<dcpu16::reg_t, size_t> uses;
+	for (size_t n = 0; n < out.num_instructions(); n++) {
+		for (size_t i = out.start(n); i < out.end(n); i++) {
+			auto r = reg_access(out.code, i, out.end(n));
+			if (r != dcpu16::reg_t::NUM_REGS) uses[r]++;
+		}
+	}
+	/* Worth the load & spill, which a block looping to itself with the
+	 * registers left on the stack only does once for the whole loop */
+	symbol own_label = out.code[out.start(0)].label;
+	bool loops = exits && std::any_of(out.code.begin(), out.code.end(), [own_label](const j5::instruction &i){
+		return is_block_exit(i) && i.code == j5::op_t::BRANCH && boost::get<symbol>(i.op) == own_label;
+	});
+	std::vector<dcpu16::reg_t> regs;
+	for (const auto &u : uses) {
+		if (u.second >= (loops ? 1 : 3)) regs.push_back(u.first);
+	}
+	std::stable_sort(regs.begin(), regs.end(), [&uses](auto a, auto b){return uses[a] > uses[b];});
+	if (regs.size() > max_regs) regs.resize(max_regs);
+
+	/* Deeper registers can end up out of reach, so back off until it fits.
+	 * The loop's registers are only ever kept as the loop keeps them */
+	for (; !regs.empty(); regs.pop_back()) {
+		j5_emitter trial(out.num_instructions() + 1);
+		if (!rewrite_stack_regs(out, trial, regs, exits, loop != nullptr && regs == loop->regs ? loop->bias
+				: std::vector<uint16_t>())) continue;
+
+		auto memcount = [](const prog_snippet &s){
+			return std::count_if(s.begin(), s.end(), [](const auto &i){return i.code == j5::op_t::LOAD || i.code == j5::op_t::STORE;});
+		};
+		log<LOG_DEBUG2>("# Stack registers: ", regs.size(), " (memory ops ", memcount(out.code), " -> ", memcount(trial.code), ")");
+		out = std::move(trial);
+		return regs;
 	}
-	j5::program ret;
-	for(const auto &v : snippets) ret.insert(ret.end(), v.begin(), v.end());
-	return ret;
+	return regs;
 }
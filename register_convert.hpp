@@ -1,41 +1,246 @@
 #ifndef REGISTER_CONVERT_HPP
 #define REGISTER_CONVERT_HPP
 
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
 #include <vector>
 
+#include "dataflow.hpp"
 #include "register_machine.hpp"
 #include "stack_machine.hpp"
 
 using prog_snippet = std::vector<j5::instruction>;
 
+/**
+ * Output buffer for converted code. All the code for a block is appended to
+ * one buffer, with the start of each register instruction's code recorded so
+ * later passes can find the code for a particular instruction.
+ */
+class j5_emitter {
+public:
+	/* Rough guess of J5 instructions per register instruction */
+	static const size_t EST_LENGTH = 16;
+
+	/**
+	 * @param first_pc Index in the register program of the first
+	 *                 instruction to be converted, for the origin of the code.
+	 */
+	explicit j5_emitter(size_t num_instructions, size_t first_pc = 0) : first_pc(first_pc), labels(0)
+	{
+		this->code.reserve(num_instructions * EST_LENGTH);
+		this->starts.reserve(num_instructions);
+	}
+
+	inline void emit(j5::op_t code)
+	{
+		this->push({symbol(), code, boost::blank()});
+	}
+	inline void emit(j5::op_t code, uint16_t op)
+	{
+		this->push({symbol(), code, op});
+	}
+	inline void emit(j5::op_t code, symbol label)
+	{
+		this->push({symbol(), code, label});
+	}
+	inline void emit(const prog_snippet &ops)
+	{
+		for (const auto &ins : ops) this->push(ins);
+	}
+
+	inline void emit_label(symbol label)
+	{
+		this->push({label, j5::op_t::LABEL, boost::blank()});
+	}
+	/* Code emitted from now on is converted from instruction n of those being converted */
+	inline void from(size_t n, uint32_t line)
+	{
+		this->origin.reg_pc = this->first_pc + n;
+		this->origin.line = line;
+	}
+	/* Code emitted from now on stands in for ins */
+	inline void from(const j5::instruction &ins)
+	{
+		this->origin.reg_pc = ins.reg_pc;
+		this->origin.line = ins.line;
+	}
+	inline symbol new_label()
+	{
+		return "." + std::to_string(this->labels++);
+	}
+
+	/* Start the code for the next register instruction */
+	inline void begin_instruction()
+	{
+		while (!this->skips.empty() && this->skips.front().first == this->starts.size()) {
+			this->emit_label(this->skips.front().second);
+			this->skips.pop_front();
+		}
+		this->starts.push_back(this->code.size());
+	}
+	/**
+	 * Local label for the end of the next register instruction's code,
+	 * which is where a conditional goes to skip it.
+	 */
+	inline symbol skip_next()
+	{
+		symbol label = this->new_label();
+		this->skips.emplace_back(this->starts.size() + 1, label);
+		return label;
+	}
+	/* Places any skip labels still waiting for the end of their instruction */
+	inline void finish()
+	{
+		for (const auto &skip : this->skips) this->emit_label(skip.second);
+		this->skips.clear();
+	}
+	inline size_t num_instructions() const
+	{
+		return this->starts.size();
+	}
+	/* Code for instruction n is in [start(n), end(n)) */
+	inline size_t start(size_t n) const
+	{
+		return this->starts[n];
+	}
+	inline size_t end(size_t n) const
+	{
+		return n + 1 < this->starts.size() ? this->starts[n + 1] : this->code.size();
+	}
+
+	prog_snippet code;
+private:
+	inline void push(j5::instruction ins)
+	{
+		ins.reg_pc = this->origin.reg_pc;
+		ins.line = this->origin.line;
+		this->code.push_back(std::move(ins));
+	}
+
+	size_t first_pc;
+	j5::instruction origin; ///< Only its reg_pc and line, given to everything emitted
+	std::vector<size_t> starts;
+	size_t labels; ///< Local labels made so far
+	std::deque<std::pair<size_t, symbol>> skips; ///< Skip labels, placed when that instruction is begun
+};
+
+/**
+ * Converts straight line runs of instructions through a dataflow graph,
+ * falling back to converting them one at a time where that isn't possible.
+ * Each run is one instruction as far as the emitter is concerned, and its
+ * code is all from the first instruction of the run.
+ */
+class dataflow_converter {
+public:
+	/**
+	 * @param live Registers live after each instruction to be added, or
+	 *             null to treat them all as live.
+	 */
+	dataflow_converter(j5_emitter &out, const liveness::reg_set *live)
+		: out(out), live(live), next(0), last(0), after_if(false) {}
+
+	void add(const dcpu16::instruction &ins);
+	void flush();
+
+private:
+	j5_emitter &out;
+	const liveness::reg_set *live;
+	dataflow::block graph;
+	std::vector<const dcpu16::instruction *> instructions; ///< Instructions in graph
+	size_t next; ///< Index of the next instruction to be added
+	size_t last; ///< Index of the last instruction in graph
+	prog_snippet code;
+	bool after_if;
+};
+
+uint16_t reg2memaddr(dcpu16::reg_t r);
+dcpu16::operand_t simple_operand(const std::string &s, size_t begin, size_t end);
 j5::program reg2stack(dcpu16::program p);
-prog_snippet convert_instruction(const dcpu16::instruction &r);
+void convert_instruction(const dcpu16::instruction &r, j5_emitter &out);
+void if_branches(j5_emitter &out, bool invert);
+
+/**
+ * Stack registers the block a branch goes to expects to find on the stack,
+ * bottom first. The label is empty for falling through to the next block.
+ */
+using exit_layouts = std::function<std::vector<dcpu16::reg_t>(symbol label)>;
+
+/* Local label after a block's stack register loads, entered when they are already there */
+static const symbol WARM_ENTRY(".warm");
+
+/**
+ * Stack registers shared by every block of a loop, bottom first. A register
+ * the loop mostly uses to index memory, as I in [0x3000+I], can be kept with
+ * the base added on, so each access through it is just a LOAD or STORE. The
+ * base comes off again for any other use and whenever it goes to memory.
+ */
+struct loop_stack_regs {
+	std::vector<dcpu16::reg_t> regs;
+	/* Added to each of regs while on the stack, empty if none is */
+	std::vector<uint16_t> bias;
+};
+
+std::map<dcpu16::reg_t, size_t> count_reg_accesses(const prog_snippet &code);
+std::vector<dcpu16::reg_t> allocate_stack_regs(j5_emitter &out, size_t max_regs, const exit_layouts &exits,
+		const loop_stack_regs *loop = nullptr);
+
+/**
+ * How convert_instructions converts a block. The defaults convert it one
+ * instruction at a time, with every register in memory.
+ */
+struct convert_options {
+	/* Most registers to keep on the stack for the duration of the block */
+	size_t stack_regs = 0;
+	/* Convert through dataflow graphs, rather than instruction by instruction */
+	bool use_dataflow = false;
+	/* Layouts of the blocks this one can go to, any exit to a block
+	 * expecting the same stack registers leaves them on the stack */
+	exit_layouts exits;
+	/* Registers live after each instruction, for dataflow to only write
+	 * back those. Null for all of them */
+	const liveness::reg_set *live = nullptr;
+	/* Stack registers of the loop the block is in, if any */
+	const loop_stack_regs *loop = nullptr;
+	/* Index of the block's first instruction in the register program,
+	 * which each instruction's reg_pc counts from */
+	size_t first_pc = 0;
+};
+
+/**
+ * Converts a block of register instructions. Branches within the block
+ * refer to local labels, which layout_branches resolves once any other
+ * passes are done with the code.
+ * @param regs Set to the stack registers used, if not null.
+ */
 template<typename It>
-prog_snippet convert_instructions(It begin, It end)
+prog_snippet convert_instructions(It begin, It end, const convert_options &opts = {},
+		std::vector<dcpu16::reg_t> *regs = nullptr)
 {
-	std::vector<prog_snippet> snippets;
-	for (auto it = begin; it != end; ++it) {
-		auto snippet = convert_instruction(*it);
-		/* Deal with generated BRZERO from if statements
-		 * requiring the length of the next instruction */
-		if (snippets.size() != 0) {
-			auto &last = snippets.back();
-			auto &last_last = last.back();
-			if (last_last.op.which() == 1 && boost::get<uint16_t>(last_last.op) == 42 &&
-					(last_last.code == j5::op_t::BRZERO || last_last.code == j5::op_t::BRANCH)) {
-				last_last.op = snippet.size() + 1;
-			}
+	j5_emitter out(std::distance(begin, end), opts.first_pc);
+	if (opts.use_dataflow) {
+		dataflow_converter conv(out, opts.live);
+		for (auto it = begin; it != end; ++it) {
+			conv.add(*it);
 		}
-		snippets.push_back(snippet);
+		conv.flush();
+	} else {
+		for (auto it = begin; it != end; ++it) {
+			out.from(it - begin, it->line);
+			convert_instruction(*it, out);
+		}
+	}
+	out.finish();
+	if (opts.stack_regs > 0) {
+		auto used = allocate_stack_regs(out, opts.stack_regs, opts.exits, opts.loop);
+		if (regs != nullptr) *regs = std::move(used);
 	}
-	/* Flatten */
-	prog_snippet ret;
-	for (const auto & snip : snippets) ret.insert(ret.end(), snip.begin(), snip.end());
-	return ret;
+	return std::move(out.code);
 }
 
-prog_snippet index_on_stack(dcpu16::operand_t x);
-prog_snippet address_on_stack(dcpu16::operand_t x);
-prog_snippet value_on_stack(dcpu16::operand_t x);
+void index_on_stack(j5_emitter &out, const dcpu16::operand_t &x);
+void address_on_stack(j5_emitter &out, const dcpu16::operand_t &x);
+void value_on_stack(j5_emitter &out, const dcpu16::operand_t &x);
 
 #endif /* REGISTER_CONVERT_HPP */
@@ -2,9 +2,14 @@
 #include <boost/optional.hpp>
 #include <chrono>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <sstream>
 #include <thread>
 
+#include "perf_counters.hpp"
+#include "profile.hpp"
+#include "sampler.hpp"
 #include "register_machine.hpp"
 #include "util.hpp"
 
@@ -38,7 +43,7 @@ std::ostream& operator<<(std::ostream& os, const instruction& ins)
 	if (!ins.label.empty()) os << ins.label << ": ";
 	os << OP_T_STR.at((size_t)ins.code);
 	os << " '" << ins.b << "'";
-	if (!(ins.a.which() == 0 && boost::get<std::string>(ins.a).empty())) os << " '" << ins.a << "'";
+	if (!(ins.a.which() == 0 && boost::get<symbol>(ins.a).empty())) os << " '" << ins.a << "'";
 	return os;
 }
 
@@ -52,32 +57,34 @@ bool operator!=(const instruction &a, const instruction &b)
 	return !(a == b);
 }
 
-operand_t get_operand(const std::string &tok)
+operand_t get_operand(boost::string_view tok)
 {
-	operand_t ret;
-	if (tok.size() > 2 && tok[0] == '0'
-			&& tolower(tok[1]) == 'x' && is_hex(tok.substr(2))) {
-		// hex literal
-		ret = static_cast<uint16_t>(std::stoul(tok.substr(2), nullptr, 16));
-	} else if (std::all_of(tok.begin(), tok.end(), ::isdigit)) {
-		// decimal literal
-		ret = static_cast<uint16_t>(std::stoul(tok));
-	} else if (std::find(REG_T_STR.begin(), REG_T_STR.end(), tok) != REG_T_STR.end()) {
+	uint16_t value;
+	if (tok.size() > 2 && tok[0] == '0' && tolower(tok[1]) == 'x' && parse_number(tok.substr(2), 16, value)) {
+		return value; // hex literal
+	} else if (parse_number(tok, 10, value)) {
+		return value; // decimal literal
+	}
+	auto reg = std::find(REG_T_STR.begin(), REG_T_STR.end(), tok);
+	if (reg != REG_T_STR.end()) {
 		// register (& pc, sp, etc)
-		ret = find_reg(tok);
+		return static_cast<reg_t>(reg - REG_T_STR.begin());
 	} else if (tok.size() >= 2 && tok.front() == '"' && tok.back() == '"') {
-		ret = tok.substr(1, tok.length() - 2); // TODO: unescape control chars
-	} else {
-		// probably a string literal or label.
-		ret = tok;
+		return symbol(tok.substr(1, tok.length() - 2)); // TODO: unescape control chars
 	}
-	return ret;
+	// probably a string literal or label.
+	return symbol(tok);
 }
 
-boost::optional<instruction> tokenise_line(const std::string &line)
+/**
+ * Tokenises a line of source.
+ * @param words Somewhere to split it into, kept between lines.
+ * @return The instruction, if there is one on the line.
+ */
+boost::optional<instruction> tokenise_line(boost::string_view line, std::vector<boost::string_view> &words)
 {
 	// Parse into separate words
-	std::vector<std::string> words = split_words(line);
+	split_words(line, words);
 	if (words.empty()) return boost::none;
 
 	instruction ins;
@@ -86,12 +93,13 @@ boost::optional<instruction> tokenise_line(const std::string &line)
 	if (it->front() == ':') { // :LABEL
 		ins.label = it->substr(1);
 		++it;
+		if (it == words.end()) throw "No instruction after label " + ins.label.str();
 	}
 
 	// Get operation
 	auto opit = std::find(OP_T_STR.begin(), OP_T_STR.end(), *it);
 	if (opit == OP_T_STR.end()) {
-		throw "Unknown op code: " + *it;
+		throw "Unknown op code: " + it->to_string();
 	}
 	ins.code = static_cast<op_t>(std::distance(OP_T_STR.begin(), opit));
 	it++;
@@ -114,160 +122,299 @@ boost::optional<instruction> tokenise_line(const std::string &line)
 
 }
 
-program tokenise_source(const std::string &source)
+/* Tokenises a run of whole lines on the calling thread, the first being line number first_line */
+static program tokenise_lines(boost::string_view source, uint32_t first_line)
 {
-	std::stringstream iss(source);
-
 	program prog;
-	std::string line;
-
-	std::string::size_type pos = 0;
-	std::string::size_type prev = 0;
-	while ((pos = source.find('\n', prev)) != std::string::npos)
-	{
-		std::string line = source.substr(prev, pos - prev);
-		boost::optional<instruction> ins = tokenise_line(line);
-		if (ins) prog.push_back(*ins);
-		prev = pos + 1;
-	}
+	prog.reserve(std::count(source.begin(), source.end(), '\n') + 1);
+	std::vector<boost::string_view> words;
+	uint32_t lineno = first_line;
+	for_each_line(source, [&prog, &words, &lineno](boost::string_view line) {
+		boost::optional<instruction> ins = tokenise_line(line, words);
+		if (ins) {
+			ins->line = lineno;
+			prog.push_back(std::move(*ins));
+		}
+		lineno++;
+	});
 	return prog;
 }
 
-uint16_t machine::find_label(const std::string &l)
+/**
+ * Tokenises a whole source, large ones split across threads.
+ * @param source Source text.
+ * @param threads Number of threads to use at most, 0 for one per core.
+ * @return The program.
+ */
+program tokenise_source(boost::string_view source, size_t threads)
 {
-	auto pos = std::find_if(this->cur_prog.begin(), this->cur_prog.end(), [l](const instruction &i) { return i.label == l; });
-	if (pos == this->cur_prog.end()) {
-		throw "Undefined label '" + l + "' used";
-	}
-	return std::distance(this->cur_prog.begin(), pos);
+	return tokenise_chunks<program>(source, threads, tokenise_lines);
 }
 
-uint16_t machine::get_val(const operand_t &x)
-{
-	switch (x.which()) {
-		case 0: { // string
-			// much sad.
-			std::string op = boost::get<std::string>(x);
-			if (is_array_type(op)) {
-				std::string interior = op.substr(1, op.length() - 2);
-				return this->mem.at(this->get_val(get_operand(interior)));
-			} else if (op.find('+') != std::string::npos) { // expression. needs expanding to others
-				size_t pos = op.find('+');
-				std::string p1 = op.substr(0, pos);
-				std::string p2 = op.substr(pos + 1);
-				return this->get_val(get_operand(p1)) + this->get_val(get_operand(p2));
-			} else {
-				return this->find_label(op);
+/**
+ * Tokenises a program a line at a time as it's read, for a machine to start
+ * on before the end of it has been written.
+ */
+program_reader read_program(std::istream &in)
+{
+	auto line = std::make_shared<std::string>();
+	auto words = std::make_shared<std::vector<boost::string_view>>();
+	auto lineno = std::make_shared<uint32_t>(0);
+	return [&in, line, words, lineno](program &prog) {
+		while (std::getline(in, *line)) {
+			++*lineno;
+			boost::optional<instruction> ins = tokenise_line(*line, *words);
+			if (ins) {
+				ins->line = *lineno;
+				prog.push_back(std::move(*ins));
+				return true;
 			}
 		}
-		case 1: // reg
-			return this->get_reg(boost::get<reg_t>(x));
-		case 2: // literal
-			return boost::get<uint16_t>(x);
+		return false;
+	};
+}
+
+/* Whether there is an instruction pc, reading up to it if the program is still coming */
+bool machine::fetch(size_t pc)
+{
+	while (pc >= this->cur_prog.size() && this->reader) {
+		program more;
+		if (this->reader(more)) {
+			size_t first = this->cur_prog.size();
+			std::move(more.begin(), more.end(), std::back_inserter(this->cur_prog));
+			this->decode_from(first);
+		} else {
+			this->reader = nullptr;
+		}
+	}
+	return pc < this->cur_prog.size();
+}
+
+/* Labels further on than has been read yet are read up to when first used */
+uint16_t machine::find_label(symbol l)
+{
+	for (size_t searched = 0;;) {
+		auto pos = std::find_if(this->cur_prog.begin() + searched, this->cur_prog.end(), [l](const instruction &i) { return i.label == l; });
+		if (pos != this->cur_prog.end()) return std::distance(this->cur_prog.begin(), pos);
+		searched = this->cur_prog.size();
+		if (!this->fetch(searched)) throw "Undefined label '" + l.str() + "' used";
+	}
+}
+
+/* Takes a symbolic operand apart into registers, literals and labels */
+machine::decoded_operand machine::decode(const operand_t &x)
+{
+	decoded_operand d;
+	d.x = x;
+	if (x.which() != 0) return d;
+	const std::string &name = boost::get<symbol>(x).str();
+	boost::string_view op(name);
+	if (is_array_type(name)) {
+		d.kind = decoded_operand::MEMORY;
+		op = op.substr(1, op.length() - 2);
+	} else if (op.find('+') != boost::string_view::npos) { // expression. needs expanding to others
+		d.kind = decoded_operand::SUM;
+	} else {
+		d.kind = decoded_operand::LABEL;
+		return d;
+	}
+	size_t pos = op.find('+');
+	if (pos == boost::string_view::npos) {
+		d.x = get_operand(op);
+		d.y = uint16_t(0);
+	} else {
+		d.x = get_operand(op.substr(0, pos));
+		d.y = get_operand(op.substr(pos + 1));
+	}
+	return d;
+}
+
+/* Decodes the operands of the instructions from first on, as they're added */
+void machine::decode_from(size_t first)
+{
+	for (size_t pc = first; pc < this->cur_prog.size(); pc++) {
+		this->decoded.push_back({{decode(this->cur_prog[pc].b), decode(this->cur_prog[pc].a)}});
+	}
+}
+
+/* Value of a register, literal or label within a decoded operand */
+uint16_t machine::term(const operand_t &t)
+{
+	switch (t.which()) {
+		case 0:
+			return this->find_label(boost::get<symbol>(t));
+		case 1:
+			return this->get_reg(boost::get<reg_t>(t));
+		case 2:
+			return boost::get<uint16_t>(t);
 	}
 	throw "Could not get value??";
 }
 
-void machine::set_val(const operand_t &x, uint16_t val)
+uint16_t machine::get_val(const decoded_operand &d)
 {
-	switch (x.which()) {
-		case 0: {
-			// duplicates a lot of get_val
-			std::string op = boost::get<std::string>(x);
-			if (is_array_type(op)) {
-				std::string interior = op.substr(1, op.length() - 2);
-				this->mem.at(this->get_val(get_operand(interior))) = val;
-			} else {
-				throw "Could not find value to set?";
+	switch (d.kind) {
+		case decoded_operand::PLAIN:
+		case decoded_operand::LABEL:
+			return this->term(d.x);
+		case decoded_operand::SUM:
+			return this->term(d.x) + this->term(d.y);
+		case decoded_operand::MEMORY:
+			return this->mem.at(static_cast<uint16_t>(this->term(d.x) + this->term(d.y)));
+	}
+	throw "Could not get value??";
+}
+
+void machine::set_val(const decoded_operand &d, uint16_t val)
+{
+	switch (d.kind) {
+		case decoded_operand::PLAIN:
+			if (d.x.which() == 1) {
+				auto reg = boost::get<reg_t>(d.x);
+				if (reg == reg_t::PC) val -= 1; // for postincrement
+				this->set_reg(reg, val);
 			}
-			break;
-		}
-		case 1: {
-			auto reg = boost::get<reg_t>(x);
-			if (reg == reg_t::PC) val -= 1; // for postincrement
-			this->set_reg(reg, val);
-			break;
-		}
-		case 2:
 			break; // silently fail attempting to set a literal
+		case decoded_operand::MEMORY:
+			this->mem.at(static_cast<uint16_t>(this->term(d.x) + this->term(d.y))) = val;
+			break;
+		default:
+			throw "Could not find value to set?";
 	}
 }
 
-void machine::run(const program &prog, bool speedlimit)
+void machine::load(const program &prog)
 {
-	this->cur_prog = prog;
+	this->cur_prog.assign(prog.begin(), prog.end());
+	this->decoded.clear();
+	this->decode_from(0);
+	this->reader = nullptr;
 	this->terminate = false;
 	this->skip_next = false;
+	this->regs.fill(0);
+	this->mem.fill(0);
 	this->set_reg(reg_t::SP, 0xffff);
+}
 
+/* Loads a program that is still being read, which is then read as it runs */
+void machine::load(const program_reader &reader)
+{
+	this->load(program());
+	this->reader = reader;
+}
 
+/**
+ * Runs the next instruction of the loaded program.
+ * @return Whether there is anything left to run.
+ */
+bool machine::step(bool speedlimit)
+{
 	uint16_t &pc = this->regs[(size_t)reg_t::PC]; // needs ref
-	for (; !this->terminate && pc < this->cur_prog.size(); pc++) {
-		auto start = std::chrono::high_resolution_clock::now();
+	if (this->terminate || !this->fetch(pc)) return false;
 
-		if (skip_next) {
-			skip_next = false;
-			continue;
-		}
+	if (this->skip_next) {
+		this->skip_next = false;
+		pc++;
+		return this->fetch(pc);
+	}
 
-		const auto &ins = this->cur_prog[pc];
-		log<LOG_DEBUG>(ins);
-		switch (ins.code) {
-			case op_t::OUT:
-				this->out_func(ins.b);
-				break;
-			case op_t::DAT:
-				this->dat_func(ins.b);
-				break;
-			// Bin ops
-			case op_t::SET:
-				if (ins.b == ins.a && ins.b.which() == 1 && boost::get<reg_t>(ins.b) == reg_t::PC) this->terminate = true;
-				/* FALLTHROUGH */
-			case op_t::ADD:
-			case op_t::SUB:
-			case op_t::MUL:
-			case op_t::MLI:
-			case op_t::DIV:
-			case op_t::DVI:
-			case op_t::MOD:
-			case op_t::MDI:
-			case op_t::AND:
-			case op_t::BOR:
-			case op_t::XOR:
-			case op_t::SHR:
-			case op_t::ASR:
-			case op_t::SHL:
-			case op_t::ADX:
-			case op_t::SBX: {
-				uint16_t b = this->get_val(ins.b);
-				uint16_t a = this->get_val(ins.a);
-				auto func = BIN_OPS.at(ins.code);
-				this->set_val(ins.b, func(this, b, a));
-				break;
-			}
-			// Cond ops
-			case op_t::IFB:
-			case op_t::IFC:
-			case op_t::IFE:
-			case op_t::IFN:
-			case op_t::IFG:
-			case op_t::IFA:
-			case op_t::IFL:
-			case op_t::IFU: {
-				uint16_t b = this->get_val(ins.b);
-				uint16_t a = this->get_val(ins.a);
-				auto func = COND_OPS.at(ins.code);
-				this->skip_next = !func(b, a);
-				break;
-			}
-			default:
-				throw "Unrecognised instruction " + OP_T_STR.at((size_t)ins.code);
+	auto start = std::chrono::high_resolution_clock::now();
+	const auto &ins = this->cur_prog[pc];
+	const auto &ops = this->decoded[pc];
+	log<LOG_DEBUG>(ins);
+	if (this->samp != nullptr && sampler::due) {
+		this->samp->take({sampler::enclosing(this->cur_prog, pc), sampler::frame(ins)});
+	}
+	profile::counts *counted = nullptr;
+	if (this->prof != nullptr) {
+		if (pc == 0 || !ins.label.empty()) this->prof->enter(pc);
+		counted = &this->prof->ran(pc);
+	}
+	switch (ins.code) {
+		case op_t::OUT:
+			this->out_func(ins.b, ops[0]);
+			break;
+		case op_t::DAT:
+			this->dat_func(ins.b);
+			break;
+		// Bin ops
+		case op_t::SET:
+			if (ins.b == ins.a && ins.b.which() == 1 && boost::get<reg_t>(ins.b) == reg_t::PC) this->terminate = true;
+			/* FALLTHROUGH */
+		case op_t::ADD:
+		case op_t::SUB:
+		case op_t::MUL:
+		case op_t::MLI:
+		case op_t::DIV:
+		case op_t::DVI:
+		case op_t::MOD:
+		case op_t::MDI:
+		case op_t::AND:
+		case op_t::BOR:
+		case op_t::XOR:
+		case op_t::SHR:
+		case op_t::ASR:
+		case op_t::SHL:
+		case op_t::ADX:
+		case op_t::SBX: {
+			uint16_t b = this->get_val(ops[0]);
+			uint16_t a = this->get_val(ops[1]);
+			auto func = BIN_OPS.at(ins.code);
+			this->set_val(ops[0], func(this, b, a));
+			break;
 		}
-		log<LOG_DEBUG2>(this->register_dump());
-		if (speedlimit) {
-			std::this_thread::sleep_until(start + std::chrono::milliseconds(100)); // arbitrary
+		// Cond ops
+		case op_t::IFB:
+		case op_t::IFC:
+		case op_t::IFE:
+		case op_t::IFN:
+		case op_t::IFG:
+		case op_t::IFA:
+		case op_t::IFL:
+		case op_t::IFU: {
+			uint16_t b = this->get_val(ops[0]);
+			uint16_t a = this->get_val(ops[1]);
+			auto func = COND_OPS.at(ins.code);
+			this->skip_next = !func(b, a);
+			if (counted != nullptr) profile::branch(*counted, !this->skip_next);
+			break;
 		}
+		default:
+			throw "Unrecognised instruction " + OP_T_STR.at((size_t)ins.code);
+	}
+	log<LOG_DEBUG2>(this->register_dump());
+	if (speedlimit) {
+		std::this_thread::sleep_until(start + std::chrono::milliseconds(100)); // arbitrary
 	}
+	pc++;
+	return !this->terminate && this->fetch(pc);
+}
+
+void machine::run(const program &prog, bool speedlimit)
+{
+	this->load(prog);
+	this->run_loaded(speedlimit);
+}
+
+void machine::run(const program_reader &reader, bool speedlimit)
+{
+	this->load(reader);
+	this->run_loaded(speedlimit);
+}
+
+void machine::run_loaded(bool speedlimit)
+{
+	if (this->counters == nullptr) {
+		while (this->step(speedlimit)) {}
+		this->out->flush();
+		return;
+	}
+	uint64_t n = 0;
+	this->counters->switch_to(perf_counters::RUN);
+	for (bool more = true; more; n++) more = this->step(speedlimit);
+	this->counters->switch_to(perf_counters::IDLE);
+	this->counters->executed(n);
+	this->out->flush();
 }
 
 std::string machine::register_dump()
@@ -341,13 +488,13 @@ uint16_t machine::add_op(uint16_t b, uint16_t a)
 
 uint16_t machine::sub_op(uint16_t b, uint16_t a)
 {
-	this->set_reg(reg_t::EX, a < b ? 0x1 : 0x0);
+	this->set_reg(reg_t::EX, a > b ? 0xffff : 0x0);
 	return b - a;
 }
 
 uint16_t machine::mul_op(uint16_t b, uint16_t a)
 {
-	uint32_t v = b * a;
+	uint32_t v = static_cast<uint32_t>(b) * a;
 	this->set_reg(reg_t::EX, (v >> 16) & 0xffff);
 	return v;
 }
@@ -365,7 +512,7 @@ uint16_t machine::div_op(uint16_t b, uint16_t a)
 		this->set_reg(reg_t::EX, 0x0);
 		return 0;
 	} else {
-		this->set_reg(reg_t::EX, ((b << 16) / a) & 0xffff);
+		this->set_reg(reg_t::EX, ((static_cast<uint32_t>(b) << 16) / a) & 0xffff);
 		return b / a;
 	}
 }
@@ -376,7 +523,8 @@ uint16_t machine::dvi_op(uint16_t b, uint16_t a)
 		this->set_reg(reg_t::EX, 0x0);
 		return 0;
 	} else {
-		this->set_reg(reg_t::EX, ((static_cast<int16_t>(b) << 16) / static_cast<int16_t>(a)) & 0xffff);
+		// 64 bit, as -0x8000 << 16 / -1 overflows
+		this->set_reg(reg_t::EX, ((static_cast<int64_t>(static_cast<int16_t>(b)) * 0x10000) / static_cast<int16_t>(a)) & 0xffff);
 		return static_cast<int16_t>(b) / static_cast<int16_t>(a);
 	}
 }
@@ -406,22 +554,29 @@ uint16_t machine::xor_op(uint16_t b, uint16_t a)
 	return b ^ a;
 }
 
+/*
+ * Shifts by 32 or more leave the same as by 32, everything shifted out of
+ * both b and EX. Clamping keeps the wide shifts below the width of the type.
+ */
 uint16_t machine::shr_op(uint16_t b, uint16_t a)
 {
-	this->set_reg(reg_t::EX, (b << 16) >> a);
-	return b >> a;
+	uint64_t wide = (static_cast<uint64_t>(b) << 16) >> std::min<uint16_t>(a, 32);
+	this->set_reg(reg_t::EX, wide);
+	return wide >> 16;
 }
 
 uint16_t machine::asr_op(uint16_t b, uint16_t a)
 {
-	this->set_reg(reg_t::EX, (static_cast<int16_t>(b) << 16) >> a);
-	return static_cast<int16_t>(b) >> a;
+	int64_t wide = (static_cast<int16_t>(b) * INT64_C(0x10000)) >> std::min<uint16_t>(a, 32);
+	this->set_reg(reg_t::EX, wide);
+	return wide >> 16;
 }
 
 uint16_t machine::shl_op(uint16_t b, uint16_t a)
 {
-	this->set_reg(reg_t::EX, (b << a) >> 16);
-	return b << a;
+	uint64_t wide = static_cast<uint64_t>(b) << std::min<uint16_t>(a, 32);
+	this->set_reg(reg_t::EX, wide >> 16);
+	return wide;
 }
 
 uint16_t machine::adx_op(uint16_t b, uint16_t a)
@@ -434,8 +589,9 @@ uint16_t machine::adx_op(uint16_t b, uint16_t a)
 uint16_t machine::sbx_op(uint16_t b, uint16_t a)
 {
 	uint16_t ex = this->get_reg(reg_t::EX);
-	this->set_reg(reg_t::EX, (a + ex < b) ? 0xffff : 0);
-	return b - a + ex;
+	int32_t v = b - a + ex;
+	this->set_reg(reg_t::EX, v < 0 ? 0xffff : (v > 0xffff ? 0x1 : 0x0));
+	return v;
 }
 
 
@@ -446,23 +602,29 @@ void machine::dat_func(operand_t x)
 	}
 }
 
-void machine::out_func(operand_t x)
+void machine::out_func(const operand_t &x, const decoded_operand &d)
 {
-	uint16_t addr = this->get_val(x);
+	uint16_t addr = this->get_val(d);
 	switch (x.which()) {
 		case 0:
-			if (isalpha(boost::get<std::string>(x)[0])) { // points to a label
-				std::cout << this->cur_prog.at(addr).b << '\n';
+			if (isalpha(boost::get<symbol>(x).str()[0])) { // points to a label
+				std::ostringstream ss;
+				ss << this->cur_prog.at(addr).b << '\n';
+				this->out->text(ss.str());
 			} else {
-				std::cout << std::to_string(addr) << '\n';
+				this->out->value(addr);
 			}
 			break;
 		case 1:
-			std::cout << std::to_string(addr) << '\n';
+			this->out->value(addr);
 			break;
-		case 2:
-			std::cout << this->cur_prog.at(addr);
+		case 2: {
+			this->fetch(addr);
+			std::ostringstream ss;
+			ss << this->cur_prog.at(addr);
+			this->out->text(ss.str());
 			break;
+		}
 	}
 }
 
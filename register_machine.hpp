@@ -2,11 +2,23 @@
 #define REGISTER_MACHINE_HPP
 
 #include <array>
+#include <boost/utility/string_view.hpp>
 #include <boost/variant.hpp>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <istream>
 #include <map>
 #include <string>
 #include <vector>
 
+#include "output.hpp"
+#include "symbol.hpp"
+
+class perf_counters;
+class profile;
+class sampler;
+
 namespace dcpu16 {
 
 enum class op_t {
@@ -115,40 +127,116 @@ inline bool is_array_type(const std::string &s)
 	return s.size() > 2 && s.front() == '[' && s.back() == ']';
 }
 
-using operand_t = boost::variant<std::string, reg_t, uint16_t>;
+using operand_t = boost::variant<symbol, reg_t, uint16_t>;
 
 struct instruction {
 	op_t code;
 	operand_t b, a;
-	std::string label;
+	symbol label;
+	uint32_t line = 0; ///< In the source, 0 if it didn't come from one
 };
 
 std::ostream& operator<<(std::ostream& os, const instruction& ins);
 bool operator==(const instruction &a, const instruction &b);
 bool operator!=(const instruction &a, const instruction &b);
 
-operand_t get_operand(const std::string &tok);
+operand_t get_operand(boost::string_view tok);
 
 using program = std::vector<instruction>;
 
-program tokenise_source(const std::string &source);
+program tokenise_source(boost::string_view source, size_t threads = 0);
+
+/**
+ * Appends the next instruction of a program that is still being read,
+ * returning false once there are no more.
+ */
+using program_reader = std::function<bool(program &prog)>;
+program_reader read_program(std::istream &in);
 
 class machine {
 public:
 	void run(const program &prog, bool speedlimit);
+	void run(const program_reader &reader, bool speedlimit);
+	void load(const program &prog);
+	void load(const program_reader &reader);
+	bool step(bool speedlimit = false);
 	std::string register_dump();
 
+	inline uint16_t reg(reg_t r) const
+	{
+		return this->regs.at(static_cast<size_t>(r));
+	}
+	inline uint16_t memory(uint16_t addr) const
+	{
+		return this->mem[addr];
+	}
+	/* Index of the next instruction to run */
+	inline uint16_t next_pc() const
+	{
+		return this->reg(reg_t::PC);
+	}
+	/* Counts what runs from now on into prof, null to stop */
+	inline void attach(profile *prof)
+	{
+		this->prof = prof;
+	}
+	/* Counts the interpreter's own performance while it runs into counters, null to stop */
+	inline void attach(perf_counters *counters)
+	{
+		this->counters = counters;
+	}
+	/* Where OUT writes to, std::cout unless changed */
+	inline void output_to(output &out)
+	{
+		this->out = &out;
+	}
+	/* Samples where the guest is into samp whenever it's due, null to stop */
+	inline void attach(sampler *samp)
+	{
+		this->samp = samp;
+	}
+	/* The program as far as it's been read */
+	inline program loaded() const
+	{
+		return program(this->cur_prog.begin(), this->cur_prog.end());
+	}
+
 private:
 	std::array<uint16_t, (size_t)reg_t::NUM_REGS> regs; // Could be a map?
 
 	std::array<uint16_t, 0x10000> mem;
-	program cur_prog;
+	/* Instructions stay where they are as more are read, while one is running */
+	std::deque<instruction> cur_prog;
+	program_reader reader; ///< Rest of the program, if it's still being read
+	profile *prof = nullptr;
+	perf_counters *counters = nullptr;
+	sampler *samp = nullptr;
+	output *out = &cout_output();
 	bool terminate;
 	bool skip_next;
 
-	uint16_t find_label(const std::string &l);
-	uint16_t get_val(const operand_t &x);
-	void set_val(const operand_t &x, uint16_t val);
+	/* An operand taken apart when loaded, so running it never goes back to its name */
+	struct decoded_operand {
+		enum {
+			PLAIN,  ///< A register or literal, as it is
+			LABEL,  ///< Just a label
+			SUM,    ///< x+y
+			MEMORY, ///< [x+y], or [x] with y 0
+		} kind = PLAIN;
+		operand_t x, y; ///< Registers, literals or labels
+	};
+	/* b and a of each instruction in cur_prog */
+	std::deque<std::array<decoded_operand, 2>> decoded;
+
+	static decoded_operand decode(const operand_t &x);
+	void decode_from(size_t first);
+
+	void run_loaded(bool speedlimit);
+	bool fetch(size_t pc);
+	uint16_t find_label(symbol l);
+	uint16_t term(const operand_t &t);
+	uint16_t get_val(const decoded_operand &d);
+	void set_val(const decoded_operand &d, uint16_t val);
 	inline uint16_t get_reg(reg_t r)
 	{
 		return this->regs.at(static_cast<size_t>(r));
@@ -185,7 +273,7 @@ private:
 	uint16_t sbx_op(uint16_t b, uint16_t a);
 
 	void dat_func(operand_t x);
-	void out_func(operand_t x);
+	void out_func(const operand_t &x, const decoded_operand &d);
 };
 
 }
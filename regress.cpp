@@ -0,0 +1,417 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+#include "convert_machine.hpp"
+#include "output.hpp"
+#include "profile.hpp"
+#include "register_machine.hpp"
+#include "stack_machine.hpp"
+#include "util.hpp"
+
+log_level_t GLOBAL_LOG_LEVEL = LOG_NOTHING;
+
+/* The same programs as test_runner.py */
+static const std::vector<std::string> REGISTER_PROGS {"test1", "test2", "bsort"};
+static const std::vector<std::string> STACK_PROGS {"loop"};
+static const std::vector<std::string> CONVERSIONS {
+	"simple", "loop", "redundant", "dataflow", "arith", "bsort", "fib20", "primes", "tri100", "vecadd",
+};
+static const size_t MAX_OPTIMISE = 3;
+/* Small enough to force eviction and retranslation */
+static const size_t SMALL_CACHE = 256;
+
+enum class mode {
+	REGISTER,
+	STACK,
+	CONVERT,
+};
+
+/* One way of running one program */
+struct job {
+	std::string name;
+	mode m;
+	const dcpu16::program *reg;
+	const j5::program *stack;
+	size_t optimise;
+	size_t cache_budget;
+	std::string reference; ///< Job whose output this one has to match and runtime is measured against, if any
+};
+
+/* What a run measured, or what the baseline has for it */
+struct metrics {
+	uint64_t output_hash = 0;
+	uint64_t instructions = 0; ///< Run, the stack instructions they became for a conversion
+	uint64_t memops = 0; ///< LOADs and STOREs run, conversions only
+	uint64_t cost = 0; ///< Program cost, conversions only
+	double runtime = 0; ///< Fastest run, in seconds
+};
+
+struct outcome {
+	std::string output;
+	metrics got;
+	double reference_runtime = 0; ///< Its reference's runtime, timed in the same run
+	std::string error;
+};
+
+/**
+ * What counts as a regression against the baseline. Runtimes are only gated
+ * when asked for, and then against the job's reference timed in the same
+ * run, as the baseline's times are from whichever machine recorded it
+ */
+struct gates {
+	double cost = 0; ///< Allowed rise in cost and memory operations, as a fraction
+	double runtime = -1; ///< Allowed rise in runtime, as a fraction, negative for no runtime gate
+	double slack = 0.0005; ///< Runtime changes under this many seconds are noise
+
+	/**
+	 * @param expected The baseline's runtime scaled to this run, see expected_runtime.
+	 */
+	inline bool slower(const metrics &now, double expected) const
+	{
+		return this->runtime >= 0 && expected > 0 && now.runtime > expected * (1 + this->runtime) + this->slack;
+	}
+};
+
+static uint64_t fnv1a(const std::string &s)
+{
+	uint64_t h = 14695981039346656037ull;
+	for (unsigned char c : s) {
+		h ^= c;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+/**
+ * Runs a job once, on a machine of its own so jobs can run side by side.
+ * @return The program cost, for a conversion.
+ */
+static size_t run_once(const job &j, output &out, profile *prof)
+{
+	switch (j.m) {
+		case mode::REGISTER: {
+			auto mach = std::make_unique<dcpu16::machine>();
+			mach->output_to(out);
+			mach->attach(prof);
+			mach->run(*j.reg, false);
+			return 0;
+		}
+		case mode::STACK: {
+			auto mach = std::make_unique<j5::machine>();
+			mach->output_to(out);
+			mach->attach(prof);
+			mach->run(*j.stack, false);
+			return 0;
+		}
+		case mode::CONVERT: {
+			auto mach = std::make_unique<convertmachine>(j.cache_budget);
+			mach->output_to(out);
+			mach->attach(prof);
+			mach->run_reg(*j.reg, false, j.optimise, true);
+			return mach->cost();
+		}
+	}
+	return 0;
+}
+
+/* Runs a job profiled for its metrics, then unprofiled to time it */
+static outcome run_job(const job &j, size_t repeats)
+{
+	outcome o;
+	try {
+		memory_output out;
+		profile prof;
+		o.got.cost = run_once(j, out, &prof);
+		o.output = out.str();
+		o.got.output_hash = fnv1a(o.output);
+		o.got.instructions = prof.total();
+		if (j.m == mode::CONVERT) o.got.memops = prof.total(j5::op_t::LOAD) + prof.total(j5::op_t::STORE);
+
+		o.got.runtime = HUGE_VAL;
+		for (size_t r = 0; r < repeats; r++) {
+			memory_output discard;
+			auto start = std::chrono::steady_clock::now();
+			run_once(j, discard, nullptr);
+			std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+			o.got.runtime = std::min(o.got.runtime, took.count());
+		}
+	} catch (const char *e) {
+		o.error = e;
+	} catch (const std::string &e) {
+		o.error = e;
+	}
+	return o;
+}
+
+/* Runs every job, each thread taking the next one left until there are none */
+static std::vector<outcome> run_jobs(const std::vector<job> &jobs, size_t threads, size_t repeats)
+{
+	std::vector<outcome> outcomes(jobs.size());
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t < std::min(threads, jobs.size()); t++) {
+		workers.emplace_back([&jobs, &outcomes, &next, repeats] {
+			for (size_t k; (k = next++) < jobs.size();) outcomes[k] = run_job(jobs[k], repeats);
+		});
+	}
+	for (auto &w : workers) w.join();
+	return outcomes;
+}
+
+/* Index of a job's reference, jobs.size() if it has none */
+static size_t reference_of(const std::vector<job> &jobs, size_t k)
+{
+	const std::string &ref = jobs[k].reference;
+	if (ref.empty()) return jobs.size();
+	return std::find_if(jobs.begin(), jobs.end(), [&ref](const job &j){return j.name == ref;}) - jobs.begin();
+}
+
+/**
+ * What the baseline's runtime for a job comes to on this machine: scaled by
+ * how its reference's runtime compares with the baseline's. 0 if the job
+ * has no reference, or either is missing from the baseline.
+ */
+static double expected_runtime(const job &j, const outcome &o, const std::map<std::string, metrics> &baseline)
+{
+	auto base = baseline.find(j.name);
+	auto ref_base = baseline.find(j.reference);
+	if (j.reference.empty() || base == baseline.end() || ref_base == baseline.end()
+			|| ref_base->second.runtime <= 0) {
+		return 0;
+	}
+	return base->second.runtime * o.reference_runtime / ref_base->second.runtime;
+}
+
+/**
+ * Times again, on their own, jobs that look slower than the baseline, with
+ * their reference straight before so both run under the same conditions.
+ * The pair is kept if the job comes out faster against it. Other jobs
+ * running at the same time, or anything else on the machine, easily make a
+ * run of a few milliseconds look slow.
+ */
+static void retime_slow(const std::vector<job> &jobs, std::vector<outcome> &outcomes,
+		const std::map<std::string, metrics> &baseline, const gates &limits, size_t repeats)
+{
+	for (size_t k = 0; k < jobs.size(); k++) {
+		outcome &o = outcomes[k];
+		if (!o.error.empty() || !limits.slower(o.got, expected_runtime(jobs[k], o, baseline))) continue;
+		double ref_again = run_job(jobs[reference_of(jobs, k)], repeats * 2).got.runtime;
+		double again = run_job(jobs[k], repeats * 2).got.runtime;
+		if (again * o.reference_runtime < o.got.runtime * ref_again) {
+			o.got.runtime = again;
+			o.reference_runtime = ref_again;
+		}
+	}
+}
+
+/**
+ * Reads a baseline, one job per line:
+ *   name output_hash instructions memops cost runtime_us
+ * with '#' starting a comment line. A missing file is an empty baseline.
+ */
+static std::map<std::string, metrics> read_baseline(const std::string &path)
+{
+	std::map<std::string, metrics> baseline;
+	std::ifstream in(path);
+	std::string line;
+	for (size_t lineno = 1; std::getline(in, line); lineno++) {
+		if (line.empty() || line[0] == '#') continue;
+		std::istringstream ss(line);
+		std::string name;
+		metrics m;
+		double runtime_us;
+		if (!(ss >> name >> std::hex >> m.output_hash >> std::dec >> m.instructions >> m.memops >> m.cost >> runtime_us)) {
+			throw path + " line " + std::to_string(lineno) + ": expected name hash instructions memops cost runtime";
+		}
+		m.runtime = runtime_us / 1e6;
+		baseline[name] = m;
+	}
+	return baseline;
+}
+
+static void write_baseline(const std::string &path, const std::vector<job> &jobs, const std::vector<outcome> &outcomes)
+{
+	std::ofstream out(path);
+	if (!out) throw "Error opening " + path;
+	out << "# reg2stack_regress baseline: name output_hash instructions memops cost runtime_us\n";
+	for (size_t k = 0; k < jobs.size(); k++) {
+		const metrics &m = outcomes[k].got;
+		out << string_format("%s %016llx %llu %llu %llu %.1f\n", jobs[k].name.c_str(), (unsigned long long)m.output_hash,
+				(unsigned long long)m.instructions, (unsigned long long)m.memops, (unsigned long long)m.cost,
+				m.runtime * 1e6);
+	}
+}
+
+/* Relative change, blank if there's nothing to compare with */
+static std::string change(double before, double after)
+{
+	if (before == 0) return "";
+	return string_format("%+.1f%%", 100 * (after - before) / before);
+}
+
+/**
+ * Checks each job against its reference and the baseline, printing a line
+ * for each and why it failed.
+ * @return The number that failed.
+ */
+static size_t check(const std::vector<job> &jobs, const std::vector<outcome> &outcomes,
+		const std::map<std::string, metrics> &baseline, const gates &limits)
+{
+	std::map<std::string, const outcome *> by_name;
+	for (size_t k = 0; k < jobs.size(); k++) by_name[jobs[k].name] = &outcomes[k];
+
+	size_t failures = 0;
+	std::cout << string_format("%-22s %10s %10s %12s %10s  %-8s %-8s %s\n", "", "instrs", "mem ops", "cost",
+			"ms", "mem ops", "cost", "runtime");
+	for (size_t k = 0; k < jobs.size(); k++) {
+		const job &j = jobs[k];
+		const outcome &o = outcomes[k];
+		std::vector<std::string> problems;
+		if (!o.error.empty()) problems.push_back("threw: " + o.error);
+		if (!j.reference.empty() && o.output != by_name.at(j.reference)->output) {
+			problems.push_back("output differs from " + j.reference);
+		}
+
+		const metrics &m = o.got;
+		metrics was;
+		double expected = expected_runtime(j, o, baseline);
+		auto base = baseline.find(j.name);
+		if (base != baseline.end()) {
+			was = base->second;
+			if (m.output_hash != was.output_hash) problems.push_back("output differs from the baseline");
+			if (m.memops > was.memops * (1 + limits.cost)) problems.push_back("more memory operations");
+			if (m.cost > was.cost * (1 + limits.cost)) problems.push_back("costs more");
+			if (limits.slower(m, expected)) problems.push_back("slower than " + j.reference + " allows");
+		}
+		std::string row = string_format("%-22s %10llu %10llu %12llu %10.3f  %-8s %-8s %-8s", j.name.c_str(),
+				(unsigned long long)m.instructions, (unsigned long long)m.memops, (unsigned long long)m.cost,
+				m.runtime * 1e3, change(was.memops, m.memops).c_str(), change(was.cost, m.cost).c_str(),
+				change(expected, m.runtime).c_str());
+		if (!problems.empty()) {
+			failures++;
+			row += "  FAIL";
+			for (const auto &p : problems) row += ", " + p;
+		}
+		row.erase(row.find_last_not_of(' ') + 1);
+		std::cout << row << '\n';
+	}
+	return failures;
+}
+
+void print_usage(const char *arg0)
+{
+	std::cerr << "Usage: " << arg0 << " [-w] [-b baseline] [-d dir] [-j threads] [-n runs] [-c percent] [-t percent]\n"
+		"Runs the example programs in every mode and at every optimisation level, side by side,\n"
+		"and checks their output and performance against a baseline\n"
+		"-w          -  Write the results as the new baseline, if every output is right\n"
+		"-b baseline -  Baseline file (default regress.baseline)\n"
+		"-d dir      -  Where the examples are (default examples)\n"
+		"-j threads  -  Jobs to run at once (default one per core)\n"
+		"-n runs     -  Times to run each job, keeping the fastest (default 5)\n"
+		"-c percent  -  Allowed rise in cost and memory operations (default 0)\n"
+		"-t percent  -  Allowed rise in runtime, relative to the register machine running the same\n"
+		"               program in the same run (default no runtime gate)\n";
+}
+
+int main(int argc, char **argv)
+{
+	std::string baseline_path = "regress.baseline";
+	std::string dir = "examples";
+	bool write = false;
+	size_t threads = std::max(1u, std::thread::hardware_concurrency());
+	size_t repeats = 5;
+	gates limits;
+	int c = 0;
+	while ((c = getopt(argc, argv, "hwb:d:j:n:c:t:")) != -1) {
+		switch (c) {
+			case 'w':
+				write = true;
+				break;
+			case 'b':
+				baseline_path = optarg;
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			case 'j':
+				threads = std::max(1, atoi(optarg));
+				break;
+			case 'n':
+				repeats = std::max(1, atoi(optarg));
+				break;
+			case 'c':
+				limits.cost = atof(optarg) / 100;
+				break;
+			case 't':
+				limits.runtime = atof(optarg) / 100;
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	try {
+		/* Each program is read once, and shared by all its jobs */
+		std::map<std::string, dcpu16::program> reg_progs;
+		std::map<std::string, j5::program> stack_progs;
+		for (const auto &names : {REGISTER_PROGS, CONVERSIONS}) {
+			for (const auto &name : names) {
+				if (reg_progs.count(name) == 0) {
+					reg_progs[name] = dcpu16::tokenise_source(mapped_file(dir + "/" + name + ".reg").text());
+				}
+			}
+		}
+		for (const auto &name : STACK_PROGS) {
+			stack_progs[name] = j5::tokenise_source(mapped_file(dir + "/" + name + ".stack").text());
+		}
+
+		std::vector<job> jobs;
+		for (const auto &p : reg_progs) {
+			jobs.push_back({p.first + "/r", mode::REGISTER, &p.second, nullptr, 0, 0, ""});
+		}
+		for (const auto &p : stack_progs) {
+			jobs.push_back({p.first + "/s", mode::STACK, nullptr, &p.second, 0, 0, p.first + "/r"});
+		}
+		for (const auto &name : CONVERSIONS) {
+			const dcpu16::program *prog = &reg_progs.at(name);
+			for (size_t optimise = 0; optimise <= MAX_OPTIMISE; optimise++) {
+				jobs.push_back({name + "/c/o" + std::to_string(optimise), mode::CONVERT, prog, nullptr, optimise, 0,
+					name + "/r"});
+			}
+			jobs.push_back({name + "/c/o2/m" + std::to_string(SMALL_CACHE), mode::CONVERT, prog, nullptr, 2, SMALL_CACHE,
+				name + "/r"});
+		}
+
+		auto outcomes = run_jobs(jobs, threads, repeats);
+		for (size_t k = 0; k < jobs.size(); k++) {
+			size_t ref = reference_of(jobs, k);
+			if (ref < jobs.size()) outcomes[k].reference_runtime = outcomes[ref].got.runtime;
+		}
+		auto baseline = write ? std::map<std::string, metrics>() : read_baseline(baseline_path);
+		if (!write && baseline.empty()) std::cout << "No baseline in " << baseline_path << ", only checking outputs\n";
+		retime_slow(jobs, outcomes, baseline, limits, repeats);
+		size_t failures = check(jobs, outcomes, baseline, limits);
+		std::cout << jobs.size() - failures << '/' << jobs.size() << " passed\n";
+		if (failures > 0) return 1;
+		if (write) write_baseline(baseline_path, jobs, outcomes);
+	} catch (const char *e) {
+		std::cerr << e << '\n';
+		return 1;
+	} catch (const std::string &e) {
+		std::cerr << e << '\n';
+		return 1;
+	}
+}
@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "sampler.hpp"
+
+/* static */ volatile sig_atomic_t sampler::due = 0;
+
+static void on_timer(int)
+{
+	sampler::due = 1;
+}
+
+sampler::~sampler()
+{
+	this->stop();
+}
+
+/**
+ * Starts the timer. It runs on the monotonic clock rather than CPU time, as
+ * CPU timers only go off on the scheduler tick, which is too coarse for
+ * programs that run for milliseconds. Run with -f so the samples aren't
+ * mostly the speed limit's sleeping.
+ */
+void sampler::start()
+{
+	if (this->started) return;
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_timer;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, nullptr);
+
+	sigevent event;
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_SIGNAL;
+	event.sigev_signo = SIGPROF;
+	if (timer_create(CLOCK_MONOTONIC, &event, &this->timer) != 0) {
+		throw std::string("Error starting the sampling timer: ") + strerror(errno);
+	}
+	itimerspec every;
+	every.it_interval.tv_sec = this->period_us / 1000000;
+	every.it_interval.tv_nsec = (this->period_us % 1000000) * 1000;
+	every.it_value = every.it_interval;
+	timer_settime(this->timer, 0, &every, nullptr);
+	due = 0;
+	this->started = true;
+}
+
+void sampler::stop()
+{
+	if (!this->started) return;
+	timer_delete(this->timer);
+	signal(SIGPROF, SIG_DFL);
+	due = 0;
+	this->started = false;
+}
+
+void sampler::take(const std::vector<std::string> &frames)
+{
+	due = 0;
+	std::string stack;
+	for (const auto &f : frames) {
+		if (!stack.empty()) stack += ';';
+		/* ; separates frames and the count comes after the last space,
+		 * so a frame may have spaces but not ; or a line break */
+		size_t begin = stack.size();
+		stack += f;
+		std::replace(stack.begin() + begin, stack.end(), ';', ',');
+		std::replace(stack.begin() + begin, stack.end(), '\n', ' ');
+	}
+	this->stacks[stack]++;
+}
+
+/* Writes the folded stacks, most sampled first */
+void sampler::write(std::ostream &os) const
+{
+	std::vector<std::pair<std::string, uint64_t>> sorted(this->stacks.begin(), this->stacks.end());
+	std::stable_sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+	for (const auto &s : sorted) os << s.first << ' ' << s.second << '\n';
+}
@@ -0,0 +1,69 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Sampling profiler of the guest program. While started, a timer goes off
+ * every period of wall time, and the machine it's attached to records where
+ * the guest is at its next instruction, as a stack of frames outermost
+ * first. The samples are written as folded stacks, one "frame;frame count"
+ * line per distinct stack, which flamegraph.pl and the like take as is.
+ */
+class sampler {
+public:
+	explicit sampler(unsigned period_us = 100) : period_us(period_us) {}
+	~sampler();
+	sampler(const sampler&) = delete;
+	sampler &operator=(const sampler&) = delete;
+
+	/* Set by the timer when a sample is due, cleared by taking one */
+	static volatile sig_atomic_t due;
+
+	void start();
+	void stop();
+	void take(const std::vector<std::string> &frames);
+	void write(std::ostream &os) const;
+
+	template<typename T>
+	static std::string text(const T &x)
+	{
+		std::ostringstream ss;
+		ss << x;
+		return ss.str();
+	}
+	/* Frame for an instruction, with the source line it's from */
+	template<typename Instruction>
+	static std::string frame(const Instruction &ins)
+	{
+		if (ins.line == 0) return text(ins);
+		return std::to_string(ins.line) + ": " + text(ins);
+	}
+	/**
+	 * Frame for the code an instruction is in, which is the last label at
+	 * or before it. Until there are calls, that's the nearest thing to a
+	 * function.
+	 */
+	template<typename Program>
+	static std::string enclosing(const Program &prog, size_t pc)
+	{
+		for (size_t k = pc + 1; k-- > 0;) {
+			if (!prog[k].label.empty()) return prog[k].label.str();
+		}
+		return "(start)";
+	}
+private:
+	unsigned period_us;
+	timer_t timer;
+	bool started = false;
+	std::unordered_map<std::string, uint64_t> stacks;
+};
+
+#endif /* SAMPLER_HPP */
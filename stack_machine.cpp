@@ -1,9 +1,14 @@
+#include <algorithm>
 #include <boost/optional.hpp>
 #include <chrono>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <thread>
 
+#include "perf_counters.hpp"
+#include "profile.hpp"
+#include "sampler.hpp"
 #include "stack_machine.hpp"
 #include "register_convert.hpp"
 #include "util.hpp"
@@ -18,26 +23,26 @@ std::ostream& operator<<(std::ostream& os, const instruction& ins)
 	return os;
 }
 
-operand_t get_operand(const std::string &tok)
+operand_t get_operand(boost::string_view tok)
 {
-	operand_t ret = boost::blank();
-	if (tok.size() > 1 && tolower(tok.back()) == 'h'
-			&& is_hex(tok.substr(0, tok.size() - 1))) {
-		// hex literal
-		ret = static_cast<uint16_t>(std::stoul(tok.substr(0, tok.size() - 1), nullptr, 16));
-	} else if (std::all_of(tok.begin(), tok.end(), ::isdigit)) {
-		// decimal literal
-		ret = static_cast<uint16_t>(std::stoul(tok));
-	} else {
-		// assume label
-		ret = tok;
+	uint16_t value;
+	if (tok.size() > 1 && tolower(tok.back()) == 'h' && parse_number(tok.substr(0, tok.size() - 1), 16, value)) {
+		return value; // hex literal
+	} else if (parse_number(tok, 10, value)) {
+		return value; // decimal literal
 	}
-	return ret;
+	// assume label
+	return symbol(tok);
 }
 
-boost::optional<instruction> tokenise_line(const std::string &line)
+/**
+ * Tokenises a line of source.
+ * @param words Somewhere to split it into, kept between lines.
+ * @return The instruction, if there is one on the line.
+ */
+boost::optional<instruction> tokenise_line(boost::string_view line, std::vector<boost::string_view> &words)
 {
-	auto words = split_words(line);
+	split_words(line, words);
 	if (words.empty()) return boost::none;
 
 	instruction ins;
@@ -45,12 +50,13 @@ boost::optional<instruction> tokenise_line(const std::string &line)
 	if (it->back() == ':') { // LABEL:
 		ins.label = it->substr(0, it->size() - 1);
 		++it;
+		if (it == words.end()) throw "No instruction after label " + ins.label.str();
 	}
 
 	// Get operation
 	auto opit = std::find(OP_T_STR.begin(), OP_T_STR.end(), *it);
 	if (opit == OP_T_STR.end()) {
-		throw "Unknown op code: " + *it;
+		throw "Unknown op code: " + it->to_string();
 	}
 	ins.code = static_cast<op_t>(std::distance(OP_T_STR.begin(), opit));
 	it++;
@@ -66,32 +72,76 @@ boost::optional<instruction> tokenise_line(const std::string &line)
 	return ins;
 }
 
-program tokenise_source(const std::string &source)
+/* Tokenises a run of whole lines on the calling thread, the first being line number first_line */
+static program tokenise_lines(boost::string_view source, uint32_t first_line)
 {
-	std::stringstream iss(source);
-
 	program prog;
-	std::string line;
-
-	std::string::size_type pos = 0;
-	std::string::size_type prev = 0;
-	while ((pos = source.find('\n', prev)) != std::string::npos)
-	{
-		std::string line = source.substr(prev, pos - prev);
-		boost::optional<instruction> ins = tokenise_line(line);
-		if (ins) prog.push_back(*ins);
-		prev = pos + 1;
-	}
+	prog.reserve(std::count(source.begin(), source.end(), '\n') + 1);
+	std::vector<boost::string_view> words;
+	uint32_t lineno = first_line;
+	for_each_line(source, [&prog, &words, &lineno](boost::string_view line) {
+		boost::optional<instruction> ins = tokenise_line(line, words);
+		if (ins) {
+			ins->line = lineno;
+			prog.push_back(std::move(*ins));
+		}
+		lineno++;
+	});
 	return prog;
 }
 
-uint16_t machine::find_label(const std::string &l)
+/**
+ * Tokenises a whole source, large ones split across threads.
+ * @param source Source text.
+ * @param threads Number of threads to use at most, 0 for one per core.
+ * @return The program.
+ */
+program tokenise_source(boost::string_view source, size_t threads)
+{
+	return tokenise_chunks<program>(source, threads, tokenise_lines);
+}
+
+/**
+ * Tokenises a program a line at a time as it's read, for a machine to start
+ * on before the end of it has been written.
+ */
+program_reader read_program(std::istream &in)
+{
+	auto line = std::make_shared<std::string>();
+	auto words = std::make_shared<std::vector<boost::string_view>>();
+	auto lineno = std::make_shared<uint32_t>(0);
+	return [&in, line, words, lineno](program &prog) {
+		while (std::getline(in, *line)) {
+			++*lineno;
+			boost::optional<instruction> ins = tokenise_line(*line, *words);
+			if (ins) {
+				ins->line = *lineno;
+				prog.push_back(std::move(*ins));
+				return true;
+			}
+		}
+		return false;
+	};
+}
+
+/* Whether there is an instruction pc, reading up to it if the program is still coming */
+bool machine::fetch(size_t pc)
 {
-	auto pos = std::find_if(this->cur_prog.begin(), this->cur_prog.end(), [l](const instruction &i) { return i.label == l; });
-	if (pos == this->cur_prog.end()) {
-		throw "Undefined label '" + l + "' used";
+	while (pc >= this->cur_prog.size() && this->reader) {
+		if (!this->reader(this->cur_prog)) this->reader = nullptr;
+	}
+	return pc < this->cur_prog.size();
+}
+
+/* Labels further on than has been read yet are read up to when first used */
+uint16_t machine::find_label(symbol l)
+{
+	for (size_t searched = 0;;) {
+		auto pos = std::find_if(this->cur_prog.begin() + searched, this->cur_prog.end(), [l](const instruction &i) { return i.label == l; });
+		if (pos != this->cur_prog.end()) return std::distance(this->cur_prog.begin(), pos);
+		searched = this->cur_prog.size();
+		if (!this->fetch(searched)) throw "Undefined label '" + l.str() + "' used";
 	}
-	return std::distance(this->cur_prog.begin(), pos);
 }
 
 uint16_t machine::run_branch_instruction(const instruction &ins)
@@ -113,7 +163,7 @@ uint16_t machine::run_branch_instruction(const instruction &ins)
 			if (ins.op.which() == 1) {
 				return this->pc + boost::get<uint16_t>(ins.op); // relative if number
 			} else {
-				return this->find_label(boost::get<std::string>(ins.op));
+				return this->find_label(boost::get<symbol>(ins.op));
 			}
 		default:
 			throw "Not reached";
@@ -147,20 +197,54 @@ uint16_t machine::run_instruction(const instruction &ins)
 void machine::run(const program &prog, bool speedlimit)
 {
 	this->cur_prog = prog;
-	this->terminate = false;
+	this->reader = nullptr;
+	this->run_loaded(speedlimit);
+}
 
-	while (!this->terminate && this->pc < this->cur_prog.size()) {
+/* Runs a program that is still being read, reading it as it goes */
+void machine::run(const program_reader &reader, bool speedlimit)
+{
+	this->cur_prog.clear();
+	this->reader = reader;
+	this->run_loaded(speedlimit);
+}
+
+void machine::run_loaded(bool speedlimit)
+{
+	this->terminate = false;
+	this->pc = 0;
+	this->stack = {};
+	this->flags = 0;
+	this->mem.fill(0);
+
+	uint64_t executed = 0;
+	if (this->counters != nullptr) this->counters->switch_to(perf_counters::RUN);
+	while (!this->terminate && this->fetch(this->pc)) {
 		auto start = std::chrono::high_resolution_clock::now();
 
 		const auto &ins = this->cur_prog[pc];
 		log<LOG_DEBUG>(ins);
+		if (this->samp != nullptr && sampler::due) {
+			this->samp->take({sampler::enclosing(this->cur_prog, this->pc), sampler::frame(ins)});
+		}
+		if (this->prof != nullptr) {
+			if (this->pc == 0 || !ins.label.empty()) this->prof->enter(this->pc);
+			profile::counts &c = this->prof->ran(this->pc);
+			if (ins.code == op_t::BRZERO) profile::branch(c, HasBit(this->flags, static_cast<uint8_t>(flagbit::ZERO)));
+		}
 		this->pc = this->run_instruction(ins);
+		executed++;
 
 		log<LOG_DEBUG2>(this->register_dump());
 		if (speedlimit) {
 			std::this_thread::sleep_until(start + std::chrono::milliseconds(100)); // arbitrary
 		}
 	}
+	if (this->counters != nullptr) {
+		this->counters->switch_to(perf_counters::IDLE);
+		this->counters->executed(executed);
+	}
+	this->out->flush();
 }
 
 std::string machine::register_dump()
@@ -178,16 +262,45 @@ std::string machine::register_dump()
 
 
 /* static */ const machine::op_map machine::OPERATIONS {{
-	{op_t::ADD, [](machine *m){m->binop_func(std::plus<>());}},
-	{op_t::SUB, [](machine *m){m->binop_func(std::minus<>());}},
-	{op_t::INC, [](machine *m){m->stack.top()++;}},
-	{op_t::DEC, [](machine *m){m->stack.top()--;}},
+	{op_t::ADD, [](machine *m){m->addc_func(false);}},
+	{op_t::SUB, [](machine *m){m->subc_func(false);}},
+	{op_t::INC, [](machine *m){m->stack.push(1); m->addc_func(false);}},
+	{op_t::DEC, [](machine *m){m->stack.push(1); m->subc_func(false);}},
 	{op_t::AND, [](machine *m){m->binop_func(std::bit_and<>());}},
 	{op_t::OR,  [](machine *m){m->binop_func(std::bit_or<>());}},
 	{op_t::NOT, [](machine *m){m->stack.top() = ~m->stack.top();}},
 	{op_t::XOR, [](machine *m){m->binop_func(std::bit_xor<>());}},
-	{op_t::SHR, [](machine *m){m->binop_func([](uint16_t a, uint16_t b){return a >> b;});}},
-	{op_t::SHL, [](machine *m){m->binop_func([](uint16_t a, uint16_t b){return a << b;});}},
+	// Shifts by 16 or more shift every bit out, leaving 0 or the sign
+	{op_t::SHR, [](machine *m){m->binop_func([](uint16_t a, uint16_t b){return b >= 16 ? 0 : a >> b;});}},
+	{op_t::SHL, [](machine *m){m->binop_func([](uint16_t a, uint16_t b){return b >= 16 ? 0 : a << b;});}},
+	// Extensions to the J5 instruction set, mainly to support DCPU-16 conversion
+	{op_t::ASR,  [](machine *m){m->binop_func([](uint16_t a, uint16_t b){
+		return static_cast<int16_t>(a) >> std::min<uint16_t>(b, 15);
+	});}},
+	{op_t::ADC,  [](machine *m){m->addc_func(true);}},
+	{op_t::SBC,  [](machine *m){m->subc_func(true);}},
+	{op_t::MUL,  [](machine *m){m->wideop_func([](uint16_t a, uint16_t b){
+		uint32_t v = static_cast<uint32_t>(a) * b;
+		return std::make_pair<uint16_t, uint16_t>(v, v >> 16);
+	});}},
+	{op_t::MULS, [](machine *m){m->wideop_func([](uint16_t a, uint16_t b){
+		int32_t v = static_cast<int16_t>(a) * static_cast<int16_t>(b);
+		return std::make_pair<uint16_t, uint16_t>(v, static_cast<uint32_t>(v) >> 16);
+	});}},
+	{op_t::DIV,  [](machine *m){m->wideop_func([](uint16_t a, uint16_t b){
+		if (b == 0) return std::make_pair<uint16_t, uint16_t>(0, 0);
+		return std::make_pair<uint16_t, uint16_t>(a / b, (static_cast<uint32_t>(a) << 16) / b);
+	});}},
+	{op_t::DIVS, [](machine *m){m->wideop_func([](uint16_t a, uint16_t b){
+		if (b == 0) return std::make_pair<uint16_t, uint16_t>(0, 0);
+		int64_t sa = static_cast<int16_t>(a); // -0x8000 << 16 / -1 overflows 32 bits
+		int64_t sb = static_cast<int16_t>(b);
+		return std::make_pair<uint16_t, uint16_t>(sa / sb, (sa * 0x10000) / sb);
+	});}},
+	{op_t::MOD,  [](machine *m){m->binop_func([](uint16_t a, uint16_t b){return b == 0 ? 0 : a % b;});}},
+	{op_t::MODS, [](machine *m){m->binop_func([](uint16_t a, uint16_t b){
+		return b == 0 ? 0 : static_cast<int16_t>(a) % static_cast<int16_t>(b);
+	});}},
 
 	{op_t::TGT, [](machine *m){m->comp_func(std::greater<>());}},
 	{op_t::TLT, [](machine *m){m->comp_func(std::less<>());}},
@@ -202,7 +315,7 @@ std::string machine::register_dump()
 //	{op_t::CALL,    [](machine *m){m->terminate = true;}},
 //	{op_t::RETURN,  [](machine *m){m->terminate = true;}},
 	{op_t::STOP,    [](machine *m){m->terminate = true;}},
-	{op_t::OUT,     [](machine *m){std::cout << m->stack.top() << '\n';}},
+	{op_t::OUT,     [](machine *m){m->out->value(m->stack.top());}},
 
 	{op_t::DROP,  [](machine* m){m->stack.pop();}},
 	{op_t::DUP,   [](machine* m){m->stack.push(m->stack.top());}},
@@ -227,6 +340,15 @@ std::string machine::register_dump()
 	{op_t::XOR, -1},
 	{op_t::SHR, -1},
 	{op_t::SHL, -1},
+	{op_t::ASR,  -1},
+	{op_t::ADC,  -1},
+	{op_t::SBC,  -1},
+	{op_t::MUL,   0},
+	{op_t::MULS,  0},
+	{op_t::DIV,   0},
+	{op_t::DIVS,  0},
+	{op_t::MOD,  -1},
+	{op_t::MODS, -1},
 
 	{op_t::TGT, 0},
 	{op_t::TLT, 0},
@@ -254,6 +376,55 @@ std::string machine::register_dump()
 	{op_t::TUCK3, 1},
 	{op_t::COPY3, 1},
 	// PUSH,POP special
+
+	{op_t::LABEL, 0},
+}};
+
+/* Number of values each op needs on the stack */
+/* static */ const std::map<op_t, int> machine::STACK_POP {{
+	{op_t::ADD,  2},
+	{op_t::SUB,  2},
+	{op_t::INC,  1},
+	{op_t::DEC,  1},
+	{op_t::AND,  2},
+	{op_t::OR,   2},
+	{op_t::NOT,  1},
+	{op_t::XOR,  2},
+	{op_t::SHR,  2},
+	{op_t::SHL,  2},
+	{op_t::ASR,  2},
+	{op_t::ADC,  2},
+	{op_t::SBC,  2},
+	{op_t::MUL,  2},
+	{op_t::MULS, 2},
+	{op_t::DIV,  2},
+	{op_t::DIVS, 2},
+	{op_t::MOD,  2},
+	{op_t::MODS, 2},
+
+	{op_t::TGT, 2},
+	{op_t::TLT, 2},
+	{op_t::TEQ, 2},
+	{op_t::TSZ, 1},
+
+	{op_t::SET,    0},
+	{op_t::LOAD,   1},
+	{op_t::STORE,  2},
+	{op_t::BRANCH, 0},
+	{op_t::BRZERO, 0},
+	{op_t::STOP,   0},
+	{op_t::OUT,    1},
+
+	{op_t::DROP,  1},
+	{op_t::DUP,   1},
+	{op_t::SWAP,  2},
+	{op_t::RSD3,  3},
+	{op_t::RSU3,  3},
+	{op_t::TUCK2, 2},
+	{op_t::TUCK3, 3},
+	{op_t::COPY3, 3},
+
+	{op_t::LABEL, 0},
 }};
 
 void machine::set_func(uint16_t v)
@@ -296,6 +467,52 @@ void machine::binop_func(std::function<uint16_t(uint16_t, uint16_t)> op)
 	this->stack.push(op(b, a));
 }
 
+/* Like binop_func, but leaves two results, second (overflow) on top */
+void machine::wideop_func(std::function<std::pair<uint16_t, uint16_t>(uint16_t, uint16_t)> op)
+{
+	uint16_t a = this->stack.top();
+	this->stack.pop();
+	uint16_t b = this->stack.top();
+	this->stack.pop();
+	auto res = op(b, a);
+	this->stack.push(res.first);
+	this->stack.push(res.second);
+}
+
+/* next + top (+ carry), sets carry flag on overflow */
+void machine::addc_func(bool with_carry)
+{
+	uint16_t a = this->stack.top();
+	this->stack.pop();
+	uint16_t b = this->stack.top();
+	this->stack.pop();
+	uint32_t v = b + a;
+	if (with_carry && HasBit(this->flags, static_cast<uint8_t>(machine::flagbit::CARRY))) v++;
+	this->stack.push(v);
+	if (v > 0xffff) {
+		SetBit(this->flags, static_cast<uint8_t>(machine::flagbit::CARRY));
+	} else {
+		ClrBit(this->flags, static_cast<uint8_t>(machine::flagbit::CARRY));
+	}
+}
+
+/* next - top (- carry), sets carry flag on borrow */
+void machine::subc_func(bool with_carry)
+{
+	uint16_t a = this->stack.top();
+	this->stack.pop();
+	uint16_t b = this->stack.top();
+	this->stack.pop();
+	uint32_t sub = a;
+	if (with_carry && HasBit(this->flags, static_cast<uint8_t>(machine::flagbit::CARRY))) sub++;
+	this->stack.push(b - sub);
+	if (sub > b) {
+		SetBit(this->flags, static_cast<uint8_t>(machine::flagbit::CARRY));
+	} else {
+		ClrBit(this->flags, static_cast<uint8_t>(machine::flagbit::CARRY));
+	}
+}
+
 void machine::comp_func(std::function<bool(uint16_t, uint16_t)> op)
 {
 	uint16_t top = this->stack.top();
@@ -2,11 +2,23 @@
 #define STACK_MACHINE_HPP
 
 #include <array>
+#include <boost/utility/string_view.hpp>
 #include <boost/variant.hpp>
+#include <functional>
+#include <iostream>
+#include <istream>
 #include <map>
 #include <stack>
+#include <string>
 #include <vector>
 
+#include "output.hpp"
+#include "symbol.hpp"
+
+class perf_counters;
+class profile;
+class sampler;
+
 namespace j5 {
 
 enum class op_t {
@@ -20,6 +32,15 @@ enum class op_t {
 	XOR,
 	SHR,
 	SHL,
+	ASR,
+	ADC,
+	SBC,
+	MUL,
+	MULS,
+	DIV,
+	DIVS,
+	MOD,
+	MODS,
 
 	TGT,
 	TLT,
@@ -49,6 +70,8 @@ enum class op_t {
 	PUSH,
 	POP,
 
+	LABEL, ///< Not a real instruction, marks a local label in generated code until the layout pass
+
 	NUM_OPS,
 };
 
@@ -63,6 +86,15 @@ static const std::array<std::string, (size_t)op_t::NUM_OPS> OP_T_STR{{
 	"XOR",
 	"SHR",
 	"SHL",
+	"ASR",
+	"ADC",
+	"SBC",
+	"MUL",
+	"MULS",
+	"DIV",
+	"DIVS",
+	"MOD",
+	"MODS",
 
 	"TGT",
 	"TLT",
@@ -91,33 +123,87 @@ static const std::array<std::string, (size_t)op_t::NUM_OPS> OP_T_STR{{
 	"COPY3",
 	"PUSH",
 	"POP",
+
+	"LABEL",
 }};
 
-using operand_t = boost::variant<boost::blank, uint16_t, std::string>;
+using operand_t = boost::variant<boost::blank, uint16_t, symbol>;
 
 struct instruction {
-	std::string label;
+	symbol label;
 	op_t code;
 	operand_t op;
+	uint32_t line = 0; ///< In the source, 0 if it didn't come from one
+	int32_t reg_pc = -1; ///< Register instruction it was converted from, -1 if it wasn't
 };
 
 std::ostream& operator<<(std::ostream& os, const instruction& ins);
 
-inline instruction make_instruction(op_t code, operand_t op = boost::blank(), std::string label = "")
+/* Code standing in for another instruction came from wherever that did, unless it's already known */
+inline void inherit_origin(instruction &ins, const instruction &from)
+{
+	if (ins.reg_pc != -1) return;
+	ins.reg_pc = from.reg_pc;
+	ins.line = from.line;
+}
+
+inline instruction make_instruction(op_t code, operand_t op = boost::blank(), symbol label = symbol())
 {
 	return {label, code, op};
 }
 
 using program = std::vector<instruction>;
 
-program tokenise_source(const std::string &source);
+/* Local labels are for branches within generated code, and can't clash
+ * with register program labels */
+inline bool is_local_label(symbol label)
+{
+	return !label.empty() && label.str().front() == '.';
+}
+
+operand_t get_operand(boost::string_view tok);
+program tokenise_source(boost::string_view source, size_t threads = 0);
+
+/**
+ * Appends the next instruction of a program that is still being read,
+ * returning false once there are no more.
+ */
+using program_reader = std::function<bool(program &prog)>;
+program_reader read_program(std::istream &in);
 
 class machine {
 public:
 	void run(const program &prog, bool speedlimit);
+	void run(const program_reader &reader, bool speedlimit);
 	std::string register_dump();
+	/* Counts what runs from now on into prof, null to stop */
+	inline void attach(profile *prof)
+	{
+		this->prof = prof;
+	}
+	/* Counts the interpreter's own performance while it runs into counters, null to stop */
+	inline void attach(perf_counters *counters)
+	{
+		this->counters = counters;
+	}
+	/* Where OUT writes to, std::cout unless changed */
+	inline void output_to(output &out)
+	{
+		this->out = &out;
+	}
+	/* Samples where the guest is into samp whenever it's due, null to stop */
+	inline void attach(sampler *samp)
+	{
+		this->samp = samp;
+	}
+	/* The program as far as it's been read */
+	inline const program &loaded() const
+	{
+		return this->cur_prog;
+	}
 
 	static const std::map<op_t, int> STACK_DIFF;
+	static const std::map<op_t, int> STACK_POP;
 protected:
 	uint16_t pc;
 	std::stack<uint16_t> stack;
@@ -137,11 +223,18 @@ protected:
 
 	bool terminate;
 	program cur_prog;
+	program_reader reader; ///< Rest of the program, if it's still being read
+	profile *prof = nullptr;
+	perf_counters *counters = nullptr;
+	sampler *samp = nullptr;
+	output *out = &cout_output();
 
+	void run_loaded(bool speedlimit);
+	bool fetch(size_t pc);
 	uint16_t run_instruction(const instruction &ins);
 	uint16_t run_branch_instruction(const instruction &ins);
 
-	virtual uint16_t find_label(const std::string &l);
+	virtual uint16_t find_label(symbol l);
 
 	using opfunc_t = std::function<void(machine*)>;
 	using op_map = std::map<op_t, opfunc_t>;
@@ -149,6 +242,9 @@ protected:
 	static const op_map OPERATIONS;
 
 	void binop_func(std::function<uint16_t(uint16_t, uint16_t)> op);
+	void wideop_func(std::function<std::pair<uint16_t, uint16_t>(uint16_t, uint16_t)> op);
+	void addc_func(bool with_carry);
+	void subc_func(bool with_carry);
 	void comp_func(std::function<bool(uint16_t, uint16_t)> op);
 	void testzero_func();
 
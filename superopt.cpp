@@ -0,0 +1,496 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <unistd.h>
+
+#include "convert_machine.hpp"
+#include "optimise.hpp"
+#include "util.hpp"
+
+log_level_t GLOBAL_LOG_LEVEL = LOG_NOTHING;
+
+/* Optimisation level the windows are taken from */
+static const size_t OPTIMISE = 2;
+
+/* Longest window to find a replacement for. Replacements are shorter, so
+ * this many stack ops to the power of one less are tried for each */
+static const size_t MAX_WINDOW = 5;
+
+/* Blocks each program may run for while counting */
+static const size_t MAX_BLOCKS = 10000000;
+
+/* Stack permutations, tried in every replacement */
+static const std::vector<j5::op_t> STACK_OPS {
+	j5::op_t::DUP, j5::op_t::DROP, j5::op_t::SWAP, j5::op_t::RSU3,
+	j5::op_t::RSD3, j5::op_t::TUCK2, j5::op_t::TUCK3, j5::op_t::COPY3,
+};
+
+/* Instruction in a window. SET operands are numbered in order of
+ * appearance, as the rule for it will use a variable for each */
+struct sym_op {
+	j5::op_t code;
+	int var; ///< SET operand, -1 for others
+
+	bool operator==(const sym_op &other) const
+	{
+		return this->code == other.code && this->var == other.var;
+	}
+};
+
+using window = std::vector<sym_op>;
+
+/* Same costs as convertmachine */
+static size_t op_cost(j5::op_t code)
+{
+	return cost_table().cost(code);
+}
+
+static size_t cost(const window &w)
+{
+	size_t c = 0;
+	for (const auto &op : w) c += op_cost(op.code);
+	return c;
+}
+
+/* Rule file form of a sequence */
+static std::string window_source(const window &w)
+{
+	std::string s;
+	for (const auto &op : w) {
+		if (!s.empty()) s += ", ";
+		s += j5::OP_T_STR.at((size_t)op.code);
+		if (op.var >= 0) s += std::string(" $") + static_cast<char>('a' + op.var);
+	}
+	return s;
+}
+
+/**
+ * Numbers terms, so the same term always gets the same number. A term is
+ * its kind followed by whatever it is made from.
+ */
+class terms {
+public:
+	enum kind : int {
+		INPUT,   ///< Value on the stack at the start
+		OPERAND, ///< SET operand
+		RESULT,  ///< Result of an op
+		HIGH,    ///< Second (overflow) result of a wide op
+		CARRY,   ///< Carry flag after an op
+		ZERO,    ///< Zero flag after a test
+		MEMORY,  ///< Memory read, after some number of writes
+	};
+
+	int get(std::vector<int> key)
+	{
+		return this->ids.emplace(std::move(key), this->ids.size()).first->second;
+	}
+
+private:
+	std::map<std::vector<int>, int> ids;
+};
+
+/**
+ * Symbolic J5 state. Two sequences run from the same state are equivalent
+ * if they leave the same terms on the stack and in the flags, and make the
+ * same memory writes and output in the same order. As terms are never
+ * simplified (other than ordering the operands of commutative ops) this
+ * holds whatever the inputs and SET operands are.
+ */
+struct sym_state {
+	std::vector<int> stack; ///< Top is last
+	int carry;
+	int zero;
+	int version; ///< Memory writes so far, a read depends on all the writes before it
+	std::vector<std::pair<int, int>> stores; ///< (address, value)
+	std::vector<int> outputs;
+
+	bool operator==(const sym_state &other) const
+	{
+		return this->stack == other.stack && this->carry == other.carry && this->zero == other.zero
+			&& this->stores == other.stores && this->outputs == other.outputs;
+	}
+};
+
+static bool commutative(j5::op_t code)
+{
+	switch (code) {
+		case j5::op_t::ADD:
+		case j5::op_t::AND:
+		case j5::op_t::OR:
+		case j5::op_t::XOR:
+		case j5::op_t::MUL:
+		case j5::op_t::MULS:
+		case j5::op_t::TEQ:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Runs one instruction symbolically.
+ * @return False if it needs more than is on the stack.
+ */
+static bool execute(sym_state &s, const sym_op &op, terms &t)
+{
+	auto &st = s.stack;
+	if ((int)st.size() < j5::machine::STACK_POP.at(op.code)) return false;
+	const int code = static_cast<int>(op.code);
+	auto pop = [&st]() { int v = st.back(); st.pop_back(); return v; };
+	/* Next and top, in a fixed order for commutative ops */
+	auto args = [&op](int b, int a) {
+		if (commutative(op.code) && a < b) std::swap(a, b);
+		return std::make_pair(b, a);
+	};
+
+	switch (op.code) {
+		case j5::op_t::SET:
+			st.push_back(t.get({terms::OPERAND, op.var}));
+			break;
+		case j5::op_t::DUP:
+			st.push_back(st.back());
+			break;
+		case j5::op_t::DROP:
+			st.pop_back();
+			break;
+		case j5::op_t::SWAP:
+			std::swap(st[st.size() - 1], st[st.size() - 2]);
+			break;
+		case j5::op_t::RSU3: // [t, n, v] -> [v, t, n]
+			std::rotate(st.end() - 3, st.end() - 1, st.end());
+			break;
+		case j5::op_t::RSD3: // [t, n, v] -> [n, v, t]
+			std::rotate(st.end() - 3, st.end() - 2, st.end());
+			break;
+		case j5::op_t::TUCK2: { // [n, v] -> [v, n, v]
+			int v = st.back();
+			st.insert(st.end() - 2, v);
+			break;
+		}
+		case j5::op_t::TUCK3: { // [t, n, v] -> [v, t, n, v]
+			int v = st.back();
+			st.insert(st.end() - 3, v);
+			break;
+		}
+		case j5::op_t::COPY3: // [t, n, v] -> [t, n, v, t]
+			st.push_back(st[st.size() - 3]);
+			break;
+
+		case j5::op_t::ADD:
+		case j5::op_t::SUB: {
+			auto ba = args(st[st.size() - 2], st.back());
+			st.resize(st.size() - 2);
+			st.push_back(t.get({terms::RESULT, code, ba.first, ba.second}));
+			s.carry = t.get({terms::CARRY, code, ba.first, ba.second});
+			break;
+		}
+		case j5::op_t::ADC:
+		case j5::op_t::SBC: {
+			int a = pop();
+			int b = pop();
+			st.push_back(t.get({terms::RESULT, code, b, a, s.carry}));
+			s.carry = t.get({terms::CARRY, code, b, a, s.carry});
+			break;
+		}
+		case j5::op_t::INC:
+		case j5::op_t::DEC: {
+			int a = pop();
+			st.push_back(t.get({terms::RESULT, code, a}));
+			s.carry = t.get({terms::CARRY, code, a});
+			break;
+		}
+		case j5::op_t::NOT:
+			st.back() = t.get({terms::RESULT, code, st.back()});
+			break;
+		case j5::op_t::MUL:
+		case j5::op_t::MULS:
+		case j5::op_t::DIV:
+		case j5::op_t::DIVS: {
+			auto ba = args(st[st.size() - 2], st.back());
+			st.resize(st.size() - 2);
+			st.push_back(t.get({terms::RESULT, code, ba.first, ba.second}));
+			st.push_back(t.get({terms::HIGH, code, ba.first, ba.second}));
+			break;
+		}
+		case j5::op_t::TGT:
+		case j5::op_t::TLT:
+		case j5::op_t::TEQ: {
+			auto ba = args(st[st.size() - 2], st.back());
+			s.zero = t.get({terms::ZERO, code, ba.first, ba.second});
+			break;
+		}
+		case j5::op_t::TSZ:
+			s.zero = t.get({terms::ZERO, code, st.back()});
+			break;
+		case j5::op_t::LOAD:
+			st.back() = t.get({terms::MEMORY, st.back(), s.version});
+			break;
+		case j5::op_t::STORE: {
+			int addr = pop();
+			int val = pop();
+			s.stores.emplace_back(addr, val);
+			s.version++;
+			break;
+		}
+		case j5::op_t::OUT:
+			s.outputs.push_back(st.back());
+			break;
+		default: {
+			if (j5::machine::STACK_DIFF.at(op.code) != -1 || j5::machine::STACK_POP.at(op.code) != 2) {
+				throw "Can't run " + j5::OP_T_STR.at((size_t)op.code) + " symbolically";
+			}
+			/* AND, OR, XOR, shifts, MOD */
+			auto ba = args(st[st.size() - 2], st.back());
+			st.resize(st.size() - 2);
+			st.push_back(t.get({terms::RESULT, code, ba.first, ba.second}));
+			break;
+		}
+	}
+	return true;
+}
+
+/**
+ * Cheapest sequence, shorter than the window, that is equivalent to it.
+ * Every sequence of the stack ops and the window's own instructions is
+ * tried, cheapest first found being kept.
+ */
+class superoptimiser {
+public:
+	explicit superoptimiser(const window &w) : best_cost(cost(w)), target(w)
+	{
+		for (auto code : STACK_OPS) this->alphabet.push_back({code, -1});
+		for (const auto &op : w) {
+			if (std::find(this->alphabet.begin(), this->alphabet.end(), op) == this->alphabet.end()) {
+				this->alphabet.push_back(op);
+			}
+		}
+
+		/* Give it as many inputs as the window needs, so replacements can't reach deeper */
+		int height = 0;
+		int need = 0;
+		for (const auto &op : w) {
+			need = std::max(need, j5::machine::STACK_POP.at(op.code) - height);
+			height += j5::machine::STACK_DIFF.at(op.code);
+		}
+		for (int i = 0; i < need; i++) this->start.stack.push_back(this->t.get({terms::INPUT, i}));
+		this->start.carry = this->t.get({terms::CARRY});
+		this->start.zero = this->t.get({terms::ZERO});
+		this->start.version = 0;
+
+		this->goal = this->start;
+		for (const auto &op : w) {
+			if (!execute(this->goal, op, this->t)) throw "Window " + window_source(w) + " underflows";
+		}
+	}
+
+	/* @return Whether anything cheaper was found */
+	bool run()
+	{
+		window seq;
+		this->search(this->start, seq, 0);
+		return this->best_cost < cost(this->target);
+	}
+
+	window best;
+	size_t best_cost;
+
+private:
+	void search(const sym_state &s, window &seq, size_t seq_cost)
+	{
+		if (s == this->goal && seq_cost < this->best_cost) {
+			this->best = seq;
+			this->best_cost = seq_cost;
+		}
+		if (seq.size() + 1 >= this->target.size()) return;
+		for (const auto &op : this->alphabet) {
+			if (seq_cost + op_cost(op.code) >= this->best_cost) continue;
+			sym_state next = s;
+			if (!execute(next, op, this->t)) continue;
+			seq.push_back(op);
+			this->search(next, seq, seq_cost + op_cost(op.code));
+			seq.pop_back();
+		}
+	}
+
+	const window &target;
+	window alphabet;
+	terms t;
+	sym_state start;
+	sym_state goal;
+};
+
+/* Whether the instruction can be part of a rule */
+static bool rewritable(const j5::instruction &ins)
+{
+	switch (ins.code) {
+		case j5::op_t::BRANCH:
+		case j5::op_t::BRZERO:
+		case j5::op_t::STOP:
+		case j5::op_t::LABEL:
+			return false;
+		default:
+			return true;
+	}
+}
+
+/**
+ * Counts every window of translated code, weighted by how many times its
+ * block ran. Code an IF skips is counted as if it always ran.
+ */
+static void count_windows(const dcpu16::program &prog, std::map<std::string, std::pair<window, size_t>> &windows)
+{
+	std::map<uint16_t, size_t> runs;
+	convertmachine conv;
+	conv.load(prog, OPTIMISE, true);
+	std::ostringstream output;
+	auto old_buf = std::cout.rdbuf(output.rdbuf());
+	try {
+		bool running = true;
+		for (size_t blocks = 0; running && blocks < MAX_BLOCKS; blocks++) {
+			runs[conv.next_pc()]++;
+			running = conv.step();
+		}
+	} catch (...) {
+		std::cout.rdbuf(old_buf);
+		throw;
+	}
+	std::cout.rdbuf(old_buf);
+
+	liveness::analysis live(prog);
+	for (const auto &block : runs) {
+		j5::program code = translate_block(prog, block.first, block_end(prog, block.first), OPTIMISE, &live);
+		for (size_t i = 0; i < code.size(); i++) {
+			window w;
+			std::vector<j5::operand_t> operands;
+			for (size_t k = i; k < code.size() && w.size() < MAX_WINDOW; k++) {
+				/* Only the first instruction of a match may be a branch target */
+				if (!rewritable(code[k]) || (k > i && !code[k].label.empty())) break;
+				int var = -1;
+				if (code[k].code == j5::op_t::SET) {
+					auto pos = std::find(operands.begin(), operands.end(), code[k].op);
+					if (pos == operands.end()) pos = operands.insert(pos, code[k].op);
+					var = std::distance(operands.begin(), pos);
+				}
+				w.push_back({code[k].code, var});
+				if (w.size() < 2) continue;
+				auto &entry = windows[window_source(w)];
+				entry.first = w;
+				entry.second += block.second;
+			}
+		}
+	}
+}
+
+void printUsage(const char *arg0)
+{
+	static const char *USAGE = ""
+		"%s - finds peephole rules for the hottest J5 code\n"
+		"\n"
+		"Usage: %s [-n rules] [-w windows] file...\n"
+		"\n"
+		"Runs each register program through the converter, counting how\n"
+		"often every short sequence of translated code runs. The most run\n"
+		"sequences are searched for cheaper, shorter equivalents, checked\n"
+		"on a symbolic stack and memory. Prints a rule file for -p, with\n"
+		"the built in rules followed by the best of those found.\n"
+		"\n"
+		"-n rules   - Most rules to print (default 20)\n"
+		"-w windows - Number of sequences to search (default 500)\n"
+		"file       - Register programs to take the sequences from\n";
+	printf(USAGE, arg0, arg0);
+}
+
+int main(int argc, char **argv)
+{
+	size_t max_rules = 20;
+	size_t max_windows = 500;
+	int c = 0;
+	while ((c = getopt(argc, argv, "hn:w:")) != -1) {
+		switch (c) {
+			case 'n':
+				max_rules = atoi(optarg);
+				break;
+			case 'w':
+				max_windows = atoi(optarg);
+				break;
+			case 'h':
+				printUsage(argv[0]);
+				return 0;
+			default:
+				printUsage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind == argc) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	try {
+		std::map<std::string, std::pair<window, size_t>> windows;
+		for (int i = optind; i < argc; i++) {
+			std::ifstream file(argv[i]);
+			if (!file) {
+				std::cerr << "Error opening " << argv[i] << '\n';
+				return 1;
+			}
+			std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			count_windows(dcpu16::tokenise_source(source), windows);
+		}
+
+		/* Most time spent in them first */
+		std::vector<const std::pair<window, size_t> *> hottest;
+		for (const auto &w : windows) hottest.push_back(&w.second);
+		std::stable_sort(hottest.begin(), hottest.end(), [](auto a, auto b) {
+			return a->second * cost(a->first) > b->second * cost(b->first);
+		});
+		if (hottest.size() > max_windows) hottest.resize(max_windows);
+
+		struct found {
+			window from;
+			window to;
+			size_t saving; ///< Total cost saved over the runs
+		};
+		std::vector<found> rules;
+		for (auto w : hottest) {
+			superoptimiser opt(w->first);
+			if (!opt.run()) continue;
+			rules.push_back({w->first, opt.best, w->second * (cost(w->first) - opt.best_cost)});
+		}
+		/* Shortest first for the same saving, as they're more general */
+		std::stable_sort(rules.begin(), rules.end(), [](const auto &a, const auto &b) {
+			return a.saving != b.saving ? a.saving > b.saving : a.from.size() < b.from.size();
+		});
+
+		/* Skip any that the rules so far already cover, such as a window
+		 * containing a shorter one that was found first */
+		std::ostringstream os;
+		os << peephole_rules().source();
+		os << "\n; Found by " << argv[0] << " from " << windows.size() << " sequences\n";
+		peephole accepted;
+		size_t count = 0;
+		for (const auto &r : rules) {
+			if (count == max_rules) break;
+			accepted.load(os.str());
+			j5::program code;
+			for (const auto &op : r.from) {
+				code.push_back(j5::make_instruction(op.code, op.var >= 0 ? j5::operand_t(static_cast<uint16_t>(op.var)) : boost::blank()));
+			}
+			if (accepted.run(code).size() < code.size()) continue;
+			os << "; saves " << r.saving << ", cost " << cost(r.from) << " -> " << cost(r.to) << '\n';
+			os << "super" << ++count << ": " << window_source(r.from) << " => " << window_source(r.to) << '\n';
+		}
+
+		peephole check;
+		check.load(os.str());
+		std::cout << os.str();
+	} catch (const char *e) {
+		std::cerr << e << '\n';
+		return 1;
+	} catch (const std::string &e) {
+		std::cerr << e << '\n';
+		return 1;
+	}
+}
@@ -0,0 +1,96 @@
+#include <array>
+#include <atomic>
+#include <boost/functional/hash.hpp>
+#include <mutex>
+#include <unordered_map>
+
+#include "symbol.hpp"
+
+namespace {
+
+struct view_hash {
+	size_t operator()(boost::string_view s) const
+	{
+		return boost::hash_range(s.begin(), s.end());
+	}
+};
+
+/**
+ * Names are interned from tokenising threads and read by every machine, so
+ * reading a name takes no lock. Names are kept in chunks that never move,
+ * found through a table of them that is never reallocated, and a name is
+ * written before its id is handed out. Interning locks only the shard of
+ * ids the name hashes to, so threads seldom wait on each other.
+ */
+struct symbol_pool {
+	static const size_t CHUNK = 1 << 12;
+	static const size_t MAX_CHUNKS = 1 << 12;
+	static const size_t SHARDS = 64;
+
+	struct shard {
+		std::mutex lock;
+		std::unordered_map<boost::string_view, uint32_t, view_hash> ids;
+	};
+
+	std::array<std::atomic<std::string *>, MAX_CHUNKS> chunks{};
+	std::atomic<uint32_t> count{1}; ///< Ids handed out, the empty name's included
+	std::array<shard, SHARDS> shards;
+
+	symbol_pool()
+	{
+		this->chunks[0] = new std::string[CHUNK];
+	}
+
+	/* Where a name goes, adding its chunk if it's the first there */
+	std::string &slot(uint32_t id)
+	{
+		size_t c = id / CHUNK;
+		if (c >= MAX_CHUNKS) throw "Too many symbols";
+		std::string *chunk = this->chunks[c].load(std::memory_order_acquire);
+		if (chunk == nullptr) {
+			std::string *fresh = new std::string[CHUNK];
+			if (this->chunks[c].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) {
+				chunk = fresh;
+			} else {
+				delete[] fresh; // another thread added it first, chunk is theirs
+			}
+		}
+		return chunk[id % CHUNK];
+	}
+};
+
+symbol_pool &pool()
+{
+	static symbol_pool p;
+	return p;
+}
+
+}
+
+symbol::symbol(boost::string_view name)
+{
+	if (name.empty()) return;
+	symbol_pool &p = pool();
+	auto &sh = p.shards[view_hash()(name) % symbol_pool::SHARDS];
+	std::lock_guard<std::mutex> guard(sh.lock);
+	auto it = sh.ids.find(name);
+	if (it != sh.ids.end()) {
+		this->id = it->second;
+		return;
+	}
+	this->id = p.count.fetch_add(1, std::memory_order_relaxed);
+	std::string &stored = p.slot(this->id);
+	stored = name.to_string();
+	sh.ids.emplace(stored, this->id);
+}
+
+const std::string &symbol::str() const
+{
+	const symbol_pool &p = pool();
+	return p.chunks[this->id / symbol_pool::CHUNK].load(std::memory_order_acquire)[this->id % symbol_pool::CHUNK];
+}
+
+std::ostream &operator<<(std::ostream &os, symbol s)
+{
+	return os << s.str();
+}
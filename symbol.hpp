@@ -0,0 +1,67 @@
+#ifndef SYMBOL_HPP
+#define SYMBOL_HPP
+
+#include <boost/utility/string_view.hpp>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+
+/**
+ * A label or symbolic operand. Each distinct name is stored once, in a pool
+ * shared by the whole program, and a symbol is just its index there, so
+ * symbols are small and compare in constant time. The empty name is always
+ * index 0.
+ */
+class symbol {
+public:
+	symbol() = default;
+	symbol(boost::string_view name);
+	symbol(const std::string &name) : symbol(boost::string_view(name)) {}
+	symbol(const char *name) : symbol(boost::string_view(name)) {}
+
+	const std::string &str() const;
+
+	inline bool empty() const
+	{
+		return this->id == 0;
+	}
+	inline void clear()
+	{
+		this->id = 0;
+	}
+	inline uint32_t index() const
+	{
+		return this->id;
+	}
+
+	friend inline bool operator==(symbol a, symbol b)
+	{
+		return a.id == b.id;
+	}
+	friend inline bool operator!=(symbol a, symbol b)
+	{
+		return a.id != b.id;
+	}
+	/* Order of first use rather than alphabetical, only for keying maps */
+	friend inline bool operator<(symbol a, symbol b)
+	{
+		return a.id < b.id;
+	}
+private:
+	uint32_t id = 0;
+};
+
+std::ostream &operator<<(std::ostream &os, symbol s);
+
+namespace std {
+template<>
+struct hash<symbol> {
+	size_t operator()(symbol s) const
+	{
+		return s.index();
+	}
+};
+}
+
+#endif /* SYMBOL_HPP */
@@ -11,7 +11,7 @@ FILEPATH = 'examples/{}.{}'
 
 REGISTER_PROGS = ['test1', 'test2', 'bsort']
 STACK_PROGS = ['loop']
-CONVERSIONS = ['simple', 'loop', 'redundant', 'bsort', 'fib20', 'primes', 'tri100']
+CONVERSIONS = ['simple', 'loop', 'redundant', 'dataflow', 'arith', 'bsort', 'fib20', 'primes', 'tri100', 'vecadd']
 
 def get_prog(name, typerun, add_args=None, verbose=0):
     """Builds the list of commandline args for a test program
@@ -52,6 +52,13 @@ def print_metric(output):
 
     print("Trace count:", len(traces))
     print("Trace LOAD/STORE count:", len(traces_loadstore))
+    return len(traces_loadstore)
+
+def print_reduction(base, count):
+    """Prints the LOAD/STORE reduction relative to an unoptimised run
+    """
+    if base > 0:
+        print("LOAD/STORE reduction: {:.1f}%".format(100 * (base - count) / base))
 
 for p in REGISTER_PROGS:
     ret = run_prog(get_prog(p, 'r'))
@@ -89,10 +96,24 @@ for p in CONVERSIONS:
         print(retconv.stdout, '!=', retconv_o2.stdout)
         break
 
+    # Tiny snippet cache, forces eviction & retranslation
+    retconv_m = run_prog(get_prog(p, 'c', ['-o2', '-m256']))
+    if retconv.stdout != retconv_m.stdout:
+        print('Bounded cache result not equal!')
+        print(retconv.stdout, '!=', retconv_m.stdout)
+        break
+
+    # Peephole rules from a file
+    retconv_p = run_prog(get_prog(p, 'c', ['-o2', '-pexamples/peephole.rules']))
+    if retconv.stdout != retconv_p.stdout:
+        print('Rule file result not equal!')
+        print(retconv.stdout, '!=', retconv_p.stdout)
+        break
+
     # Call metric tests
     retconv_o0_v2 = run_prog(get_prog(p, 'c', ['-o0'], verbose=2))
-    print_metric(retconv_o0_v2.stdout)
+    memops_o0 = print_metric(retconv_o0_v2.stdout)
     retconv_o1_v2 = run_prog(get_prog(p, 'c', ['-o1'], verbose=2))
-    print_metric(retconv_o1_v2.stdout)
+    print_reduction(memops_o0, print_metric(retconv_o1_v2.stdout))
     retconv_o2_v2 = run_prog(get_prog(p, 'c', ['-o2'], verbose=2))
-    print_metric(retconv_o2_v2.stdout)
+    print_reduction(memops_o0, print_metric(retconv_o2_v2.stdout))
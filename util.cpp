@@ -1,22 +1,107 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "util.hpp"
 
-std::vector<std::string> split_words(const std::string &line)
+/**
+ * Splits a line into words, on whitespace and commas, up to any ; comment.
+ * Quoted strings are kept whole.
+ * @param words Set to views into the line, reusing its storage.
+ */
+void split_words(boost::string_view line, std::vector<boost::string_view> &words)
 {
-	// Parse into separate words
-	std::vector<std::string> words;
-	bool inword = false;
+	words.clear();
 	bool inquote = false;
-	for (char c : line) {
+	size_t start = boost::string_view::npos;
+	size_t i = 0;
+	for (; i < line.size(); i++) {
+		char c = line[i];
 		if (c == ';') break; // comment
 		if (c == '"') inquote = !inquote;
 		if (!inquote && (isspace(c) || c == ',')) {
-			inword = false;
-			continue;
-		} else if (!inword) {
-			words.emplace_back(); // start next word
+			if (start != boost::string_view::npos) words.push_back(line.substr(start, i - start));
+			start = boost::string_view::npos;
+		} else if (start == boost::string_view::npos) {
+			start = i; // start next word
 		}
-		words.back().push_back(c);
-		inword = true;
 	}
+	if (start != boost::string_view::npos) words.push_back(line.substr(start, i - start));
+}
+
+std::vector<std::string> split_words(const std::string &line)
+{
+	std::vector<boost::string_view> views;
+	split_words(line, views);
+	std::vector<std::string> words;
+	for (auto w : views) words.push_back(w.to_string());
 	return words;
 }
+
+/**
+ * Parses a number without copying it out first. Numbers too big for 16
+ * bits wrap around.
+ * @return False if it isn't all digits of the base.
+ */
+bool parse_number(boost::string_view digits, unsigned base, uint16_t &value)
+{
+	if (digits.empty()) return false;
+	uint16_t v = 0;
+	for (char c : digits) {
+		unsigned d;
+		if (c >= '0' && c <= '9') {
+			d = c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			d = c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			d = c - 'A' + 10;
+		} else {
+			return false;
+		}
+		if (d >= base) return false;
+		v = static_cast<uint16_t>(v * base + d);
+	}
+	value = v;
+	return true;
+}
+
+mapped_file::mapped_file(const std::string &filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) throw "Error opening " + filename;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw "Error reading " + filename;
+	}
+	this->size = st.st_size;
+	if (this->size > 0) {
+		void *addr = mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr == MAP_FAILED) {
+			close(fd);
+			throw "Error reading " + filename;
+		}
+		this->data = static_cast<const char *>(addr);
+	}
+	close(fd);
+}
+
+/**
+ * Whether a source has to be read as it comes rather than mapped, i.e. it
+ * is stdin ("-"), a pipe or a terminal.
+ * @param filename Path given on the command line.
+ * @return True if the source is a stream.
+ */
+bool is_stream(const std::string &filename)
+{
+	if (filename == "-") return true;
+	struct stat st;
+	if (stat(filename.c_str(), &st) != 0) return false;
+	return S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode);
+}
+
+mapped_file::~mapped_file()
+{
+	if (this->data != nullptr) munmap(const_cast<char *>(this->data), this->size);
+}
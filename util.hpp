@@ -2,12 +2,99 @@
 #define UTIL_HPP
 
 #include <algorithm>
+#include <boost/utility/string_view.hpp>
+#include <cstdint>
+#include <future>
 #include <iostream>
+#include <iterator>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
+void split_words(boost::string_view line, std::vector<boost::string_view> &words);
 std::vector<std::string> split_words(const std::string &line);
+bool parse_number(boost::string_view digits, unsigned base, uint16_t &value);
+bool is_stream(const std::string &filename);
+
+/**
+ * Calls f with each line of some source, without the newline. The last
+ * line doesn't need one to be counted.
+ */
+template<typename F>
+void for_each_line(boost::string_view source, F f)
+{
+	while (!source.empty()) {
+		size_t pos = source.find('\n');
+		f(source.substr(0, pos));
+		if (pos == boost::string_view::npos) break;
+		source.remove_prefix(pos + 1);
+	}
+}
+
+/**
+ * Tokenises a source in chunks split at line boundaries, one per thread, and
+ * joins the results in order. Sources too small to be worth the threads are
+ * done on the calling thread. An error is rethrown from the first chunk it
+ * happened in, so it's the same one a single thread would give.
+ * @param source Whole source text.
+ * @param threads Number of chunks at most, 0 for one per core.
+ * @param tokenise Tokenises a run of whole lines into a program, given the
+ *                 line number of the first.
+ * @return The program for the whole source.
+ */
+template<typename Program, typename F>
+Program tokenise_chunks(boost::string_view source, size_t threads, F tokenise)
+{
+	static const size_t MIN_CHUNK = 1 << 16; ///< Bytes, below this a thread costs more than it saves
+
+	if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = std::min(threads, source.size() / MIN_CHUNK);
+	if (threads <= 1) return tokenise(source, 1);
+
+	std::vector<std::future<Program>> chunks;
+	size_t chunk_size = source.size() / threads;
+	uint32_t first_line = 1;
+	while (!source.empty()) {
+		size_t end = source.size();
+		if (chunks.size() + 1 < threads) {
+			end = source.find('\n', chunk_size);
+			end = end == boost::string_view::npos ? source.size() : end + 1;
+		}
+		boost::string_view chunk = source.substr(0, end);
+		chunks.push_back(std::async(std::launch::async, tokenise, chunk, first_line));
+		first_line += std::count(chunk.begin(), chunk.end(), '\n');
+		source.remove_prefix(end);
+	}
+
+	Program prog = chunks.front().get();
+	for (auto it = chunks.begin() + 1; it != chunks.end(); ++it) {
+		Program part = it->get();
+		prog.reserve(prog.size() + part.size());
+		std::move(part.begin(), part.end(), std::back_inserter(prog));
+	}
+	return prog;
+}
+
+/**
+ * A file mapped read only into memory, for tokenising in place rather than
+ * copying it into a string first.
+ */
+class mapped_file {
+public:
+	explicit mapped_file(const std::string &filename);
+	~mapped_file();
+	mapped_file(const mapped_file &) = delete;
+	mapped_file &operator=(const mapped_file &) = delete;
+
+	inline boost::string_view text() const
+	{
+		return boost::string_view(this->data, this->size);
+	}
+private:
+	const char *data = nullptr;
+	size_t size = 0;
+};
 
 template<typename... Args>
 std::string string_format(const std::string& format, Args... args)
@@ -18,7 +105,7 @@ std::string string_format(const std::string& format, Args... args)
 	return std::string(buf.get(), buf.get() + size - 1); // We don't want the '\0' inside
 }
 
-inline bool is_hex(const std::string &s)
+inline bool is_hex(boost::string_view s)
 {
 	return std::all_of(s.begin(), s.end(), ::isxdigit);
 }